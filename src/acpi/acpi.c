@@ -4,6 +4,8 @@
 #include <stddef.h> // For size_t and NULL
 #include <stdint.h> // For uint32_t, uint8_t, etc.
 
+static acpi_rsdt_t* acpi_rsdt = NULL;
+
 // Function to print a pointer in hexadecimal format
 void print_pointer(void* ptr) {
     print("0x");
@@ -68,6 +70,7 @@ void acpi_parse_rsdp(acpi_rsdp_t *rsdp) {
     print("\n");
     
     // Parse the RSDT
+    acpi_rsdt = (acpi_rsdt_t *)rsdp->rsdt_address;
     acpi_rsdt_t *rsdt = (acpi_rsdt_t *)rsdp->rsdt_address;
     acpi_parse_rsdt(rsdt);
 }
@@ -84,3 +87,69 @@ void acpi_parse_rsdt(acpi_rsdt_t *rsdt) {
     
     // Further parsing of entries can be done here
 }
+
+static int acpi_checksum_ok(acpi_sdt_header_t* header) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < header->length; i++) {
+        sum += ((uint8_t*)header)[i];
+    }
+    return sum == 0;
+}
+
+// Find a table by signature, the RSDT holds 32-bit pointers after its header
+acpi_sdt_header_t* acpi_find_table(const char* signature) {
+    if (!acpi_rsdt) {
+        acpi_rsdp_t* rsdp = find_rsdp();
+        if (!rsdp) {
+            return NULL;
+        }
+        acpi_rsdt = (acpi_rsdt_t*)rsdp->rsdt_address;
+    }
+
+    uint32_t entries = (acpi_rsdt->length - sizeof(acpi_rsdt_t)) / 4;
+    uint32_t* tables = (uint32_t*)((uint8_t*)acpi_rsdt + sizeof(acpi_rsdt_t));
+
+    for (uint32_t i = 0; i < entries; i++) {
+        acpi_sdt_header_t* header = (acpi_sdt_header_t*)tables[i];
+        if (header->signature[0] == signature[0] && header->signature[1] == signature[1] &&
+            header->signature[2] == signature[2] && header->signature[3] == signature[3]) {
+            return acpi_checksum_ok(header) ? header : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Walk the MADT entries for enabled processors and the I/O APIC
+int acpi_parse_madt(acpi_madt_info_t* info) {
+    acpi_madt_t* madt = (acpi_madt_t*)acpi_find_table("APIC");
+    if (!madt || !info) {
+        return 0;
+    }
+
+    info->lapic_address = madt->lapic_address;
+    info->cpu_count = 0;
+    info->ioapic_address = 0;
+
+    uint8_t* entry = (uint8_t*)madt + sizeof(acpi_madt_t);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+
+    while (entry + sizeof(acpi_madt_entry_t) <= end) {
+        acpi_madt_entry_t* header = (acpi_madt_entry_t*)entry;
+        if (header->length < sizeof(acpi_madt_entry_t)) {
+            break; // Malformed, stop rather than loop forever
+        }
+
+        if (header->type == ACPI_MADT_LAPIC) {
+            acpi_madt_lapic_t* lapic = (acpi_madt_lapic_t*)entry;
+            if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) && info->cpu_count < ACPI_MAX_CPUS) {
+                info->apic_ids[info->cpu_count++] = lapic->apic_id;
+            }
+        } else if (header->type == ACPI_MADT_IOAPIC && !info->ioapic_address) {
+            info->ioapic_address = ((acpi_madt_ioapic_t*)entry)->ioapic_address;
+        }
+
+        entry += header->length;
+    }
+
+    return info->cpu_count > 0;
+}
@@ -23,8 +23,8 @@ typedef struct {
 typedef struct {
     char signature[4];          // "RSDT"
     uint32_t length;            // Length of the table
-    uint32_t revision;          // Revision of the table
-    uint32_t checksum;          // Checksum of the table
+    uint8_t revision;           // Revision of the table
+    uint8_t checksum;           // Checksum of the table
     char oem_id[6];             // OEM ID
     char oem_table_id[8];       // OEM Table ID
     uint32_t oem_revision;       // OEM Revision
@@ -33,13 +33,71 @@ typedef struct {
     // Table entries follow
 } acpi_rsdt_t;
 
+// Every table the RSDT points at starts with the same header
+typedef acpi_rsdt_t acpi_sdt_header_t;
+
+// MADT ("APIC") fixed part, interrupt controller entries follow
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;     // Physical address of each CPU's local APIC
+    uint32_t flags;             // Bit 0: legacy 8259 pair present
+} acpi_madt_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} acpi_madt_entry_t;
+
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_IOAPIC        1
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+
+// Type 0: one per processor
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} acpi_madt_lapic_t;
+
+// Type 1: one per I/O APIC
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t ioapic_address;
+    uint32_t gsi_base;
+} acpi_madt_ioapic_t;
+
 #pragma pack(pop) // Restore previous packing
 
+#define ACPI_MAX_CPUS 8
+
+// What the SMP bring-up needs out of the MADT
+typedef struct {
+    uint32_t lapic_address;
+    uint32_t cpu_count;                 // Enabled processors, boot CPU included
+    uint8_t apic_ids[ACPI_MAX_CPUS];
+    uint32_t ioapic_address;            // 0 when none is listed
+} acpi_madt_info_t;
+
 // Function declarations
 void acpi_init(void);
 void acpi_parse_rsdp(acpi_rsdp_t *rsdp);
 void acpi_parse_rsdt(acpi_rsdt_t *rsdt);
 acpi_rsdp_t* find_rsdp(void);
+
+/**
+ * @brief Looks up a table by its 4 character signature through the RSDT.
+ * @return The table header, NULL if the table is missing or fails its checksum.
+ */
+acpi_sdt_header_t* acpi_find_table(const char* signature);
+
+/**
+ * @brief Collects the enabled processors and APIC addresses from the MADT.
+ * @return 1 on success, 0 when there is no usable MADT.
+ */
+int acpi_parse_madt(acpi_madt_info_t* info);
 void print_pointer(void* ptr);
 
 #endif // ACPI_H
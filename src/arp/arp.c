@@ -4,6 +4,9 @@
 #include "../utility/utility.h" // For memcpy, memset, etc.
 #include "../rtl8139/rtl8139.h"
 #include "../timers/timer.h"
+#include "../timers/timer_wheel.h"
+#include "../timers/tick.h"
+#include "../scheduler/task.h"
 // Ethernet frame header size
 #define ETH_HEADER_SIZE 14
 
@@ -161,6 +164,25 @@ void arp_handle_packet(const uint8_t *packet_data, uint16_t length) {
     }
 }
 
+// Outstanding resolution, retransmitted from the timer wheel
+static timer_list_t arp_retry_timer;
+static uint8_t arp_pending_ip[ARP_PLEN_IPV4];
+static volatile int arp_retries_left;
+
+static void arp_retry_callback(uint32_t data) {
+    (void)data;
+    
+    if (arp_retries_left <= 0) {
+        return;
+    }
+    
+    arp_retries_left--;
+    if (arp_retries_left > 0) {
+        arp_send_request(my_mac, my_ip, arp_pending_ip);
+        mod_timer(&arp_retry_timer, ticks + ARP_RESOLVE_RETRY_MS);
+    }
+}
+
 bool arp_resolve(const uint8_t *ip, uint8_t *mac_out) {
     if (!ip || !mac_out) {
         return false;
@@ -169,15 +191,28 @@ bool arp_resolve(const uint8_t *ip, uint8_t *mac_out) {
     if (arp_cache_lookup(ip, mac_out)) {
         return true;
     }
-    // Not in cache, send ARP request
+    // Not in cache, send ARP request and let the timer resend it
+    memcpy(arp_pending_ip, ip, ARP_PLEN_IPV4);
+    arp_retries_left = ARP_RESOLVE_MAX_RETRIES;
+    setup_timer(&arp_retry_timer, arp_retry_callback, 0);
     arp_send_request(my_mac, my_ip, ip);
-    // Wait and poll cache for reply
-    for (int i = 0; i < ARP_RESOLVE_MAX_RETRIES; i++) {
-        delay_ms(ARP_RESOLVE_RETRY_MS);
+    mod_timer(&arp_retry_timer, ticks + ARP_RESOLVE_RETRY_MS);
+    
+    // Halt between checks, the NIC interrupt or the next retry wakes us
+    while (arp_retries_left > 0) {
         if (arp_cache_lookup(ip, mac_out)) {
+            del_timer(&arp_retry_timer);
+            arp_retries_left = 0;
             return true;
         }
+        disable_interrupts();
+        if (arp_retries_left > 0) {
+            task_idle_wait();
+        } else {
+            enable_interrupts();
+        }
     }
+    
     // Failed to resolve
-    return false;
+    return arp_cache_lookup(ip, mac_out);
 }
\ No newline at end of file
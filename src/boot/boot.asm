@@ -2,7 +2,8 @@
 
 section .multiboot
 	MB_MAGIC    equ 0x1BADB002
-	MB_FLAGS    equ 0
+	MB_ALIGN    equ 1 << 0 ; load modules on page boundaries
+	MB_FLAGS    equ MB_ALIGN
 	MB_CHECKSUM equ -(MB_MAGIC + MB_FLAGS)
 
 	dd MB_MAGIC
@@ -22,8 +23,9 @@ section .text
 global _start
 _start:
     mov esp, stack_bottom
-    mov ebx, [esp + 4]  ; multiboot info pointer passed by bootloader
+    ; the bootloader leaves its magic in eax and the multiboot info in ebx
     push ebx
+    push eax
 	extern kernel_main
     call kernel_main
     cli
@@ -54,6 +56,11 @@ load_gdt:
 
 ; gets called for ALL interrupts
 isr_common:
+	; interrupted kernel code already runs on the kernel data segments,
+	; only a ring 3 frame needs them saved and reloaded
+	test dword [esp + 12], 3 ; CS of the interrupted code
+	jz .kernel
+
 	; push registers to match struct TrapFrame (in reverse order)
 	pushad
 	push ds
@@ -81,6 +88,18 @@ isr_common:
 	add esp, 8      ; pop error code and interrupt number
 	iret            ; pops (CS, EIP, EFLAGS) and also (SS, ESP) if privilege change occurs
 
+.kernel:
+	; same TrapFrame layout, the segment slots are left unset
+	pushad
+	sub esp, 16
+
+	call handle_interrupt
+
+	add esp, 16
+	popad
+	add esp, 8
+	iret
+
 ; generate isr stubs that jump to isr_common, in order to get a consistent stack frame
 
 %macro ISR_ERROR_CODE 1
@@ -150,6 +169,11 @@ ISR_NO_ERROR_CODE 45
 ISR_NO_ERROR_CODE 46
 ISR_NO_ERROR_CODE 47
 
+; LAPIC timer, reschedule IPI and spurious interrupt
+ISR_NO_ERROR_CODE 48
+ISR_NO_ERROR_CODE 49
+ISR_NO_ERROR_CODE 255
+
 ; syscall 0x80
 global isr128
 ISR_NO_ERROR_CODE 128
@@ -187,6 +211,9 @@ switch_context:
 	; swap kernel stack pointer and store them
 	mov [eax + 4], esp ; from->kesp = esp
 	mov esp, [edx + 4] ; esp = to->kesp
+
+	; from's stack is no longer in use, another CPU may pick it up now
+	mov dword [eax + 8], 0 ; from->on_cpu = 0
 	
 	; NewTaskKernelStack will match the stack from here on out.
 
@@ -216,4 +243,62 @@ new_task_setup:
 	xor ebp, ebp
 
 	; exit the interrupt, placing us in the real task entry function
-	iret
\ No newline at end of file
+	iret
+
+; ----- SMP trampoline -----
+
+; Copied to 0x8000 by smp_init. An application processor starts here in real
+; mode after the startup IPI, so everything before the far jump has to use
+; addresses relative to the copy.
+AP_TRAMPOLINE_BASE equ 0x8000
+%define AP_REL(label) (AP_TRAMPOLINE_BASE + (label - ap_trampoline_start))
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_stack
+
+bits 16
+ap_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+	lgdt [AP_REL(ap_gdt_pointer)]
+
+	mov eax, cr0
+	or eax, 1
+	mov cr0, eax
+	jmp dword 0x08:AP_REL(ap_protected)
+
+bits 32
+ap_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; absolute addresses from here on, the kernel image is identity mapped
+	mov esp, [ap_stack]
+	extern ap_main
+	mov eax, ap_main
+	call eax
+	cli
+.hang:
+	hlt
+	jmp .hang
+
+; flat code and data, replaced by the kernel GDT in ap_main
+ap_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF
+	dq 0x00CF92000000FFFF
+ap_gdt_pointer:
+	dw ap_gdt_pointer - ap_gdt - 1
+	dd AP_REL(ap_gdt)
+ap_trampoline_end:
+
+section .data
+ap_stack:
+	dd 0 ; top of the idle stack for the AP being started
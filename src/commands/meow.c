@@ -2,11 +2,17 @@
 #include "../errors/error.h"
 #include "../keyboard/keyboard.h"
 #include "../memory/memory.h"
+#include "../cpu/cpu.h"
+#include "../utility/bench.h"
 #include "meow.h"
-#define BF_MEMORY_SIZE 30000
-#define BF_STACK_SIZE 1000
-#define BF_INPUT_SIZE 1000
 
+#define BF_BENCH_RUNS 3
+
+static bf_state_t static_bf_state;
+static char static_bf_memory[BF_MEMORY_SIZE];
+static int static_bf_stack[BF_STACK_SIZE];
+static char static_bf_input[256];
+static int bf_state_in_use = 0;
 
 bf_state_t* bf_init() {
     if (bf_state_in_use) {
@@ -21,7 +27,7 @@ bf_state_t* bf_init() {
     static_bf_state.input_buffer = static_bf_input;
     
     // Initialize memory
-    for (int i = 0; i < 1000; i++) {
+    for (int i = 0; i < BF_MEMORY_SIZE; i++) {
         static_bf_memory[i] = 0;
     }
     
@@ -30,10 +36,15 @@ bf_state_t* bf_init() {
     static_bf_state.stack_ptr = 0;
     static_bf_state.input_ptr = 0;
     static_bf_state.input_length = 0;
+    static_bf_state.program_size = 0;
+    static_bf_state.quiet = false;
+    static_bf_state.output_length = 0;
+    static_bf_state.jit_enabled = false;
     
     return &static_bf_state;
 }
 void bf_cleanup(bf_state_t* state) {
+    // The compiled code buffer is kept for the next program
     bf_state_in_use = 0;
 }
 // Find matching bracket
@@ -58,8 +69,9 @@ int find_matching_bracket(char* code, int pos, int length, char open, char close
     return (bracket_count == 0) ? pos : -1;
 }
 
-// Execute Brainfuck code
-int bf_execute(bf_state_t* state) {
+// Reference interpreter working on the source one character at a time, kept
+// so bench has something to measure the compiled code against
+static int bf_interpret(bf_state_t* state) {
     while (state->code_ptr < state->code_length) {
         char instruction = state->code[state->code_ptr];
         
@@ -91,7 +103,7 @@ int bf_execute(bf_state_t* state) {
             case '.':
                 // Output character
                 char output[2] = {state->memory[state->data_ptr], '\0'};
-                print(output);
+                if (!state->quiet) print(output);
                 break;
                 
             case ',':
@@ -102,7 +114,7 @@ int bf_execute(bf_state_t* state) {
                 } else {
                     // Get more input
                     print("Input: ");
-                    char temp_input[256];
+                    char temp_input[COMMAND_BUFFER_SIZE];
                     keyboard_input(temp_input);
                     if (strlen(temp_input) > 0) {
                         state->memory[state->data_ptr] = temp_input[0];
@@ -159,13 +171,416 @@ int bf_execute(bf_state_t* state) {
     return 0;
 }
 
+// Net pointer movement and cell changes of a loop body made of + - < >
+// only, as in [->+<]. Returns the index of its ] or -1 when the body has
+// anything else or touches too many cells
+static int bf_scan_loop(const char* code, int pos, int length, int* offsets, int* deltas,
+                        int* count, int* moved) {
+    int ptr = 0;
+    *count = 0;
+    
+    for (pos++; pos < length; pos++) {
+        char c = code[pos];
+        if (c == ']') {
+            *moved = ptr;
+            return pos;
+        }
+        if (c == '>' || c == '<') {
+            ptr += c == '>' ? 1 : -1;
+            continue;
+        }
+        if (c != '+' && c != '-') {
+            if (BF_IS_VALID_INSTRUCTION(c)) return -1;
+            continue;
+        }
+        
+        int slot = 0;
+        while (slot < *count && offsets[slot] != ptr) slot++;
+        if (slot == *count) {
+            if (*count == BF_MAX_LOOP_OFFSETS) return -1;
+            offsets[slot] = ptr;
+            deltas[slot] = 0;
+            (*count)++;
+        }
+        deltas[slot] += c == '+' ? 1 : -1;
+    }
+    return -1;
+}
+
+static void bf_emit(bf_state_t* state, uint8_t op, uint8_t value, int32_t arg) {
+    bf_instruction_t* instr = &state->program[state->program_size++];
+    instr->op = op;
+    instr->value = value;
+    instr->arg = arg;
+}
+
+// Emits the loop starting at code[pos] as clear, multiply or scan when it is
+// one. Returns the index of its ], or -1 to compile it as a plain loop
+static int bf_compile_idiom(bf_state_t* state, int pos) {
+    int offsets[BF_MAX_LOOP_OFFSETS];
+    int deltas[BF_MAX_LOOP_OFFSETS];
+    int count, moved;
+    
+    int end = bf_scan_loop(state->code, pos, state->code_length, offsets, deltas, &count, &moved);
+    if (end < 0) {
+        return -1;
+    }
+    
+    // [>] [<<] and friends: only moves
+    bool changes = false;
+    for (int i = 0; i < count; i++) {
+        if (deltas[i] & 0xFF) changes = true;
+    }
+    if (!changes) {
+        if (moved == 0) return -1;     // [] spins forever, keep that
+        bf_emit(state, BF_OP_SCAN, 0, moved);
+        return end;
+    }
+    
+    // The loop cell has to step by one each round for the count to be the
+    // cell itself, and every other cell gets a multiple of it
+    int step = 0;
+    for (int i = 0; i < count; i++) {
+        if (offsets[i] == 0) step = deltas[i] & 0xFF;
+    }
+    if (moved != 0 || (step != 0xFF && step != 1)) {
+        return -1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (offsets[i] == 0 || (deltas[i] & 0xFF) == 0) continue;
+        // Counting up from v takes 256 - v rounds, so the factor flips sign
+        int factor = step == 0xFF ? deltas[i] : -deltas[i];
+        bf_emit(state, BF_OP_MUL_ADD, (uint8_t) factor, offsets[i]);
+    }
+    bf_emit(state, BF_OP_CLEAR, 0, 0);
+    return end;
+}
+
+int bf_compile(bf_state_t* state) {
+    const char* code = state->code;
+    int length = state->code_length;
+    
+    // Every character makes at most one operation, plus the end marker
+    uint32_t pages = ((length + 1) * sizeof(bf_instruction_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!state->program || state->program_pages < pages) {
+        if (state->program) {
+            free_contiguous_pages((uint32_t) state->program, state->program_pages);
+        }
+        state->program_pages = 0;
+        state->program = (bf_instruction_t*) allocate_contiguous_pages(pages);
+        if (!state->program) {
+            return BF_ERROR_NO_MEMORY;
+        }
+        state->program_pages = pages;
+    }
+    
+    state->program_size = 0;
+    int depth = 0;
+    
+    for (int pos = 0; pos < length; pos++) {
+        char c = code[pos];
+        
+        switch (c) {
+            case '+':
+            case '-': {
+                int amount = 0;
+                for (; pos < length && code[pos] != '>' && code[pos] != '<' && code[pos] != '.' &&
+                       code[pos] != ',' && code[pos] != '[' && code[pos] != ']'; pos++) {
+                    if (code[pos] == '+') amount++;
+                    else if (code[pos] == '-') amount--;
+                }
+                pos--;
+                if (amount & 0xFF) {
+                    bf_emit(state, BF_OP_ADD, (uint8_t) amount, 0);
+                }
+                break;
+            }
+            
+            case '>':
+            case '<': {
+                int distance = 0;
+                for (; pos < length && code[pos] != '+' && code[pos] != '-' && code[pos] != '.' &&
+                       code[pos] != ',' && code[pos] != '[' && code[pos] != ']'; pos++) {
+                    if (code[pos] == '>') distance++;
+                    else if (code[pos] == '<') distance--;
+                }
+                pos--;
+                if (distance) {
+                    bf_emit(state, BF_OP_MOVE, 0, distance);
+                }
+                break;
+            }
+            
+            case '.':
+                bf_emit(state, BF_OP_OUTPUT, 0, 0);
+                break;
+                
+            case ',':
+                bf_emit(state, BF_OP_INPUT, 0, 0);
+                break;
+                
+            case '[': {
+                int end = bf_compile_idiom(state, pos);
+                if (end >= 0) {
+                    pos = end;
+                    break;
+                }
+                if (depth >= BF_STACK_SIZE) {
+                    return BF_ERROR_STACK_OVERFLOW;
+                }
+                state->loop_stack[depth++] = state->program_size;
+                bf_emit(state, BF_OP_OPEN, 0, 0);
+                break;
+            }
+            
+            case ']': {
+                if (depth == 0) {
+                    return BF_ERROR_UNMATCHED_BRACKET;
+                }
+                int open = state->loop_stack[--depth];
+                state->program[open].arg = state->program_size + 1;
+                bf_emit(state, BF_OP_CLOSE, 0, open + 1);
+                break;
+            }
+            
+            default:
+                // Ignore non-Brainfuck characters (comments)
+                break;
+        }
+    }
+    
+    if (depth != 0) {
+        return BF_ERROR_UNMATCHED_BRACKET;
+    }
+    bf_emit(state, BF_OP_END, 0, 0);
+    return BF_SUCCESS;
+}
+
+// Runs the compiled program from the start
+static int bf_run_program(bf_state_t* state) {
+    bf_instruction_t* program = state->program;
+    uint8_t* cells = (uint8_t*) state->memory;
+    int ptr = state->data_ptr;
+    int pc = 0;
+    int status = BF_SUCCESS;
+    
+    while (true) {
+        bf_instruction_t* instr = &program[pc++];
+        
+        switch (instr->op) {
+            case BF_OP_END:
+                goto out;
+                
+            case BF_OP_ADD:
+                cells[ptr] += instr->value;
+                break;
+                
+            case BF_OP_MOVE:
+                ptr += instr->arg;
+                if ((uint32_t) ptr >= BF_MEMORY_SIZE) {
+                    status = ptr < 0 ? BF_ERROR_MEMORY_UNDERFLOW : BF_ERROR_MEMORY_OVERFLOW;
+                    goto out;
+                }
+                break;
+                
+            case BF_OP_OUTPUT:
+                // A zero cell prints nothing, as with print() per character
+                if (cells[ptr]) {
+                    state->output[state->output_length++] = cells[ptr];
+                    if (state->output_length == BF_OUTPUT_SIZE) {
+                        bf_flush_output(state);
+                    }
+                }
+                break;
+            
+            case BF_OP_INPUT:
+                cells[ptr] = bf_read_input(state);
+                break;
+                
+            case BF_OP_OPEN:
+                if (cells[ptr] == 0) pc = instr->arg;
+                break;
+                
+            case BF_OP_CLOSE:
+                if (cells[ptr] != 0) pc = instr->arg;
+                break;
+                
+            case BF_OP_CLEAR:
+                cells[ptr] = 0;
+                break;
+                
+            case BF_OP_MUL_ADD:
+                // The loop never ran its body for a zero cell, so neither
+                // does the bounds check
+                if (cells[ptr]) {
+                    int target = ptr + instr->arg;
+                    if ((uint32_t) target >= BF_MEMORY_SIZE) {
+                        status = target < 0 ? BF_ERROR_MEMORY_UNDERFLOW : BF_ERROR_MEMORY_OVERFLOW;
+                        goto out;
+                    }
+                    cells[target] += cells[ptr] * instr->value;
+                }
+                break;
+                
+            case BF_OP_SCAN:
+                while (cells[ptr]) {
+                    ptr += instr->arg;
+                    if ((uint32_t) ptr >= BF_MEMORY_SIZE) {
+                        status = ptr < 0 ? BF_ERROR_MEMORY_UNDERFLOW : BF_ERROR_MEMORY_OVERFLOW;
+                        goto out;
+                    }
+                }
+                break;
+        }
+    }
+    
+out:
+    bf_flush_output(state);
+    state->data_ptr = ptr < 0 ? 0 : (ptr >= BF_MEMORY_SIZE ? BF_MEMORY_SIZE - 1 : ptr);
+    return status;
+}
+
+void bf_flush_output(bf_state_t* state) {
+    if (state->output_length == 0) {
+        return;
+    }
+    state->output[state->output_length] = '\0';
+    if (!state->quiet) {
+        print(state->output);
+    }
+    state->output_length = 0;
+}
+
+uint8_t bf_read_input(bf_state_t* state) {
+    if (state->input_ptr < state->input_length) {
+        return state->input_buffer[state->input_ptr++];
+    }
+    
+    bf_flush_output(state);
+    print("Input: ");
+    char temp_input[COMMAND_BUFFER_SIZE];
+    keyboard_input(temp_input);
+    return temp_input[0];
+}
+
+// Execute Brainfuck code
+int bf_execute(bf_state_t* state) {
+    int result = bf_compile(state);
+    if (result != BF_SUCCESS) {
+        return result;
+    }
+    if (state->jit_enabled) {
+        result = bf_jit_compile(state);
+        return result == BF_SUCCESS ? bf_jit_run(state) : result;
+    }
+    return bf_run_program(state);
+}
+
+const char* bf_get_error_string(int error_code) {
+    switch (error_code) {
+        case BF_SUCCESS: return "Success";
+        case BF_ERROR_MEMORY_OVERFLOW: return "Memory pointer overflow";
+        case BF_ERROR_MEMORY_UNDERFLOW: return "Memory pointer underflow";
+        case BF_ERROR_UNMATCHED_BRACKET: return "Unmatched bracket";
+        case BF_ERROR_STACK_OVERFLOW: return "Loops nested too deep";
+        case BF_ERROR_INIT_FAILED: return "Initialization failed";
+        case BF_ERROR_NO_MEMORY: return "Out of memory for the compiled program";
+        default: return "Unknown error";
+    }
+}
+
+// Nested loops with copies and long runs, the shapes compiled code is
+// good at and the character interpreter is not. Prints a single 'A'
+static const char* bf_bench_program =
+    "++++++++[>++++++++<-]>[>++++[>++++++++[>++++++++[>+>++<<-]>>[<<+>>-]<<<-]<-]<-]"
+    ">>>>>>>++++++++[<++++++++>-]<+.";
+
+static void bf_bench_reset(void* arg) {
+    bf_state_t* state = arg;
+    for (int cell = 0; cell < BF_MEMORY_SIZE; cell++) {
+        state->memory[cell] = 0;
+    }
+    state->data_ptr = 0;
+    state->code_ptr = 0;
+    state->stack_ptr = 0;
+}
+
+static int bf_bench_compiled(void* arg) {
+    return bf_execute(arg);
+}
+
+static int bf_bench_source(void* arg) {
+    return bf_interpret(arg);
+}
+
+// Best of BF_BENCH_RUNS runs of state->code in TSC cycles, 0 if it fails
+static uint32_t bf_bench_run(bf_state_t* state, bool compiled) {
+    return bench_best_cycles(BF_BENCH_RUNS, bf_bench_reset,
+                             compiled ? bf_bench_compiled : bf_bench_source, state);
+}
+
+static void bf_bench(void) {
+    bf_state_t* state = bf_init();
+    if (!state) {
+        return;
+    }
+    
+    state->code = (char*) bf_bench_program;
+    state->code_length = strlen(bf_bench_program);
+    state->quiet = true;
+    
+    uint32_t interpreted = bf_bench_run(state, false);
+    uint32_t compiled = bf_bench_run(state, true);
+    state->jit_enabled = true;
+    uint32_t native = bf_bench_run(state, true);
+    
+    if (!interpreted || !compiled || !native) {
+        print("Benchmark failed\n");
+    } else {
+        uint32_t tenths = compiled >= 10 ? interpreted / (compiled / 10) : 0;
+        printr("source     %10u cycles\n", interpreted);
+        printr("compiled   %10u cycles (%d operations)  %u.%ux\n", compiled,
+               state->program_size, tenths / 10, tenths % 10);
+        tenths = native >= 10 ? interpreted / (native / 10) : 0;
+        printr("jit        %10u cycles  %u.%ux\n", native, tenths / 10, tenths % 10);
+    }
+    bf_cleanup(state);
+}
+
+// Compiles and runs code, reporting failures
+static void bf_run_source(char* code, bool jit) {
+    bf_state_t* state = bf_init();
+    if (!state) {
+        print("Error: Failed to initialize Brainfuck interpreter\n");
+        return;
+    }
+    
+    state->code = code;
+    state->code_length = strlen(code);
+    state->jit_enabled = jit;
+    
+    print("Output: ");
+    int result = bf_execute(state);
+    print("\n");
+    
+    if (result != 0) {
+        printr("Execution failed: %s\n", bf_get_error_string(result));
+    }
+    
+    bf_cleanup(state);
+}
+
 void brainfuck_command(int argc, char* argv[]) {
     char input[COMMAND_BUFFER_SIZE];
+    bool jit = false;
     
     print("\nBrainfuck Interpreter\n");
     print("Commands:\n");
     print("  run <code>  - Execute Brainfuck code\n");
     print("  hello       - Run Hello World example \n");
+    print("  jit on/off  - Run programs as native code\n");
+    print("  bench       - Time compiled code against the source interpreter\n");
     print("  help        - Show this help\n");
     print("  exit        - Exit interpreter\n\n");
     
@@ -188,25 +603,15 @@ void brainfuck_command(int argc, char* argv[]) {
         } else if (strcmp(input, "hello") == 0) {
             // Hello World example
             char* hello_world = "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.>---.+++++++..+++.>>.<-.<.+++.------.--------.>>+.>++.";
-            
-            bf_state_t* state = bf_init();
-            if (!state) {
-                print("Error: Failed to initialize Brainfuck interpreter\n");
-                continue;
-            }
-            
-            state->code = hello_world;
-            state->code_length = strlen(hello_world);
-            
-            print("Output: ");
-            int result = bf_execute(state);
-            print("\n");
-            
-            if (result != 0) {
-                print("Execution failed\n");
-            }
-            
-            bf_cleanup(state);
+            bf_run_source(hello_world, jit);
+        } else if (strcmp(input, "bench") == 0) {
+            bf_bench();
+        } else if (strcmp(input, "jit on") == 0) {
+            jit = true;
+            print("Native code on\n");
+        } else if (strcmp(input, "jit off") == 0) {
+            jit = false;
+            print("Native code off\n");
         } else if (strncmp(input, "run ", 4) == 0) {
             char* code = input + 4; // Skip "run "
             
@@ -214,25 +619,7 @@ void brainfuck_command(int argc, char* argv[]) {
                 print("Error: No code provided\n");
                 continue;
             }
-            
-            bf_state_t* state = bf_init();
-            if (!state) {
-                print("Error: Failed to initialize Brainfuck interpreter\n");
-                continue;
-            }
-            
-            state->code = code;
-            state->code_length = strlen(code);
-            
-            print("Output: ");
-            int result = bf_execute(state);
-            print("\n");
-            
-            if (result != 0) {
-                print("Execution failed\n");
-            }
-            
-            bf_cleanup(state);
+            bf_run_source(code, jit);
         } else {
             print("Unknown command. Type 'help' for available commands.\n");
         }
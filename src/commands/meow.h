@@ -9,6 +9,29 @@
 #define BF_STACK_SIZE 1000
 #define BF_INPUT_SIZE 1000
 
+#define BF_MAX_LOOP_OFFSETS 16   // Cells a multiply loop may touch
+#define BF_OUTPUT_SIZE 128       // Characters collected before one print
+
+// Operations of a compiled program
+typedef enum {
+    BF_OP_END,
+    BF_OP_ADD,               // cell += value, a folded run of + and -
+    BF_OP_MOVE,              // ptr += arg, a folded run of > and <
+    BF_OP_OUTPUT,
+    BF_OP_INPUT,
+    BF_OP_OPEN,              // [ jumps to arg when the cell is zero
+    BF_OP_CLOSE,             // ] jumps to arg when the cell is not zero
+    BF_OP_CLEAR,             // [-] and [+]
+    BF_OP_MUL_ADD,           // cell[ptr + arg] += cell * value, from loops like [->+<]
+    BF_OP_SCAN               // [>] and [<], step by arg to the next zero cell
+} bf_op_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t value;           // Amount for ADD, factor for MUL_ADD
+    int32_t arg;             // Distance, offset or jump target
+} bf_instruction_t;
+
 // Brainfuck interpreter state structure
 typedef struct {
     char* code;              // Pointer to the Brainfuck code
@@ -21,12 +44,18 @@ typedef struct {
     char* input_buffer;      // Buffer for input characters
     int input_ptr;           // Current position in input buffer
     int input_length;        // Length of input buffer
+    bf_instruction_t* program; // Compiled code, from the page allocator
+    int program_size;
+    uint32_t program_pages;
+    bool quiet;              // Drop output, for benchmarks
+    char output[BF_OUTPUT_SIZE + 1]; // Pending output, see bf_flush_output
+    int output_length;
+    bool jit_enabled;        // bf_execute runs native code
+    uint8_t* jit_code;       // Native code built by bf_jit_compile
+    uint32_t jit_pages;
+    uint32_t* jit_map;       // Native address of each operation
+    uint32_t jit_map_pages;
 } bf_state_t;
-static bf_state_t static_bf_state;
-static char static_bf_memory[1000];
-static int static_bf_stack[100];
-static char static_bf_input[256];
-static int bf_state_in_use = 0;
 // Error codes
 typedef enum {
     BF_SUCCESS = 0,
@@ -34,7 +63,8 @@ typedef enum {
     BF_ERROR_MEMORY_UNDERFLOW = -2,
     BF_ERROR_UNMATCHED_BRACKET = -3,
     BF_ERROR_STACK_OVERFLOW = -4,
-    BF_ERROR_INIT_FAILED = -5
+    BF_ERROR_INIT_FAILED = -5,
+    BF_ERROR_NO_MEMORY = -6
 } bf_error_t;
 
 // Function prototypes
@@ -63,7 +93,45 @@ void bf_cleanup(bf_state_t* state);
 int find_matching_bracket(char* code, int pos, int length, char open, char close);
 
 /**
- * Execute Brainfuck code
+ * Compile state->code into state->program. Runs of + - < > are folded,
+ * brackets get their targets up front, and clear, multiply and scan loops
+ * become single operations
+ * @param state Pointer to initialized bf_state_t structure
+ * @return 0 on success, negative error code on failure
+ */
+int bf_compile(bf_state_t* state);
+
+/**
+ * Translate the compiled program to i386 code, with the cell pointer kept
+ * in a register
+ * @param state State holding a program from bf_compile
+ * @return 0 on success, negative error code on failure
+ */
+int bf_jit_compile(bf_state_t* state);
+
+/**
+ * Run the code from bf_jit_compile from the first cell
+ * @param state State holding the native code
+ * @return 0 on success, negative error code on failure
+ */
+int bf_jit_run(bf_state_t* state);
+
+/**
+ * Print the collected output in one go
+ * @param state Pointer to bf_state_t structure
+ */
+void bf_flush_output(bf_state_t* state);
+
+/**
+ * Character for ',' from the input buffer, or asked from the keyboard once
+ * the pending output is out
+ * @param state Pointer to bf_state_t structure
+ * @return The character, 0 for an empty line
+ */
+uint8_t bf_read_input(bf_state_t* state);
+
+/**
+ * Execute Brainfuck code, compiling it first
  * @param state Pointer to initialized bf_state_t structure
  * @return 0 on success, negative error code on failure
  */
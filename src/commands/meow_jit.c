@@ -0,0 +1,234 @@
+#include "meow.h"
+#include "../memory/memory.h"
+#include "../utility/utility.h"
+#include "../utility/jit_emit.h"
+
+// Brainfuck to i386. The cell pointer lives in edi as an absolute address,
+// eax and edx are scratch, and output and input go through C helpers called
+// cdecl, which leave edi alone. A pointer that would leave the tape exits
+// with its cell index in eax, so the error stub can tell the two ends apart.
+
+#define BF_JIT_MAX_BYTES    64      // Longest template, output is about 46
+#define BF_JIT_HEADER       64      // Entry, error and exit
+
+typedef struct {
+    jit_emit_t emit;
+    bf_state_t* state;
+    uint32_t error;             // Offset of the out of range exit
+    uint32_t exit;              // Offset of the common exit, eax holds the result
+} bf_jit_t;
+
+// Leave through the error exit unless the cell at edi + disp is on the tape
+static void jit_check(bf_jit_t* jit, int32_t disp) {
+    uint32_t base = (uint32_t) jit->state->memory;
+
+    jit_byte(&jit->emit, 0x8D);                             // lea eax, [edi + disp - base]
+    jit_byte(&jit->emit, 0x87);
+    jit_word(&jit->emit, disp - base);
+    jit_byte(&jit->emit, 0x3D);                             // cmp eax, BF_MEMORY_SIZE
+    jit_word(&jit->emit, BF_MEMORY_SIZE);
+    jit_byte(&jit->emit, 0x0F);                             // jae error
+    jit_byte(&jit->emit, 0x83);
+    jit_rel32(&jit->emit, jit->error);
+}
+
+// cdecl call of fn(state)
+static void jit_call(bf_jit_t* jit, void* fn) {
+    jit_byte(&jit->emit, 0x68);                             // push state
+    jit_word(&jit->emit, (uint32_t) jit->state);
+    jit_byte(&jit->emit, 0xE8);                             // call fn
+    jit_word(&jit->emit, (uint32_t) fn - jit_address(&jit->emit, jit->emit.pos + 4));
+    jit_byte(&jit->emit, 0x83);                             // add esp, 4
+    jit_byte(&jit->emit, 0xC4);
+    jit_byte(&jit->emit, 0x04);
+}
+
+static void jit_operation(bf_jit_t* jit, uint32_t index) {
+    bf_state_t* state = jit->state;
+    bf_instruction_t* instr = &state->program[index];
+
+    switch (instr->op) {
+        case BF_OP_END:
+            jit_byte(&jit->emit, 0x31);                     // xor eax, eax
+            jit_byte(&jit->emit, 0xC0);
+            jit_byte(&jit->emit, 0xE9);                     // jmp exit
+            jit_rel32(&jit->emit, jit->exit);
+            break;
+
+        case BF_OP_ADD:
+            jit_byte(&jit->emit, 0x80);                     // add byte [edi], value
+            jit_byte(&jit->emit, 0x07);
+            jit_byte(&jit->emit, instr->value);
+            break;
+
+        case BF_OP_MOVE:
+            jit_byte(&jit->emit, 0x81);                     // add edi, arg
+            jit_byte(&jit->emit, 0xC7);
+            jit_word(&jit->emit, instr->arg);
+            jit_check(jit, 0);
+            break;
+
+        case BF_OP_OUTPUT: {
+            jit_byte(&jit->emit, 0x8A);                     // mov al, [edi]
+            jit_byte(&jit->emit, 0x07);
+            jit_byte(&jit->emit, 0x84);                     // test al, al
+            jit_byte(&jit->emit, 0xC0);
+            uint32_t zero = jit_short(&jit->emit, 0x74);    // jz done
+            jit_byte(&jit->emit, 0x8B);                     // mov edx, [output_length]
+            jit_byte(&jit->emit, 0x15);
+            jit_word(&jit->emit, (uint32_t) &state->output_length);
+            jit_byte(&jit->emit, 0x88);                     // mov [output + edx], al
+            jit_byte(&jit->emit, 0x82);
+            jit_word(&jit->emit, (uint32_t) state->output);
+            jit_byte(&jit->emit, 0x42);                     // inc edx
+            jit_byte(&jit->emit, 0x89);                     // mov [output_length], edx
+            jit_byte(&jit->emit, 0x15);
+            jit_word(&jit->emit, (uint32_t) &state->output_length);
+            jit_byte(&jit->emit, 0x81);                     // cmp edx, BF_OUTPUT_SIZE
+            jit_byte(&jit->emit, 0xFA);
+            jit_word(&jit->emit, BF_OUTPUT_SIZE);
+            uint32_t room = jit_short(&jit->emit, 0x75);    // jne done
+            jit_call(jit, bf_flush_output);
+            jit_land(&jit->emit, zero);
+            jit_land(&jit->emit, room);
+            break;
+        }
+
+        case BF_OP_INPUT:
+            jit_call(jit, bf_read_input);
+            jit_byte(&jit->emit, 0x88);                     // mov [edi], al
+            jit_byte(&jit->emit, 0x07);
+            break;
+
+        case BF_OP_OPEN:
+        case BF_OP_CLOSE:
+            jit_byte(&jit->emit, 0x80);                     // cmp byte [edi], 0
+            jit_byte(&jit->emit, 0x3F);
+            jit_byte(&jit->emit, 0x00);
+            jit_byte(&jit->emit, 0x0F);                     // jz / jnz target
+            jit_byte(&jit->emit, instr->op == BF_OP_OPEN ? 0x84 : 0x85);
+            jit_fixup(&jit->emit, index, instr->arg);
+            break;
+
+        case BF_OP_CLEAR:
+            jit_byte(&jit->emit, 0xC6);                     // mov byte [edi], 0
+            jit_byte(&jit->emit, 0x07);
+            jit_byte(&jit->emit, 0x00);
+            break;
+
+        case BF_OP_MUL_ADD: {
+            jit_byte(&jit->emit, 0x80);                     // cmp byte [edi], 0
+            jit_byte(&jit->emit, 0x3F);
+            jit_byte(&jit->emit, 0x00);
+            uint32_t zero = jit_short(&jit->emit, 0x74);    // jz done
+            jit_check(jit, instr->arg);
+            jit_byte(&jit->emit, 0x0F);                     // movzx eax, byte [edi]
+            jit_byte(&jit->emit, 0xB6);
+            jit_byte(&jit->emit, 0x07);
+            if (instr->value != 1) {
+                jit_byte(&jit->emit, 0x69);                 // imul eax, eax, value
+                jit_byte(&jit->emit, 0xC0);
+                jit_word(&jit->emit, instr->value);
+            }
+            jit_byte(&jit->emit, 0x00);                     // add [edi + arg], al
+            jit_byte(&jit->emit, 0x87);
+            jit_word(&jit->emit, instr->arg);
+            jit_land(&jit->emit, zero);
+            break;
+        }
+
+        case BF_OP_SCAN: {
+            uint32_t loop = jit->emit.pos;
+            jit_byte(&jit->emit, 0x80);                     // cmp byte [edi], 0
+            jit_byte(&jit->emit, 0x3F);
+            jit_byte(&jit->emit, 0x00);
+            uint32_t done = jit_short(&jit->emit, 0x74);    // jz done
+            jit_byte(&jit->emit, 0x81);                     // add edi, arg
+            jit_byte(&jit->emit, 0xC7);
+            jit_word(&jit->emit, instr->arg);
+            jit_check(jit, 0);
+            jit_byte(&jit->emit, 0xEB);                     // jmp loop
+            jit_byte(&jit->emit, (uint8_t) (loop - (jit->emit.pos + 1)));
+            jit_land(&jit->emit, done);
+            break;
+        }
+    }
+}
+
+// Entry at offset 0, called as int (*)(void). The pointer comes from and
+// goes back to state->data_ptr
+static void jit_prologue(bf_jit_t* jit) {
+    bf_state_t* state = jit->state;
+    uint32_t base = (uint32_t) state->memory;
+
+    jit_byte(&jit->emit, 0x57);                             // push edi
+    jit_byte(&jit->emit, 0x8B);                             // mov edi, [data_ptr]
+    jit_byte(&jit->emit, 0x3D);
+    jit_word(&jit->emit, (uint32_t) &state->data_ptr);
+    jit_byte(&jit->emit, 0x81);                             // add edi, memory
+    jit_byte(&jit->emit, 0xC7);
+    jit_word(&jit->emit, base);
+    uint32_t body = jit_short(&jit->emit, 0xEB);            // jmp body
+
+    jit->error = jit->emit.pos;
+    jit_byte(&jit->emit, 0x85);                             // test eax, eax
+    jit_byte(&jit->emit, 0xC0);
+    jit_byte(&jit->emit, 0xB8);                             // mov eax, overflow
+    jit_word(&jit->emit, (uint32_t) BF_ERROR_MEMORY_OVERFLOW);
+    uint32_t above = jit_short(&jit->emit, 0x79);           // jns exit
+    jit_byte(&jit->emit, 0xB8);                             // mov eax, underflow
+    jit_word(&jit->emit, (uint32_t) BF_ERROR_MEMORY_UNDERFLOW);
+    jit_land(&jit->emit, above);
+
+    jit->exit = jit->emit.pos;
+    jit_byte(&jit->emit, 0x81);                             // sub edi, memory
+    jit_byte(&jit->emit, 0xEF);
+    jit_word(&jit->emit, base);
+    jit_byte(&jit->emit, 0x89);                             // mov [data_ptr], edi
+    jit_byte(&jit->emit, 0x3D);
+    jit_word(&jit->emit, (uint32_t) &state->data_ptr);
+    jit_byte(&jit->emit, 0x5F);                             // pop edi
+    jit_byte(&jit->emit, 0xC3);                             // ret
+
+    jit_land(&jit->emit, body);
+}
+
+int bf_jit_compile(bf_state_t* state) {
+    if (!state || state->program_size == 0) return BF_ERROR_INIT_FAILED;
+
+    uint32_t size = state->program_size;
+    bf_jit_t jit;
+    jit.state = state;
+
+    if (!jit_prepare(&jit.emit, &state->jit_code, &state->jit_pages, &state->jit_map, &state->jit_map_pages,
+                     size, BF_JIT_HEADER, BF_JIT_MAX_BYTES)) {
+        return BF_ERROR_NO_MEMORY;
+    }
+
+    jit_prologue(&jit);
+
+    for (uint32_t i = 0; i < size; i++) {
+        jit_mark(&jit.emit, i);
+        jit_operation(&jit, i);
+    }
+
+    // Loop targets are all placed now
+    jit_patch(&jit.emit, size);
+    return BF_SUCCESS;
+}
+
+int bf_jit_run(bf_state_t* state) {
+    if (!state || !state->jit_code) return BF_ERROR_INIT_FAILED;
+
+    int (*native)(void) = (int (*)(void)) state->jit_code;
+    int result = native();
+
+    // A failed move leaves the pointer off the tape, as in bf_run_program
+    bf_flush_output(state);
+    if (state->data_ptr < 0) {
+        state->data_ptr = 0;
+    } else if (state->data_ptr >= BF_MEMORY_SIZE) {
+        state->data_ptr = BF_MEMORY_SIZE - 1;
+    }
+    return result;
+}
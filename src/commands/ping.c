@@ -4,6 +4,12 @@
 #include "../timers/timer.h"
 #include "../io/io.h"
 #include "../rtl8139/rtl8139.h"
+#include "../cpu/cpu.h"
+#include "../timers/clocksource.h"
+#include "../timers/timer_wheel.h"
+#include "../timers/tick.h"
+#include "../scheduler/task.h"
+#include "ping.h"
 
 // External RTL8139 reference
 extern struct rtl8139* RTL8139;
@@ -164,15 +170,8 @@ uint16_t calculate_icmp_checksum(icmp_header_t* header, uint8_t* data, uint16_t
     return htons(~sum);
 }
 
-// Send ping packet
-bool send_ping(uint32_t dest_ip, uint16_t identifier, uint16_t sequence) {
-    if (!RTL8139 || !RTL8139->initialized) {
-        warn("RTL8139 not initialized", __FILE__);
-        return false;
-    }
-    
-    // Create packet buffer
-    uint8_t packet[128];
+// Build an ICMP echo request frame into packet, returns the frame length
+static uint16_t build_ping_packet(uint8_t* packet, uint32_t dest_ip, uint16_t identifier, uint16_t sequence) {
     uint16_t packet_len = 0;
     
     // Ethernet header
@@ -218,6 +217,20 @@ ip->src_ip = htonl(ip_host_order);
     // Calculate ICMP checksum
     icmp->checksum = calculate_icmp_checksum(icmp, icmp_data, 32);
     
+    return packet_len;
+}
+
+// Send ping packet
+bool send_ping(uint32_t dest_ip, uint16_t identifier, uint16_t sequence) {
+    if (!RTL8139 || !RTL8139->initialized) {
+        warn("RTL8139 not initialized", __FILE__);
+        return false;
+    }
+    
+    // Create packet buffer
+    uint8_t packet[128];
+    uint16_t packet_len = build_ping_packet(packet, dest_ip, identifier, sequence);
+    
     // Debug: Print packet info
     print("Sending packet: ");
     char buffer[16];
@@ -229,16 +242,28 @@ ip->src_ip = htonl(ip_host_order);
     return rtl8139_send_packet((int8*)packet, packet_len);
 }
 
+// Reply timeout, signalled from the timer wheel
+#define PING_REPLY_TIMEOUT_MS 1000
+
+static volatile bool ping_timed_out;
+
+static void ping_timeout_callback(uint32_t data) {
+    (void)data;
+    ping_timed_out = true;
+}
+
 // Receive and process ping reply
 bool receive_ping_reply(uint16_t expected_id, uint16_t expected_seq, uint32_t* reply_time) {
     uint8_t buffer[1500];
     int16 length;
     uint32_t start_time = get_ticks();
     
-    // Use a simple counter instead of relying on timer
-    int timeout_counter = 5000; // Adjust this value
+    timer_list_t timeout_timer;
+    setup_timer(&timeout_timer, ping_timeout_callback, 0);
+    ping_timed_out = false;
+    mod_timer(&timeout_timer, start_time + PING_REPLY_TIMEOUT_MS);
     
-    while (timeout_counter > 0) {
+    while (!ping_timed_out) {
         if (rtl8139_receive_packet((int8*)buffer, &length)) {
             print("Received packet: ");
             char len_str[16];
@@ -248,33 +273,28 @@ bool receive_ping_reply(uint16_t expected_id, uint16_t expected_seq, uint32_t* r
             
             // Parse Ethernet header
             if (length < sizeof(ethernet_header_t)) {
-                timeout_counter--;
                 continue;
             }
             
             ethernet_header_t* eth = (ethernet_header_t*)buffer;
             if (ntohs(eth->ethertype) != ETHERTYPE_IP) {
                 print("Not IP packet\n");
-                timeout_counter--;
                 continue;
             }
             
             // Parse IP header
             if (length < sizeof(ethernet_header_t) + sizeof(ip_header_t)) {
-                timeout_counter--;
                 continue;
             }
             
             ip_header_t* ip = (ip_header_t*)(buffer + sizeof(ethernet_header_t));
             if (ip->protocol != IP_PROTOCOL_ICMP) {
                 print("Not ICMP packet\n");
-                timeout_counter--;
                 continue;
             }
             
             // Parse ICMP header
             if (length < sizeof(ethernet_header_t) + sizeof(ip_header_t) + sizeof(icmp_header_t)) {
-                timeout_counter--;
                 continue;
             }
             
@@ -291,15 +311,17 @@ bool receive_ping_reply(uint16_t expected_id, uint16_t expected_seq, uint32_t* r
                 ntohs(icmp->sequence) == expected_seq) {
                 
                 *reply_time = get_ticks() - start_time;
+                del_timer(&timeout_timer);
                 return true;
             }
-        }
-        
-        timeout_counter--;
-        
-        // Show progress
-        if (timeout_counter % 1000 == 0) {
-            print(".");
+        } else {
+            // Nothing queued, halt until the NIC or the timeout timer interrupts
+            disable_interrupts();
+            if (!ping_timed_out && !rtl8139_rx_pending()) {
+                task_idle_wait();
+            } else {
+                enable_interrupts();
+            }
         }
     }
     
@@ -407,7 +429,7 @@ void ping_predefined(const char* target) {
 // Command wrapper for shell integration
 void text(int argc, char* argv[]) {
     if (argc < 2) {
-        print("Usage: ping <IP_address|target>\n");
+        print("Usage: ping [-c count] [-f | -i ms] <IP_address|target>\n");
         print("Examples:\n");
         print("  ping 8.8.8.8        - Ping Google DNS\n");
         print("  ping 192.168.1.1    - Ping custom IP\n");
@@ -420,6 +442,12 @@ void text(int argc, char* argv[]) {
         return;
     }
     
+    // Options (-c, -f, -i) are handled by the full ping command
+    if (argv[1][0] == '-') {
+        ping_command(argc, argv);
+        return;
+    }
+    
     const char* target = argv[1];
     
     // Check if it's a predefined target
@@ -540,21 +568,292 @@ bool is_valid_ip(const char* ip_str) {
     return parse_ip_address(ip_str) != 0;
 }
 
+// Flood / interval mode: several echoes are kept in flight at once, each one
+// is timestamped with the TSC and nothing is printed until the run is over
+#define PING_FLOOD_WINDOW      16      // Echo requests allowed in flight at once
+#define PING_FLOOD_MAX_COUNT   4096    // Samples kept for the percentile report
+#define PING_FLOOD_TIMEOUT_MS  1000    // An echo older than this is counted as lost
+
+typedef struct {
+    uint64_t sent_tsc;
+    uint16_t sequence;
+    bool in_flight;
+} ping_slot_t;
+
+static ping_slot_t ping_slots[PING_FLOOD_WINDOW];
+static uint32_t ping_rtt_ns[PING_FLOOD_MAX_COUNT];
+
+// Pull the sequence number out of an echo reply carrying our identifier
+static bool parse_ping_reply(const uint8_t* buffer, int16 length, uint16_t identifier, uint16_t* sequence) {
+    if (length < sizeof(ethernet_header_t) + sizeof(ip_header_t) + sizeof(icmp_header_t)) {
+        return false;
+    }
+    
+    const ethernet_header_t* eth = (const ethernet_header_t*)buffer;
+    if (ntohs(eth->ethertype) != ETHERTYPE_IP) {
+        return false;
+    }
+    
+    const ip_header_t* ip = (const ip_header_t*)(buffer + sizeof(ethernet_header_t));
+    if (ip->protocol != IP_PROTOCOL_ICMP) {
+        return false;
+    }
+    
+    // Honour IP options instead of assuming a 20 byte header
+    uint16_t ip_header_len = (ip->version_ihl & 0x0F) * 4;
+    if (length < sizeof(ethernet_header_t) + ip_header_len + sizeof(icmp_header_t)) {
+        return false;
+    }
+    
+    const icmp_header_t* icmp = (const icmp_header_t*)(buffer + sizeof(ethernet_header_t) + ip_header_len);
+    if (icmp->type != ICMP_TYPE_ECHO_REPLY || ntohs(icmp->identifier) != identifier) {
+        return false;
+    }
+    
+    *sequence = ntohs(icmp->sequence);
+    return true;
+}
+
+// Integer square root, used for the standard deviation
+static uint32_t ping_isqrt(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    
+    while (bit > value) {
+        bit >>= 2;
+    }
+    
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    
+    return (uint32_t)result;
+}
+
+// Shell sort of the RTT samples so percentiles can be read off directly
+static void ping_sort_samples(uint32_t* samples, int count) {
+    for (int gap = count / 2; gap > 0; gap /= 2) {
+        for (int i = gap; i < count; i++) {
+            uint32_t value = samples[i];
+            int j = i;
+            while (j >= gap && samples[j - gap] > value) {
+                samples[j] = samples[j - gap];
+                j -= gap;
+            }
+            samples[j] = value;
+        }
+    }
+}
+
+// Print a nanosecond value as milliseconds with three decimals
+static void print_ping_ms(uint32_t ns) {
+    uint32_t us = ns / 1000;
+    printr("%u.%03u", us / 1000, us % 1000);
+}
+
+// Pipelined ping: interval_ms == 0 floods as fast as the NIC accepts frames
+void ping_flood(const char* ip_str, int count, uint32_t interval_ms) {
+    if (!RTL8139 || !RTL8139->initialized) {
+        warn("Network card not initialized", __FILE__);
+        return;
+    }
+    
+    uint32_t target_ip = parse_ip_address(ip_str);
+    if (target_ip == 0) {
+        terminal_setcolor(VGA_COLOR_RED);
+        print("Invalid IP address format: ");
+        print(ip_str);
+        print("\n");
+        terminal_setcolor(VGA_COLOR_WHITE);
+        return;
+    }
+    
+    char ip_display[16];
+    ip_to_string(target_ip, ip_display);
+    
+    uint32_t cpu_mhz = clocksource_tsc_khz() / 1000;
+    if (cpu_mhz == 0) {
+        cpu_mhz = get_cpu_frequency_mhz();
+    }
+    uint64_t timeout_cycles = (uint64_t)PING_FLOOD_TIMEOUT_MS * cpu_mhz * 1000;
+    uint64_t interval_cycles = (uint64_t)interval_ms * cpu_mhz * 1000;
+    
+    printr("PING %s: %d packets, %d in flight, interval %u ms\n",
+           ip_display, count, PING_FLOOD_WINDOW, interval_ms);
+    
+    memset(ping_slots, 0, sizeof(ping_slots));
+    uint32_t dropped_before = rtl8139_rx_dropped();
+    
+    uint16_t identifier = 0x4652;
+    int sent = 0;
+    int received = 0;
+    int lost = 0;
+    int in_flight = 0;
+    int duplicates = 0;
+    uint64_t sum_ns = 0;
+    uint32_t min_ns = 0xFFFFFFFF;
+    uint32_t max_ns = 0;
+    
+    uint8_t packet[128];
+    uint8_t reply[1600];
+    int16 reply_len;
+    
+    uint64_t start_tsc = get_cpu_timestamp();
+    uint64_t last_send_tsc = 0;
+    
+    while (received + lost < count) {
+        uint64_t now = get_cpu_timestamp();
+        
+        // Transmit while the window has room and the pacing interval has passed
+        if (sent < count && in_flight < PING_FLOOD_WINDOW &&
+            (sent == 0 || now - last_send_tsc >= interval_cycles)) {
+            uint16_t sequence = (uint16_t)(sent + 1);
+            ping_slot_t* slot = &ping_slots[sequence % PING_FLOOD_WINDOW];
+            
+            if (!slot->in_flight && rtl8139_tx_ready()) {
+                uint16_t packet_len = build_ping_packet(packet, target_ip, identifier, sequence);
+                slot->sequence = sequence;
+                slot->sent_tsc = get_cpu_timestamp();
+                
+                if (rtl8139_send_packet((int8*)packet, packet_len)) {
+                    slot->in_flight = true;
+                    in_flight++;
+                } else {
+                    lost++;
+                }
+                
+                sent++;
+                last_send_tsc = slot->sent_tsc;
+            }
+        }
+        
+        // Drain every reply that has arrived, matching on sequence number
+        while (rtl8139_receive_packet((int8*)reply, &reply_len)) {
+            uint64_t arrival = get_cpu_timestamp();
+            uint16_t sequence;
+            
+            if (!parse_ping_reply(reply, reply_len, identifier, &sequence)) {
+                continue;
+            }
+            
+            ping_slot_t* slot = &ping_slots[sequence % PING_FLOOD_WINDOW];
+            if (!slot->in_flight || slot->sequence != sequence) {
+                duplicates++;
+                continue;
+            }
+            
+            uint32_t rtt_ns = (uint32_t)clocksource_tsc_to_ns(arrival - slot->sent_tsc);
+            if (received < PING_FLOOD_MAX_COUNT) {
+                ping_rtt_ns[received] = rtt_ns;
+            }
+            
+            if (rtt_ns < min_ns) min_ns = rtt_ns;
+            if (rtt_ns > max_ns) max_ns = rtt_ns;
+            sum_ns += rtt_ns;
+            
+            slot->in_flight = false;
+            in_flight--;
+            received++;
+        }
+        
+        // Expire echoes that have been outstanding for too long
+        now = get_cpu_timestamp();
+        for (int i = 0; i < PING_FLOOD_WINDOW; i++) {
+            if (ping_slots[i].in_flight && now - ping_slots[i].sent_tsc > timeout_cycles) {
+                ping_slots[i].in_flight = false;
+                in_flight--;
+                lost++;
+            }
+        }
+    }
+    
+    uint64_t elapsed_ns = clocksource_tsc_to_ns(get_cpu_timestamp() - start_tsc);
+    
+    // Print statistics
+    printr("\n--- %s ping statistics ---\n", ip_display);
+    printr("%d transmitted, %d received, %d lost (%d%% loss), %d duplicates, time %u ms\n",
+           sent, received, lost, count > 0 ? (lost * 100) / count : 0, duplicates,
+           (uint32_t)(elapsed_ns / 1000000));
+    
+    // Replies the driver had no room for show up as loss above
+    uint32_t dropped = rtl8139_rx_dropped() - dropped_before;
+    if (dropped > 0) {
+        printr("%u frames dropped by the receive queue\n", dropped);
+    }
+    
+    if (received == 0) {
+        return;
+    }
+    
+    int samples = received < PING_FLOOD_MAX_COUNT ? received : PING_FLOOD_MAX_COUNT;
+    uint32_t avg_ns = (uint32_t)(sum_ns / received);
+    
+    // Past PING_FLOOD_MAX_COUNT replies only the first ones are stored, so
+    // the spread is taken around their own mean rather than the overall one
+    uint64_t sample_sum = 0;
+    for (int i = 0; i < samples; i++) {
+        sample_sum += ping_rtt_ns[i];
+    }
+    uint32_t sample_avg = (uint32_t)(sample_sum / samples);
+    
+    uint64_t variance = 0;
+    for (int i = 0; i < samples; i++) {
+        int64_t diff = (int64_t)ping_rtt_ns[i] - sample_avg;
+        variance += (uint64_t)(diff * diff);
+    }
+    variance /= samples;
+    
+    ping_sort_samples(ping_rtt_ns, samples);
+    
+    print("rtt min/avg/max/stddev = ");
+    print_ping_ms(min_ns);
+    print("/");
+    print_ping_ms(avg_ns);
+    print("/");
+    print_ping_ms(max_ns);
+    print("/");
+    print_ping_ms(ping_isqrt(variance));
+    print(" ms\n");
+    
+    print("rtt p50/p90/p99/p99.9 = ");
+    print_ping_ms(ping_rtt_ns[(samples * 50) / 100]);
+    print("/");
+    print_ping_ms(ping_rtt_ns[(samples * 90) / 100]);
+    print("/");
+    print_ping_ms(ping_rtt_ns[(samples * 99) / 100]);
+    print("/");
+    print_ping_ms(ping_rtt_ns[(samples * 999) / 1000]);
+    print(" ms\n");
+}
+
 // Enhanced ping command with options
 void ping_command(int argc, char* argv[]) {
     if (argc < 2) {
         print("Usage: ping [options] <IP_address|target>\n");
         print("Options:\n");
         print("  -c <count>     Number of pings to send\n");
+        print("  -f             Flood: keep echoes in flight, print only statistics\n");
+        print("  -i <ms>        Interval between echoes, statistics only\n");
         print("  -t             Continuous ping (not implemented)\n");
         print("\nExamples:\n");
         print("  ping 8.8.8.8\n");
         print("  ping -c 5 google\n");
+        print("  ping -f -c 1000 gateway\n");
         print("  ping gateway\n");
         return;
     }
     
     int ping_count = 1;
+    bool count_given = false;
+    bool flood = false;
+    bool interval_given = false;
+    uint32_t interval_ms = 0;
     const char* target = NULL;
     
     // Parse arguments
@@ -573,7 +872,26 @@ void ping_command(int argc, char* argv[]) {
                     return;
                 }
             }
+            count_given = true;
             i++; // Skip the count argument
+        } else if (strcmp(argv[i], "-f") == 0) {
+            flood = true;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            // Parse interval in milliseconds
+            interval_ms = 0;
+            const char* interval_str = argv[i + 1];
+            for (int j = 0; interval_str[j] != '\0'; j++) {
+                if (interval_str[j] >= '0' && interval_str[j] <= '9') {
+                    interval_ms = interval_ms * 10 + (interval_str[j] - '0');
+                } else {
+                    print("Invalid interval: ");
+                    print(interval_str);
+                    print("\n");
+                    return;
+                }
+            }
+            interval_given = true;
+            i++; // Skip the interval argument
         } else if (argv[i][0] != '-') {
             target = argv[i];
         }
@@ -584,7 +902,12 @@ void ping_command(int argc, char* argv[]) {
         return;
     }
     
-    if (ping_count <= 0 || ping_count > 100) {
+    bool stats_mode = flood || interval_given;
+    if (stats_mode && !count_given) {
+        ping_count = 100;
+    }
+    
+    if (ping_count <= 0 || (!stats_mode && ping_count > 100)) {
         print("Invalid ping count (1-100)\n");
         return;
     }
@@ -609,7 +932,9 @@ void ping_command(int argc, char* argv[]) {
     }
     
     // Execute ping
-    if (ping_count == 1) {
+    if (stats_mode) {
+        ping_flood(ip_str, ping_count, flood ? 0 : interval_ms);
+    } else if (ping_count == 1) {
         ping_ip(ip_str);
     } else {
         ping_test(ip_str, ping_count);
@@ -1,6 +1,10 @@
 #ifndef PING_H
 #define PING_H
 
+#include <stdint.h>
+
 void text(int argc, char* argv[]);
 void netdiag_command(int argc, char* argv[]);
+void ping_command(int argc, char* argv[]);
+void ping_flood(const char* ip_str, int count, uint32_t interval_ms);
 #endif
@@ -0,0 +1,111 @@
+#include "schedbench.h"
+#include "../terminal/terminal.h"
+#include "../utility/utility.h"
+#include "../scheduler/task.h"
+#include "../timers/clocksource.h"
+#include "../cpu/cpu.h"
+
+#define SCHEDBENCH_DEFAULT_ROUNDS 10000
+#define SCHEDBENCH_MAX_ROUNDS     1000000
+
+// The partner gets a fixed stack so repeated runs do not leak kernel stacks
+static uint8_t partner_stack[8192] __attribute__((aligned(16)));
+static volatile bool partner_running = false;
+static volatile uint32_t partner_id = 0;
+
+static void schedbench_partner() {
+    while (partner_running) {
+        task_yield();
+    }
+    cleanup_task(partner_id);
+}
+
+static void schedbench_report(const char* label, uint64_t cycles, uint32_t count) {
+    char buffer[32];
+
+    print(label);
+    if (count == 0) {
+        print("n/a\n");
+        return;
+    }
+
+    uint64_t per = cycles / count;
+    itoa((uint32_t) per, buffer, 10);
+    print(buffer);
+    print(" cycles (");
+    itoa((uint32_t) clocksource_tsc_to_ns(per), buffer, 10);
+    print(buffer);
+    print(" ns) over ");
+    itoa(count, buffer, 10);
+    print(buffer);
+    print("\n");
+}
+
+void schedbench_command(int argc, char* argv[]) {
+    uint32_t rounds = SCHEDBENCH_DEFAULT_ROUNDS;
+    if (argc > 1) {
+        rounds = (uint32_t) atoi(argv[1]);
+        if (rounds == 0 || rounds > SCHEDBENCH_MAX_ROUNDS) {
+            print("Usage: schedbench [rounds 1-1000000]\n");
+            return;
+        }
+    }
+
+    if (!scheduler_ready()) {
+        print("Scheduler is not running\n");
+        return;
+    }
+
+    // 1. schedule() with nothing else ready, the path every idle tick takes
+    uint64_t start = get_cpu_timestamp();
+    for (uint32_t i = 0; i < rounds; i++) {
+        task_yield();
+    }
+    schedbench_report("yield, no switch:  ", get_cpu_timestamp() - start, rounds);
+
+    // 2. Ping-pong with a partner task at the same priority
+    int id = task_alloc_id();
+    if (id < 0) {
+        print("No free task slot\n");
+        return;
+    }
+
+    // Both sides stay on this CPU, otherwise an idle AP steals the partner
+    // and the yields never switch
+    uint32_t self_id = current_task->id;
+    task_set_pinned(self_id, true);
+
+    partner_id = (uint32_t) id;
+    partner_running = true;
+    if (!create_task_stopped(partner_id, (uint32_t) schedbench_partner, 0,
+                             (uint32_t)(partner_stack + sizeof(partner_stack)), true)) {
+        partner_running = false;
+        task_set_pinned(self_id, false);
+        task_free_id(id);
+        print("Could not create the partner task\n");
+        return;
+    }
+    task_set_pinned(partner_id, true);
+    task_set_priority(partner_id, current_task->prio);
+    task_start(partner_id);
+
+    // Let the partner reach its loop before timing
+    task_yield();
+
+    uint32_t switches_before = current_task->nr_switches;
+    start = get_cpu_timestamp();
+    for (uint32_t i = 0; i < rounds; i++) {
+        task_yield();
+    }
+    uint64_t elapsed = get_cpu_timestamp() - start;
+
+    // Every time we are switched back in the CPU went out and in again
+    uint32_t switches = (current_task->nr_switches - switches_before) * 2;
+    schedbench_report("context switch:    ", elapsed, switches);
+
+    partner_running = false;
+    while (task_is_alive(partner_id)) {
+        task_yield();
+    }
+    task_set_pinned(self_id, false);
+}
@@ -0,0 +1,7 @@
+#ifndef SCHEDBENCH_H
+#define SCHEDBENCH_H
+
+// Measures the cost of schedule() with and without an actual context switch
+void schedbench_command(int argc, char* argv[]);
+
+#endif // SCHEDBENCH_H
@@ -0,0 +1,222 @@
+#include "script.h"
+#include "text.h"
+#include "../terminal/terminal.h"
+#include "../utility/utility.h"
+#include "../keyboard/keyboard.h"
+#include "../timers/clocksource.h"
+#include "../cpu/cpu.h"
+
+#define SCRIPT_NAME_SIZE 48
+
+typedef struct {
+    char name[SCRIPT_NAME_SIZE];   // Module command line
+    char text[SCRIPT_MAX_SIZE];
+    uint32_t size;
+    bool truncated;
+} script_module_t;
+
+typedef struct {
+    char line[40];                 // Command as shown in the summary
+    uint64_t cycles;
+} script_result_t;
+
+static script_module_t script_modules[SCRIPT_MAX_MODULES];
+static int script_module_count = 0;
+static script_result_t script_results[SCRIPT_MAX_LINES];
+static bool script_running = false;
+
+static void script_copy(char* dest, const char* src, uint32_t size) {
+    uint32_t i = 0;
+    while (src && src[i] && i < size - 1) {
+        dest[i] = src[i];
+        i++;
+    }
+    dest[i] = '\0';
+}
+
+int script_init(uint32_t magic, multiboot_info_t* info) {
+    script_module_count = 0;
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || !info || !(info->flags & MULTIBOOT_INFO_MODS)) {
+        return 0;
+    }
+
+    multiboot_module_t* mods = (multiboot_module_t*) info->mods_addr;
+    for (uint32_t i = 0; i < info->mods_count && script_module_count < SCRIPT_MAX_MODULES; i++) {
+        script_module_t* script = &script_modules[script_module_count++];
+        uint32_t size = mods[i].mod_end - mods[i].mod_start;
+
+        script->truncated = size > SCRIPT_MAX_SIZE - 1;
+        if (script->truncated) {
+            size = SCRIPT_MAX_SIZE - 1;
+        }
+        memcpy(script->text, (const void*) mods[i].mod_start, size);
+        script->text[size] = '\0';
+        script->size = size;
+        script_copy(script->name, (const char*) mods[i].string, SCRIPT_NAME_SIZE);
+    }
+
+    return script_module_count;
+}
+
+static void script_column(uint32_t value, int width) {
+    char buffer[16];
+    itoa(value, buffer, 10);
+    for (int i = strlen(buffer); i < width; i++) {
+        print(" ");
+    }
+    print(buffer);
+}
+
+// Microseconds when the TSC rate is known, raw cycles otherwise
+static uint32_t script_elapsed(uint64_t cycles) {
+    if (clocksource_tsc_khz() == 0) {
+        return (uint32_t) cycles;
+    }
+    return (uint32_t) (clocksource_tsc_to_ns(cycles) / 1000);
+}
+
+static void script_summary(const char* name, int count, int timed, uint64_t total) {
+    const char* unit = clocksource_tsc_khz() ? "us" : "cycles";
+
+    print("\n=== script ");
+    print(name);
+    print(" ===\n");
+    print("  #  ");
+    for (int i = strlen(unit); i < 10; i++) {
+        print(" ");
+    }
+    print(unit);
+    print("  command\n");
+
+    for (int i = 0; i < timed; i++) {
+        script_column(i + 1, 3);
+        print("  ");
+        script_column(script_elapsed(script_results[i].cycles), 10);
+        print("  ");
+        print(script_results[i].line);
+        print("\n");
+    }
+    if (count > timed) {
+        print("  ... ");
+        print_decimal(count - timed);
+        print(" more not listed\n");
+    }
+
+    print("total");
+    script_column(script_elapsed(total), 10);
+    print("  ");
+    print_decimal(count);
+    print(" commands\n");
+}
+
+int script_run(const char* text, const char* name) {
+    char line[SCRIPT_LINE_SIZE];
+    int count = 0;
+    int timed = 0;
+    uint64_t total = 0;
+
+    // The results table is shared, a script cannot start another one
+    if (script_running) {
+        print("A script is already running\n");
+        return 0;
+    }
+    script_running = true;
+
+    while (*text) {
+        // Cut the next line, execute_command tokenizes it in place
+        uint32_t length = 0;
+        while (text[length] && text[length] != '\n') {
+            length++;
+        }
+        uint32_t copy = length < SCRIPT_LINE_SIZE - 1 ? length : SCRIPT_LINE_SIZE - 1;
+        memcpy(line, text, copy);
+        line[copy] = '\0';
+        text += length;
+        if (*text == '\n') {
+            text++;
+        }
+
+        // Trim the CR of CRLF files and leading blanks
+        if (copy > 0 && line[copy - 1] == '\r') {
+            line[--copy] = '\0';
+        }
+        char* command = line;
+        while (*command == ' ' || *command == '\t') {
+            command++;
+        }
+        if (*command == '\0' || *command == '#') {
+            continue;
+        }
+
+        if (timed < SCRIPT_MAX_LINES) {
+            script_copy(script_results[timed].line, command, sizeof(script_results[timed].line));
+        }
+
+        terminal_setcolor(VGA_COLOR_CYAN);
+        print("> ");
+        print(command);
+        print("\n");
+        terminal_setcolor(VGA_COLOR_WHITE);
+
+        uint64_t start = get_cpu_timestamp();
+        execute_command(command);
+        uint64_t cycles = get_cpu_timestamp() - start;
+
+        if (timed < SCRIPT_MAX_LINES) {
+            script_results[timed++].cycles = cycles;
+        }
+        total += cycles;
+        count++;
+    }
+
+    script_summary(name, count, timed, total);
+    script_running = false;
+    return count;
+}
+
+void script_autorun(void) {
+    for (int i = 0; i < script_module_count; i++) {
+        if (strstr(script_modules[i].name, "autorun")) {
+            script_run(script_modules[i].text, script_modules[i].name);
+        }
+    }
+}
+
+static void script_list(void) {
+    if (script_module_count == 0) {
+        print("No script modules loaded\n");
+        return;
+    }
+    for (int i = 0; i < script_module_count; i++) {
+        print_decimal(i);
+        print(": ");
+        print(script_modules[i].name[0] ? script_modules[i].name : "(unnamed)");
+        print(" (");
+        print_decimal(script_modules[i].size);
+        print(script_modules[i].truncated ? " bytes, truncated)\n" : " bytes)\n");
+    }
+}
+
+void script_command(int argc, char* argv[]) {
+    if (argc < 2 || strcmp(argv[1], "list") == 0) {
+        script_list();
+        return;
+    }
+
+    if (strcmp(argv[1], "text") == 0) {
+        script_run(textspace_get_program_string(), "textspace");
+        return;
+    }
+
+    if (strcmp(argv[1], "run") == 0) {
+        int index = argc > 2 ? atoi(argv[2]) : 0;
+        if (index < 0 || index >= script_module_count) {
+            print("No such script module\n");
+            return;
+        }
+        script_run(script_modules[index].text, script_modules[index].name);
+        return;
+    }
+
+    print("Usage: script [list | run <module> | text]\n");
+}
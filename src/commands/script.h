@@ -0,0 +1,37 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+#include "../kernel/multiboot.h"
+
+#define SCRIPT_MAX_MODULES 4
+#define SCRIPT_MAX_SIZE    8192   // Bytes kept from each module
+#define SCRIPT_MAX_LINES   64     // Commands timed per run, the rest still run
+#define SCRIPT_LINE_SIZE   256
+
+/**
+ * @brief Copies the multiboot modules into kernel memory before the page
+ *        allocator can hand out the pages GRUB loaded them into.
+ * @param magic EAX at entry, modules are only trusted when it matches.
+ * @param info EBX at entry.
+ * @return Number of modules kept.
+ */
+int script_init(uint32_t magic, multiboot_info_t* info);
+
+/**
+ * @brief Runs newline separated shell commands through execute_command, timing
+ *        each with the TSC, and prints a summary table. Blank lines and lines
+ *        starting with '#' are skipped.
+ * @return Number of commands run.
+ */
+int script_run(const char* text, const char* name);
+
+/**
+ * @brief Runs every module whose command line contains "autorun".
+ */
+void script_autorun(void);
+
+// Lists modules and runs a module or the textspace buffer as a script
+void script_command(int argc, char* argv[]);
+
+#endif // SCRIPT_H
@@ -336,9 +336,7 @@ void textspace_command(int argc, char* argv[]) {
                         print("\n");
                     }
                 } else {
-                    print("Failed to load program: ");
-                    print(mpop_get_error_string(result));
-                    print("\n");
+                    mpop_print_load_error(cpu, result);
                 }
                 
                 mpop_cleanup(cpu);
@@ -594,9 +592,7 @@ print("  /save          - Save program (placeholder)\n");
                                 print("\n");
                             }
                         } else {
-                            print("Failed to load program: ");
-                            print(mpop_get_error_string(result));
-                            print("\n");
+                            mpop_print_load_error(cpu, result);
                         }
                         mpop_cleanup(cpu);
                     }
@@ -6,4 +6,7 @@
 // Function prototype for TEXTing the system
 void textspace_command(int argc, char* argv[]);
 
+// Editor buffer joined into one newline separated string
+char* textspace_get_program_string();
+
 #endif // TEXT_H
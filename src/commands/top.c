@@ -0,0 +1,183 @@
+#include "top.h"
+#include "../terminal/terminal.h"
+#include "../utility/utility.h"
+#include "../keyboard/keyboard.h"
+#include "../scheduler/task.h"
+#include "../timers/timer.h"
+#include "../timers/clocksource.h"
+#include "../cpu/cpu.h"
+#include "../io/io.h"
+
+#define TOP_REFRESH_MS 1000
+#define TOP_POLL_MS    50
+#define TOP_LINE_WIDTH 79
+
+static size_t top_line_used = 0;
+
+static void top_print(const char* text) {
+    print(text);
+    top_line_used += strlen(text);
+}
+
+// Right-align a number in a column of the given width
+static void top_column(uint32_t value, int width) {
+    char buffer[16];
+    itoa(value, buffer, 10);
+    for (int pad = width - (int)strlen(buffer); pad > 0; pad--) {
+        top_print(" ");
+    }
+    top_print(buffer);
+}
+
+// Blank the rest of the line so shorter values do not leave stale digits
+static void top_end_line(void) {
+    while (top_line_used < TOP_LINE_WIDTH) {
+        print(" ");
+        top_line_used++;
+    }
+    print("\n");
+    top_line_used = 0;
+}
+
+// Fixed 9 columns, longer names are cut
+static void top_name(const char* name) {
+    char column[10];
+    int i = 0;
+
+    for (; name && name[i] && i < 8; i++) {
+        column[i] = name[i];
+    }
+    for (; i < 9; i++) {
+        column[i] = ' ';
+    }
+    column[9] = '\0';
+    top_print(column);
+}
+
+static const char* top_state_name(const task_stats_t* stats) {
+    if (stats->is_idle) {
+        return "idle   ";
+    }
+    switch (stats->state) {
+        case TASK_RUNNING: return "running";
+        case TASK_READY:   return "ready  ";
+        case TASK_BLOCKED: return "blocked";
+        case TASK_ZOMBIE:  return "zombie ";
+        default:           return "?      ";
+    }
+}
+
+static uint32_t top_cycles_to_us(uint64_t cycles) {
+    return (uint32_t)(clocksource_tsc_to_ns(cycles) / 1000);
+}
+
+static void top_draw(task_stats_t* now, int count, uint64_t* last_runtime, uint64_t elapsed) {
+    terminal_set_position(0, 0);
+
+    CPUUsageStats usage;
+    get_cpu_usage_stats(&usage);
+
+    top_print("top - up ");
+    top_column(get_time_ms() / 1000, 0);
+    top_print("s, ");
+    top_column(count - num_cpus, 0);
+    top_print(" tasks, ");
+    top_column(num_cpus, 0);
+    top_print(" cpus ");
+    top_column(usage.kernel_time + usage.user_time, 0);
+    top_print("% busy (");
+    top_column(usage.kernel_time, 0);
+    top_print("% kernel, ");
+    top_column(usage.user_time, 0);
+    top_print("% user)");
+    top_end_line();
+    top_print("Press any key to exit");
+    top_end_line();
+    top_end_line();
+
+    top_print(" ID NAME     STATE   C PRIO  CPU% TIME(ms) SWITCH LAT(us) MAX(us) STACK(B)");
+    top_end_line();
+
+    for (int i = 0; i < count; i++) {
+        task_stats_t* task = &now[i];
+        uint32_t slot = task->is_idle ? MAX_TASKS + task->cpu : task->id;
+        uint64_t delta = task->runtime_cycles - last_runtime[slot];
+        last_runtime[slot] = task->runtime_cycles;
+
+        // Tenths of a percent of the refresh interval
+        uint32_t permille = elapsed ? (uint32_t)(delta * 1000 / elapsed) : 0;
+        if (permille > 1000) {
+            permille = 1000;
+        }
+
+        if (task->is_idle) {
+            top_print("  -");
+        } else {
+            top_column(task->id, 3);
+        }
+        top_print(" ");
+        top_name(task->name);
+        top_print(top_state_name(task));
+        top_column(task->cpu, 2);
+        top_column(task->prio, 5);
+        top_column(permille / 10, 5);
+        top_print(".");
+        top_column(permille % 10, 1);
+        top_column((uint32_t)(clocksource_tsc_to_ns(task->runtime_cycles) / 1000000), 9);
+        top_column(task->nr_switches, 7);
+        top_column(task->nr_wakeups ? top_cycles_to_us(task->wakeup_latency_total / task->nr_wakeups) : 0, 8);
+        top_column(top_cycles_to_us(task->wakeup_latency_max), 8);
+        if (task->stack_size) {
+            top_column(task->stack_used, 9);
+        } else {
+            top_print("        -");
+        }
+        top_end_line();
+    }
+
+    // Wipe rows left over from tasks that have exited since the last frame
+    for (int i = count; i <= MAX_TASKS; i++) {
+        top_end_line();
+    }
+
+    terminal_update_cursor();
+}
+
+void top_command(int argc, char* argv[]) {
+    task_stats_t snapshot[MAX_TASKS + MAX_CPUS];
+    uint64_t last_runtime[MAX_TASKS + MAX_CPUS];
+    uint64_t last_tsc = get_cpu_timestamp();
+
+    // Start every column from the current totals so the first frame shows a rate
+    memset((uint8_t*) last_runtime, 0, sizeof(last_runtime));
+    int count = task_snapshot(snapshot, MAX_TASKS + MAX_CPUS);
+    for (int i = 0; i < count; i++) {
+        last_runtime[snapshot[i].is_idle ? MAX_TASKS + snapshot[i].cpu : snapshot[i].id] = snapshot[i].runtime_cycles;
+    }
+    CPUUsageStats usage;
+    get_cpu_usage_stats(&usage);
+
+    terminal_clear_inFunction();
+    top_line_used = 0;
+
+    // First frame comes quickly, later ones at the normal rate
+    uint32_t interval = TOP_POLL_MS * 4;
+
+    while (true) {
+        for (uint32_t waited = 0; waited < interval; waited += TOP_POLL_MS) {
+            uint8_t scan_code;
+            if (keyboard_poll_scancode(&scan_code)) {
+                // The key is consumed here, so the shell does not see it
+                terminal_clear();
+                return;
+            }
+            delay_ms(TOP_POLL_MS);
+        }
+
+        uint64_t tsc = get_cpu_timestamp();
+        count = task_snapshot(snapshot, MAX_TASKS + MAX_CPUS);
+        top_draw(snapshot, count, last_runtime, tsc - last_tsc);
+        last_tsc = tsc;
+        interval = TOP_REFRESH_MS;
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef TOP_H
+#define TOP_H
+
+// Live per-task CPU usage table, refreshed in place until a key is pressed
+void top_command(int argc, char* argv[]);
+
+#endif // TOP_H
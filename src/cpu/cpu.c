@@ -1,6 +1,8 @@
 #include "cpu.h"
 #include "../utility/utility.h"
 #include "../terminal/terminal.h"
+#include "../timers/clocksource.h"
+#include "../scheduler/task.h"
 
 // CPU feature flags for CPUID function 1 (EDX register)
 #define CPUID_FEAT_EDX_FPU      (1 << 0)   // Floating Point Unit
@@ -289,6 +291,11 @@ uint64_t get_cpu_timestamp() {
 uint32_t get_cpu_frequency_mhz() {
     CPUIDInfo info;
     
+    // Prefer the rate measured against the PIT by the clocksource
+    if (clocksource_tsc_khz() != 0) {
+        return clocksource_tsc_khz() / 1000;
+    }
+    
     // Try to get frequency from CPUID function 0x16 (newer processors)
     get_cpuid(0x16, &info);
     if (info.eax != 0) {
@@ -758,15 +765,43 @@ void stop_cpu_monitoring() {
     print("CPU monitoring stopped.\n");
 }
 
+// Busy/idle split since the previous call, from the scheduler's TSC accounting
 void get_cpu_usage_stats(CPUUsageStats* stats) {
-    // This would calculate CPU usage statistics
-    // For now, just initialize to zero
+    static uint64_t last_user = 0, last_kernel = 0, last_idle = 0;
+    task_stats_t snapshot[MAX_TASKS + MAX_CPUS];
+    uint64_t user = 0, kernel = 0, idle = 0;
+    
     memset(stats, 0, sizeof(CPUUsageStats));
     
-    // Placeholder values
-    stats->user_time = 25;
-    stats->kernel_time = 10;
-    stats->idle_time = 65;
+    int count = task_snapshot(snapshot, MAX_TASKS + MAX_CPUS);
+    for (int i = 0; i < count; i++) {
+        if (snapshot[i].is_idle) {
+            idle += snapshot[i].runtime_cycles;
+        } else if (snapshot[i].is_user) {
+            user += snapshot[i].runtime_cycles;
+        } else {
+            kernel += snapshot[i].runtime_cycles;
+        }
+    }
+    
+    // Exited tasks drop out of the sums, never let a delta go negative
+    uint64_t d_user = user > last_user ? user - last_user : 0;
+    uint64_t d_kernel = kernel > last_kernel ? kernel - last_kernel : 0;
+    uint64_t d_idle = idle > last_idle ? idle - last_idle : 0;
+    last_user = user;
+    last_kernel = kernel;
+    last_idle = idle;
+    
+    uint64_t total = d_user + d_kernel + d_idle;
+    if (total == 0) {
+        stats->idle_time = 100;
+        stats->total_time = 100;
+        return;
+    }
+    
+    stats->user_time = (uint32_t)(d_user * 100 / total);
+    stats->kernel_time = (uint32_t)(d_kernel * 100 / total);
+    stats->idle_time = 100 - stats->user_time - stats->kernel_time;
     stats->total_time = 100;
 }
 
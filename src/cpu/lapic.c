@@ -0,0 +1,142 @@
+#include "lapic.h"
+#include "cpu.h"
+#include "../timers/clocksource.h"
+
+#define LAPIC_CALIBRATE_NS 10000000ULL
+
+static volatile uint32_t* lapic_base = 0;
+
+uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" :: "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+bool lapic_available(void) {
+    CPUIDInfo info;
+    get_cpuid(1, &info);
+
+    // APIC (bit 9) and MSR (bit 5)
+    return (info.edx & (1 << 9)) && (info.edx & (1 << 5));
+}
+
+bool lapic_enabled(void) {
+    return lapic_base != 0;
+}
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic_base[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_base[reg / 4] = value;
+    (void)lapic_base[LAPIC_REG_ID / 4]; // Read back to post the write
+}
+
+uint32_t lapic_id(void) {
+    if (!lapic_base) {
+        return 0;
+    }
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+int lapic_init(void) {
+    if (!lapic_available()) {
+        return 0;
+    }
+
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    if (!(base & IA32_APIC_BASE_ENABLE)) {
+        wrmsr(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_ENABLE);
+    }
+
+    // Paging is off, so the physical MMIO window is used directly
+    lapic_base = (volatile uint32_t*)(uint32_t)(base & 0xFFFFF000);
+
+    // Virtual wire mode: legacy PIC through LINT0, NMI on LINT1
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_DELIVERY_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_DELIVERY_NMI);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    return 1;
+}
+
+void lapic_init_ap(void) {
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    if (!(base & IA32_APIC_BASE_ENABLE)) {
+        wrmsr(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_ENABLE);
+    }
+
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low) {
+    if (!lapic_base) {
+        return;
+    }
+
+    // The high/low pair must not be split by an IPI sent from an interrupt
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile ("pause");
+    }
+
+    if (flags & 0x200) {
+        __asm__ volatile ("sti");
+    }
+}
+
+uint32_t lapic_timer_calibrate(void) {
+    if (!lapic_base) {
+        return 0;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+    // The counter runs while masked, count it down across a known interval
+    uint64_t start = clocksource_read_ns();
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+    while (clocksource_read_ns() - start < LAPIC_CALIBRATE_NS);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+    return (uint32_t)((uint64_t)elapsed * 1000000000ULL / LAPIC_CALIBRATE_NS);
+}
+
+void lapic_timer_periodic(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count ? count : 1);
+}
+
+void lapic_timer_oneshot(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count ? count : 1);
+}
+
+void lapic_timer_stop(void) {
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+}
@@ -0,0 +1,91 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Model specific register holding the LAPIC base and global enable bit
+#define IA32_APIC_BASE_MSR      0x1B
+#define IA32_APIC_BASE_ENABLE   (1 << 11)
+
+// Register offsets from the LAPIC base
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_VERSION       0x030
+#define LAPIC_REG_TPR           0x080
+#define LAPIC_REG_EOI           0x0B0
+#define LAPIC_REG_SVR           0x0F0
+#define LAPIC_REG_ICR_LOW       0x300
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_LVT_LINT0     0x350
+#define LAPIC_REG_LVT_LINT1     0x360
+#define LAPIC_REG_LVT_ERROR     0x370
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE        (1 << 8)
+#define LAPIC_LVT_MASKED        (1 << 16)
+#define LAPIC_TIMER_PERIODIC    (1 << 17)
+#define LAPIC_DELIVERY_EXTINT   0x700
+#define LAPIC_DELIVERY_NMI      0x400
+#define LAPIC_TIMER_DIVIDE_16   0x3
+
+// Interrupt command register (low dword) bits
+#define LAPIC_ICR_FIXED         0x000
+#define LAPIC_ICR_INIT          0x500
+#define LAPIC_ICR_STARTUP       0x600
+#define LAPIC_ICR_PENDING       (1 << 12)
+#define LAPIC_ICR_ASSERT        (1 << 14)
+#define LAPIC_ICR_LEVEL         (1 << 15)
+
+// Vectors owned by the LAPIC, just above the remapped PIC range
+#define LAPIC_TIMER_VECTOR      48
+#define LAPIC_RESCHED_VECTOR    49
+#define LAPIC_SPURIOUS_VECTOR   255
+
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+
+/**
+ * @brief True when CPUID reports an on-chip APIC and MSRs to program it.
+ */
+bool lapic_available(void);
+
+/**
+ * @brief Software-enables the LAPIC of the calling CPU in virtual wire mode,
+ *        so the 8259 keeps delivering legacy IRQs through LINT0.
+ * @return 1 on success, 0 when no LAPIC is present.
+ */
+int lapic_init(void);
+
+/**
+ * @brief Enables the LAPIC of an application processor. Only the boot CPU
+ *        takes legacy IRQs, so LINT0/LINT1 stay masked here.
+ */
+void lapic_init_ap(void);
+
+/**
+ * @brief Sends an IPI to the CPU with the given APIC ID and waits until the
+ *        LAPIC has accepted it. icr_low holds the delivery mode and vector.
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+
+bool lapic_enabled(void);
+
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+/**
+ * @brief Measures the LAPIC timer rate (after the divide by 16) against the
+ *        clocksource. Returns the rate in Hz, 0 on failure.
+ */
+uint32_t lapic_timer_calibrate(void);
+
+void lapic_timer_periodic(uint32_t count);
+void lapic_timer_oneshot(uint32_t count);
+void lapic_timer_stop(void);
+
+#endif // LAPIC_H
@@ -0,0 +1,106 @@
+#include "smp.h"
+#include "lapic.h"
+#include "../acpi/acpi.h"
+#include "../scheduler/task.h"
+#include "../timers/tick.h"
+#include "../timers/clocksource.h"
+#include "../utility/utility.h"
+
+// In boot.asm
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern volatile uint32_t ap_stack;
+
+extern GDTPointer gdt_pointer;
+extern IDTPointer idt_pointer;
+
+// The tick may still be in tickless idle, so spin on the clocksource instead
+static void smp_udelay(uint32_t us) {
+    uint64_t end = clocksource_read_ns() + (uint64_t)us * 1000;
+    while (clocksource_read_ns() < end) {
+        cpu_relax();
+    }
+}
+
+// INIT, then two startup IPIs as the MP spec asks, then wait for the AP to
+// mark itself online from task_start_ap
+static bool smp_start_ap(uint32_t index, uint8_t apic_id) {
+    cpu_t* cpu = &cpus[index];
+
+    cpu->apic_id = apic_id;
+    apic_to_cpu[apic_id] = (uint8_t) index;
+    ap_stack = cpu->idle->kesp_bottom;
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    smp_udelay(10000);
+
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+        smp_udelay(200);
+    }
+
+    uint64_t deadline = clocksource_read_ns() + AP_STARTUP_MS * 1000000ULL;
+    while (!cpu->online && clocksource_read_ns() < deadline) {
+        cpu_relax();
+    }
+    return cpu->online;
+}
+
+int smp_init(void) {
+    acpi_madt_info_t madt;
+
+    if (!lapic_available() || !acpi_parse_madt(&madt) || madt.cpu_count < 2) {
+        info("Single processor, APs not started", __FILE__);
+        return 1;
+    }
+
+    // With the PIT as tick device the LAPIC is still off, IPIs need it
+    if (!lapic_enabled() && !lapic_init()) {
+        return 1;
+    }
+    if (tick_lapic_hz() < TICK_HZ) {
+        warn("LAPIC timer unusable, APs not started", __FILE__);
+        return 1;
+    }
+
+    memcpy((void*) AP_TRAMPOLINE_ADDR, ap_trampoline_start,
+           (size_t)(ap_trampoline_end - ap_trampoline_start));
+
+    uint32_t bsp_id = lapic_id();
+    cpus[0].apic_id = bsp_id;
+    apic_to_cpu[bsp_id] = 0;
+    smp_active = true;
+
+    // APs start one at a time, they all come up through the same ap_stack
+    uint32_t next = 1;
+    for (uint32_t i = 0; i < madt.cpu_count && next < MAX_CPUS; i++) {
+        if (madt.apic_ids[i] == bsp_id) {
+            continue;
+        }
+        if (smp_start_ap(next, madt.apic_ids[i])) {
+            next++;
+            num_cpus = next;
+        } else {
+            warn("Application processor did not start", __FILE__);
+        }
+    }
+
+    return 1;
+}
+
+void ap_main(void) {
+    // Swap the trampoline GDT for the kernel's; there is no TSS load, user
+    // tasks only ever run on the boot CPU
+    load_gdt((uint32_t) &gdt_pointer);
+    asm volatile("lidt %0" :: "m"(idt_pointer));
+
+    lapic_init_ap();
+    tick_start_ap();
+
+    // Does not return
+    task_start_ap(this_cpu()->index);
+}
+
+uint32_t smp_cpu_count(void) {
+    return num_cpus;
+}
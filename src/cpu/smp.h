@@ -0,0 +1,26 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Real mode entry of the APs, the startup IPI vector is its page number
+#define AP_TRAMPOLINE_ADDR  0x8000
+#define AP_STARTUP_MS       100     // How long to wait for an AP to check in
+
+/**
+ * @brief Starts the application processors listed in the MADT with the
+ *        INIT/SIPI/SIPI sequence; each one runs its own idle task and takes
+ *        work from the others. Needs the scheduler and the tick.
+ * @return 1 on success, including when the machine has a single CPU.
+ */
+int smp_init(void);
+
+/**
+ * @brief C entry of an AP, called from the trampoline on its idle stack.
+ */
+void ap_main(void);
+
+uint32_t smp_cpu_count(void);
+
+#endif // SMP_H
@@ -3,12 +3,16 @@
 #include "../scheduler/task.h"
 #include "../timers/timer.h"
 #include "../timers/date.h"
+#include "../timers/clocksource.h"
+#include "../timers/tick.h"
 #include "../errors/error.h"
 #include "../memory/memory.h"
 #include "../sound/sound.h"
 #include "../io/io.h"
 #include "../mpop/mpop.h"
 #include "../cpu/cpu.h"
+#include "../cpu/smp.h"
+#include "../utility/utility.h"
 #include "../driver/driver.h"
 
 #include "../arp/arp.h"
@@ -29,13 +33,36 @@
 #include "../commands/ping.h"
 #include "../commands/radifetch.h"
 #include "../commands/gambling.h"
+#include "../commands/top.h"
+#include "../scheduler/workqueue.h"
+#include "../commands/schedbench.h"
+#include "../commands/script.h"
+#include "multiboot.h"
 
 
-void kernel_main() {
+void kernel_main(uint32_t magic, multiboot_info_t* boot_info) {
     terminal_initialize();
+    
+    // Before memory_init, the pages holding the modules are not reserved
+    int modules = script_init(magic, boot_info);
+    if (modules > 0) {
+        print("SCRIPT - Loaded ");
+        print_decimal(modules);
+        print(" modules.\n");
+    }
     memory_init();
     speaker_init();
     debug_memory_status();
+    
+    // Calibrate before initialize_cpu_info so it picks up the measured TSC rate
+    if (!clocksource_init()) {
+        handle_error("\nCLOCKSOURCE - Initialize Failed\n", "kernel");
+    } else {
+        print("CLOCKSOURCE - Initialized (");
+        print(clocksource_name());
+        print(").\n");
+    }
+    
     initialize_cpu_info();
     init_physical_memory();
     set_keyboard_leds(0);
@@ -72,6 +99,39 @@ void kernel_main() {
         print("TASKS - Initialized.\n");
     }
     
+    if (!tick_init()) {
+        handle_error("TICK - Initialize Failed\n", "kernel");
+    } else {
+        print("TICK - Initialized (");
+        print(tick_device_name());
+        print(tick_is_nohz() ? ", tickless idle).\n" : ", periodic).\n");
+    }
+    
+    if (!keyboard_init()) {
+        handle_error("KEYBOARD - Initialize Failed\n", "kernel");
+    } else {
+        print("KEYBOARD - Initialized.\n");
+    }
+    
+    // Everything that raises interrupts is set up, let them in
+    enable_interrupts();
+    
+    if (!workqueue_init()) {
+        handle_error("WORKQUEUE - Initialize Failed\n", "kernel");
+    } else {
+        print("WORKQUEUE - Initialized.\n");
+    }
+    
+    if (!smp_init()) {
+        handle_error("SMP - Initialize Failed\n", "kernel");
+    } else {
+        char cpu_count[12];
+        itoa(smp_cpu_count(), cpu_count, 10);
+        print("SMP - Initialized (");
+        print(cpu_count);
+        print(" CPUs).\n");
+    }
+    
     if (!register_command("help", "Displays this message", help_command)) {
         system_error("Command registration", "0x101");
     }
@@ -132,6 +192,15 @@ void kernel_main() {
     if (!register_command("gambling", "Gamble (blackjack)", gambling_command)) {
         system_error("Command registration", "0x134");
     }
+    if (!register_command("top", "Per-task CPU usage", top_command)) {
+        system_error("Command registration", "0x135");
+    }
+    if (!register_command("schedbench", "Context switch benchmark", schedbench_command)) {
+        system_error("Command registration", "0x136");
+    }
+    if (!register_command("script", "Runs a command script", script_command)) {
+        system_error("Command registration", "0x137");
+    }
     if (radifetch_init() != 0) {
         handle_error("RADIFETCH - Initialize Failed\n", "kernel");
     } else {
@@ -152,6 +221,7 @@ void kernel_main() {
     //speaker_play_error_sound();
     arp_init(RTL8139->mac_address, "10.0.2.2");
     //meltdown_screen("Test Meltdown", __FILE__, 167, 0x14, 1230, 190);
+    script_autorun();
     keyboard_read_input();
     
     
@@ -0,0 +1,31 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+// Value the bootloader leaves in EAX for a multiboot 1 kernel
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+#define MULTIBOOT_INFO_MEMORY  0x00000001
+#define MULTIBOOT_INFO_CMDLINE 0x00000004
+#define MULTIBOOT_INFO_MODS    0x00000008
+
+// Boot information handed over in EBX, only the leading fields are used
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;    // Module command line from the grub.cfg module line
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+#endif // MULTIBOOT_H
@@ -5,6 +5,7 @@
 #include "../errors/error.h"      // For error handling functions
 #include "../io/io.h"             // For I/O operations
 #include "../scheduler/task.h"
+#include "../timers/tick.h"
 #include <stdint.h>
 #define MAX_HISTORY 10 // Maximum number of commands to store in history
 #define COMMAND_BUFFER_SIZE 256
@@ -18,6 +19,13 @@ int current_history_index = -1; // Current position in history (-1 means not bro
 Command commands[MAX_COMMANDS]; // Array to hold commands
 size_t command_count = 0;       // Number of registered commands
 
+// Open-addressed index over commands[], slot holds the command index + 1 and
+// 0 marks an empty slot. Kept at most half full so probes stay short
+static uint8_t command_hash[COMMAND_HASH_SIZE];
+
+// Command indexes sorted by name, Tab completion finds a prefix range in it
+static uint8_t command_sorted[MAX_COMMANDS];
+
 // Shift state variable
 bool shift_active = false;
 
@@ -39,6 +47,37 @@ void display_prompt()
     terminal_update_cursor();
 }
 
+// FNV-1a over the command name
+static uint32_t command_hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot holding name, or the empty slot where it would go
+static uint32_t command_hash_slot(const char *name)
+{
+    uint32_t slot = command_hash_name(name) & (COMMAND_HASH_SIZE - 1);
+    while (command_hash[slot] != 0 && strcmp(commands[command_hash[slot] - 1].name, name) != 0)
+    {
+        slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+    }
+    return slot;
+}
+
+Command *find_command(const char *name)
+{
+    uint32_t slot = command_hash_slot(name);
+    if (command_hash[slot] == 0)
+        return NULL;
+    return &commands[command_hash[slot] - 1];
+}
+
 int register_command(const char *name, const char *description, void (*execute)(int, char *[]))
 {
     if (command_count >= MAX_COMMANDS)
@@ -52,22 +91,54 @@ int register_command(const char *name, const char *description, void (*execute)(
     }
 
     // Check if command already exists
-    for (int i = 0; i < command_count; i++)
+    uint32_t slot = command_hash_slot(name);
+    if (command_hash[slot] != 0)
     {
-        if (strcmp(commands[i].name, name) == 0)
-        {
-            return 0; // Failed: command already exists
-        }
+        return 0; // Failed: command already exists
     }
 
     commands[command_count].name = name;
     commands[command_count].description = description;
     commands[command_count].execute = execute;
+    command_hash[slot] = command_count + 1;
+
+    // Insertion step keeps the completion index sorted
+    size_t pos = command_count;
+    while (pos > 0 && strcmp(commands[command_sorted[pos - 1]].name, name) > 0)
+    {
+        command_sorted[pos] = command_sorted[pos - 1];
+        pos--;
+    }
+    command_sorted[pos] = command_count;
     command_count++;
 
     return 1; // Success
 }
 
+// First position in command_sorted whose name starts with prefix, *matches
+// gets how many consecutive entries do
+static size_t find_command_prefix(const char *prefix, size_t length, size_t *matches)
+{
+    size_t low = 0;
+    size_t high = command_count;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (strncmp(commands[command_sorted[mid]].name, prefix, length) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    size_t end = low;
+    while (end < command_count && strncmp(commands[command_sorted[end]].name, prefix, length) == 0)
+    {
+        end++;
+    }
+    *matches = end - low;
+    return low;
+}
+
 // Function to add command to history
 void add_to_history(const char *command)
 {
@@ -201,22 +272,124 @@ void redraw_command_line(const char *command, size_t *command_length)
     update_cursor_display_simple(command, *command_length);
 }
 
+// Scancode ring filled by IRQ1. The handler is the only writer of the head and
+// the foreground reader the only writer of the tail, so neither needs a lock
+static uint8_t scancode_ring[KEYBOARD_RING_SIZE];
+static volatile uint32_t scancode_head = 0; // Next slot the IRQ handler fills
+static volatile uint32_t scancode_tail = 0; // Next slot a reader takes
+static uint32_t scancode_dropped = 0;
+static wait_queue_t keyboard_wait;
+static bool keyboard_irq_enabled = false;
+
+static void keyboard_irq_handler()
+{
+    // The controller holds one byte at a time, take whatever is there
+    for (int i = 0; i < 16 && (inb(0x64) & 0x01); i++)
+    {
+        uint8_t scan_code = inb(0x60);
+        if (scancode_head - scancode_tail >= KEYBOARD_RING_SIZE)
+        {
+            scancode_dropped++; // Reader fell far behind, keep the older keys
+            continue;
+        }
+        scancode_ring[scancode_head % KEYBOARD_RING_SIZE] = scan_code;
+        asm volatile("" ::: "memory"); // Fill the slot before publishing it
+        scancode_head++;
+    }
+
+    wake_up(&keyboard_wait);
+}
+
+int keyboard_init()
+{
+    wait_queue_init(&keyboard_wait);
+
+    uint32_t flags = irq_save();
+    if (!register_irq_handler(1, keyboard_irq_handler))
+    {
+        irq_restore(flags);
+        return 0;
+    }
+
+    // A byte left over from boot would keep IRQ1 from ever firing again
+    while (inb(0x64) & 0x01)
+    {
+        inb(0x60);
+    }
+    keyboard_irq_enabled = true;
+    irq_restore(flags);
+
+    return 1;
+}
+
+// Take the next scancode without waiting, false when none is pending
+bool keyboard_poll_scancode(uint8_t *scan_code)
+{
+    if (!keyboard_irq_enabled)
+    {
+        if (!(port_byte_in(0x64) & 0x01))
+            return false;
+        *scan_code = port_byte_in(0x60);
+        return true;
+    }
+
+    if (scancode_tail == scancode_head)
+        return false;
+
+    *scan_code = scancode_ring[scancode_tail % KEYBOARD_RING_SIZE];
+    asm volatile("" ::: "memory"); // Read the slot before handing it back
+    scancode_tail++;
+    return true;
+}
+
+uint32_t keyboard_dropped_count()
+{
+    return scancode_dropped;
+}
+
 // Function to check if a key is pressed
 bool is_key_pressed()
 {
+    if (keyboard_irq_enabled)
+        return scancode_head != scancode_tail;
     return (port_byte_in(0x64) & 0x01) != 0; // Check if a key is pressed
 }
 
-// Function to wait for a key press
-void keyboard_await()
+// Sleep until a scancode is waiting. Once IRQ1 feeds the ring the task
+// blocks on the keyboard wait queue and the CPU is free for others or halted
+static void keyboard_idle()
 {
-    // print("Press any key to continue...\n"); // Prompt the user
-    while (!is_key_pressed())
+    if (!tick_ready())
+        return;
+
+    if (keyboard_irq_enabled && scheduler_ready() && current_task != this_cpu()->idle)
     {
-        // Wait until a key is pressed
+        wait_event(keyboard_wait, scancode_head != scancode_tail);
+        return;
     }
-    // Clear the key from the buffer
-    port_byte_in(0x60); // Read from the keyboard port to clear the interrupt
+
+    disable_interrupts();
+    if (is_key_pressed())
+        enable_interrupts();
+    else
+        task_idle_wait();
+}
+
+uint8_t keyboard_read_scancode()
+{
+    uint8_t scan_code;
+    while (!keyboard_poll_scancode(&scan_code))
+    {
+        keyboard_idle();
+    }
+    return scan_code;
+}
+
+// Function to wait for a key press
+void keyboard_await()
+{
+    // Wait for a key and drop it
+    keyboard_read_scancode();
 }
 
 // Function to execute commands
@@ -239,14 +412,14 @@ void execute_command(const char *command)
         token = strtok(NULL, " "); // Get the next token
     }
 
-    // Check if the command matches any loaded command
-    for (size_t i = 0; i < command_count; i++)
+    if (argc == 0)
+        return; // Only spaces
+
+    Command *cmd = find_command(argv[0]);
+    if (cmd)
     {
-        if (strcmp(argv[0], commands[i].name) == 0)
-        {
-            commands[i].execute(argc, argv); // Call the command's execute function with arguments
-            return;
-        }
+        cmd->execute(argc, argv); // Call the command's execute function with arguments
+        return;
     }
 
     // If no command matched, handle unknown command
@@ -457,15 +630,70 @@ bool handle_arrow_keys(uint8_t scan_code, char *command_buffer, size_t *command_
 // Add this global variable at the top with your other globals
 bool caps_lock_active = false;
 
+// Tab on the command name: finish it when only one command fits, otherwise
+// extend to the longest shared prefix, and list the candidates if that adds nothing
+static void complete_command(char *command_buffer, size_t *command_length)
+{
+    if (cursor_position != *command_length)
+        return;
+    for (size_t i = 0; i < *command_length; i++)
+    {
+        if (command_buffer[i] == ' ')
+            return; // Only the command name completes
+    }
+
+    size_t matches;
+    size_t first = find_command_prefix(command_buffer, *command_length, &matches);
+    if (matches == 0)
+        return;
+
+    // Longest prefix the first and last match share covers every match between
+    const char *low = commands[command_sorted[first]].name;
+    const char *high = commands[command_sorted[first + matches - 1]].name;
+    size_t common = *command_length;
+    while (low[common] && low[common] == high[common])
+    {
+        common++;
+    }
+
+    if (common > *command_length)
+    {
+        for (size_t i = *command_length; i < common && *command_length < COMMAND_BUFFER_SIZE - 1; i++)
+        {
+            insert_char_at_cursor(command_buffer, command_length, low[i]);
+        }
+        if (matches == 1 && *command_length < COMMAND_BUFFER_SIZE - 1)
+        {
+            insert_char_at_cursor(command_buffer, command_length, ' ');
+        }
+        terminal_update_cursor();
+        return;
+    }
+
+    if (matches == 1)
+        return;
+
+    print("\n");
+    for (size_t i = 0; i < matches; i++)
+    {
+        print(commands[command_sorted[first + i]].name);
+        print("  ");
+    }
+    print("\n");
+    display_prompt();
+    command_buffer[*command_length] = '\0';
+    print(command_buffer);
+    terminal_update_cursor();
+}
+
 void keyboard_handler()
 {
     static char command_buffer[COMMAND_BUFFER_SIZE];
     static size_t command_length = 0;
 
-    if (is_key_pressed())
+    uint8_t scan_code;
+    if (keyboard_poll_scancode(&scan_code))
     {
-        uint8_t scan_code = port_byte_in(0x60); // Read from keyboard port
-
         // Handle arrow keys first
         if (handle_arrow_keys(scan_code, command_buffer, &command_length))
         {
@@ -495,7 +723,8 @@ void keyboard_handler()
             }
             else if (scan_code == 0x0F)
             { // Tab key
-              // On explicit Tab press, list matches
+                complete_command(command_buffer, &command_length);
+                current_history_index = -1;
             }
             else if (scan_code < sizeof(keyboard_map))
             {
@@ -571,6 +800,7 @@ void keyboard_read_input()
     display_prompt(); // Display prompt for the first command
     while (true)
     {
+        keyboard_idle();
         keyboard_handler(); // Call the keyboard handler function when a key is pressed
     }
 }
@@ -581,9 +811,10 @@ void keyboard_input_secure(char *userinput)
     size_t command_length = 0;
     while (true)
     {
-        if (is_key_pressed())
+        keyboard_idle();
+        uint8_t scan_code;
+        if (keyboard_poll_scancode(&scan_code))
         {
-            uint8_t scan_code = port_byte_in(0x60); // Read from keyboard port
             if (scan_code < sizeof(keyboard_map))
             {
                 if (scan_code & 0x80)
@@ -658,10 +889,10 @@ int keyboard_input(char *userinput)
 
     while (true)
     {
-        if (is_key_pressed())
+        keyboard_idle();
+        uint8_t scan_code;
+        if (keyboard_poll_scancode(&scan_code))
         {
-            uint8_t scan_code = port_byte_in(0x60);
-
             if (scan_code & 0x80)
             {
                 uint8_t key_code = scan_code & 0x7F;
@@ -743,9 +974,10 @@ uint8_t keyboard_wait_for_key(bool dump_scancode)
 {
     while (true)
     {
-        if (is_key_pressed())
+        keyboard_idle();
+        uint8_t scan_code;
+        if (keyboard_poll_scancode(&scan_code))
         {
-            uint8_t scan_code = port_byte_in(0x60); // Read from keyboard port
             if (dump_scancode)
             {
                 // Print the scan code if the flag is set
@@ -776,9 +1008,9 @@ uint8_t keyboard_wait_for_key(bool dump_scancode)
 
 uint8_t keyboard_key()
 {
-    keyboard_await();
+    uint8_t scan_code = keyboard_read_scancode();
     print("\n");
-    return port_byte_in(0x60);
+    return scan_code;
 }
 
 void keyboard_wait_for_input()
@@ -807,7 +1039,7 @@ void keyboard_wait_for_output()
 
 static uint8_t led_status = 0;
 
-void set_keyboard_leds(uint8_t leds)
+static void keyboard_send_leds(uint8_t leds)
 {
     keyboard_wait_for_input();
     outb(0x60, 0xED);
@@ -825,6 +1057,15 @@ void set_keyboard_leds(uint8_t leds)
     }
 }
 
+void set_keyboard_leds(uint8_t leds)
+{
+    // Mask IRQ1 so the handler does not swallow the ACK bytes
+    uint8_t mask = inb(0x21);
+    outb(0x21, mask | 0x02);
+    keyboard_send_leds(leds);
+    outb(0x21, mask);
+}
+
 void toggle_caps_lock()
 {
     led_status ^= 4;
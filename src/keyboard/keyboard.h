@@ -10,13 +10,42 @@ typedef struct {
     void (*execute)(int, char*[]); // Update to accept arguments
 } Command;
 
+// Scancodes IRQ1 can buffer before the oldest unread ones win
+#define KEYBOARD_RING_SIZE 256
+
 // Function prototypes
+
+/**
+ * @brief Hooks IRQ1 so scancodes are queued as they arrive instead of being
+ *        polled from port 0x60. Needs the IDT and the scheduler.
+ * @return 1 on success, 0 on failure.
+ */
+int keyboard_init();
+
+/**
+ * @brief Takes the next buffered scancode without blocking.
+ * @return false when no key is waiting.
+ */
+bool keyboard_poll_scancode(uint8_t* scan_code);
+
+/**
+ * @brief Blocks the calling task until a scancode arrives and returns it.
+ */
+uint8_t keyboard_read_scancode();
+uint32_t keyboard_dropped_count();
+
 bool is_key_pressed();
 void execute_command(const char* command);
 void keyboard_handler();
 void keyboard_task();
 void keyboard_await();
 int register_command(const char* name, const char* description, void (*execute)(int, char*[]));
+
+/**
+ * @brief Looks a command up by name in the registry's hash index.
+ * @return The command, or NULL when none is registered under name.
+ */
+Command* find_command(const char* name);
 int keyboard_input(char* userinput);
 void keyboard_input_secure(char* userinput);
 void keyboard_read_input();
@@ -28,6 +57,7 @@ void set_keyboard_leds(uint8_t leds);
 #define MAX_HISTORY 10 // Maximum number of commands to store in history
 #define COMMAND_BUFFER_SIZE 1000 // Size of the command buffer
 #define MAX_COMMANDS 100 // Maximum number of commands
+#define COMMAND_HASH_SIZE 256 // Power of two, at least twice MAX_COMMANDS
 #define LED_CAPS_LOCK = 4
 
 
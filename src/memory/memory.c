@@ -1,6 +1,7 @@
 #include "memory.h"
 #include "../terminal/terminal.h"
 #include "../errors/error.h"
+#include "../scheduler/spinlock.h"
 
 // Memory pool for kernel allocations
 uint8_t memory_pool[MEMORY_POOL_SIZE]; 
@@ -39,6 +40,9 @@ static uint8_t* page_bitmap = NULL;
 static uint32_t total_pages = 0;
 static uint32_t allocated_pages = 0;
 
+// End of the kernel image including .bss and .heap, from linker.ld
+extern char _kernel_end[];
+
 // Function to detect memory using BIOS E820 (simplified for kernel mode)
 int detect_memory_e820(MemoryMap* memory_map) {
     // Since we're in protected mode, we'll simulate or use bootloader-provided info
@@ -197,6 +201,13 @@ void init_physical_memory(void) {
     
     allocated_pages = 0;
     used_physical_memory = 0;
+    
+    // Low memory and the kernel image are never handed out, this also keeps
+    // page 0 reserved so an address of 0 can mean failure
+    uint32_t kernel_pages = PAGE_ALIGN((uint32_t) _kernel_end) / PAGE_SIZE;
+    for (uint32_t page = 0; page < kernel_pages && page < total_pages; page++) {
+        set_page_allocated(page);
+    }
 }
 
 void memory_init(void) {
@@ -604,10 +615,15 @@ void enable_paging(void) {
 
 // Additional utility functions for physical memory management
 
+// Stack and buffer allocations can come from any CPU
+static spinlock_t page_lock = SPINLOCK_INIT;
+
 // Allocate contiguous physical pages
 uint32_t allocate_contiguous_pages(uint32_t num_pages) {
     if (!page_bitmap || num_pages == 0) return 0;
     
+    uint32_t flags = spin_lock_irqsave(&page_lock);
+    
     // Find contiguous free pages
     for (uint32_t start_page = 0; start_page <= total_pages - num_pages; start_page++) {
         bool found_contiguous = true;
@@ -625,20 +641,25 @@ uint32_t allocate_contiguous_pages(uint32_t num_pages) {
             for (uint32_t i = 0; i < num_pages; i++) {
                 set_page_allocated(start_page + i);
             }
+            spin_unlock_irqrestore(&page_lock, flags);
             return start_page * PAGE_SIZE; // Return physical address
         }
     }
     
+    spin_unlock_irqrestore(&page_lock, flags);
     return 0; // No contiguous block found
 }
 
 // Free contiguous physical pages
 void free_contiguous_pages(uint32_t physical_addr, uint32_t num_pages) {
     uint32_t start_page = physical_addr / PAGE_SIZE;
+    uint32_t flags = spin_lock_irqsave(&page_lock);
     
     for (uint32_t i = 0; i < num_pages; i++) {
         set_page_free(start_page + i);
     }
+    
+    spin_unlock_irqrestore(&page_lock, flags);
 }
 
 // Get memory statistics
@@ -4,6 +4,9 @@
 #include "../keyboard/keyboard.h"
 #include "../memory/memory.h"
 #include "../utility/utility.h"
+#include "../utility/bench.h"
+#include "../cpu/cpu.h"
+#include "../scheduler/kthread.h"
 
 const char* MPOP_TESTr =
     "; MPOP Test Suite - Comprehensive CPU Test\n"
@@ -212,45 +215,108 @@ const char* MPOP_FACTORIAL =
     "PRINT R1\n"        // printr result
     "HALT\n";
 
-// Static CPU instance for simplicity
-static mpop_cpu_t static_cpu;
-static bool cpu_initialized = false;
+// Trial division over 2..4999, long enough to be worth timing
+const char* MPOP_PRIMES =
+    "mov R0, 2\n"       // Candidate
+    "mov R3, 0\n"       // Primes found
+    "next:\n"
+    "mov R1, 2\n"       // Divisor
+    "try:\n"
+    "mul R2, R1, R1\n"
+    "CMP R2, R0\n"
+    "JG prime\n"        // No divisor up to the square root
+    "mod R2, R0, R1\n"
+    "JZ composite\n"
+    "INC R1\n"
+    "JMP try\n"
+    "prime:\n"
+    "INC R3\n"
+    "composite:\n"
+    "INC R0\n"
+    "CMP R0, 5000\n"
+    "JL next\n"
+    "PRINT R3\n"        // 669
+    "HALT\n";
+
+// Instance pool. Slots are claimed under the lock, everything else in a CPU
+// belongs to whoever holds it or to the task running its program. The done
+// queues start out empty from the zeroed array and live as long as the pool,
+// since a finishing task may still be waking one after its slot was reclaimed
+static mpop_cpu_t mpop_instances[MPOP_MAX_INSTANCES];
+static spinlock_t mpop_pool_lock = SPINLOCK_INIT;
 
 mpop_cpu_t* mpop_init(void) {
-    if (cpu_initialized) {
-        mpop_reset(&static_cpu);
-        return &static_cpu;
+    mpop_cpu_t* cpu = NULL;
+    
+    uint32_t flags = spin_lock_irqsave(&mpop_pool_lock);
+    for (int i = 0; i < MPOP_MAX_INSTANCES; i++) {
+        if (!mpop_instances[i].in_use && !mpop_instances[i].task_active) {
+            cpu = &mpop_instances[i];
+            cpu->in_use = true;
+            break;
+        }
     }
+    spin_unlock_irqrestore(&mpop_pool_lock, flags);
     
-    // Initialize CPU state
+    if (!cpu) {
+        return NULL;
+    }
+    
+    // Initialize CPU state. Program and JIT buffers of the slot are kept
     for (int i = 0; i < MPOP_REGISTER_COUNT; i++) {
-        static_cpu.registers[i] = 0;
+        cpu->registers[i] = 0;
     }
     
     for (int i = 0; i < MPOP_MEMORY_SIZE; i++) {
-        static_cpu.memory[i] = 0;
+        cpu->memory[i] = 0;
     }
     
     for (int i = 0; i < MPOP_STACK_SIZE; i++) {
-        static_cpu.stack[i] = 0;
+        cpu->stack[i] = 0;
+    }
+    
+    for (int i = 0; i < MPOP_LABEL_HASH_SIZE; i++) {
+        cpu->label_hash[i] = 0;
     }
     
-    static_cpu.pc = 0;
-    static_cpu.sp = 0;
-    static_cpu.zero_flag = false;
-    static_cpu.carry_flag = false;
-    static_cpu.negative_flag = false;
-    static_cpu.program_size = 0;
-    static_cpu.label_count = 0;
-    static_cpu.running = false;
-    static_cpu.debug_mode = false;
+    cpu->pc = 0;
+    cpu->sp = 0;
+    cpu->zero_flag = false;
+    cpu->carry_flag = false;
+    cpu->negative_flag = false;
+    cpu->program_size = 0;
+    cpu->slow_count = 0;
+    cpu->threaded = false;
+    cpu->label_count = 0;
+    cpu->running = false;
+    cpu->debug_mode = false;
+    cpu->jit_ready = false;
+    cpu->jit_enabled = false;
+    cpu->quiet = false;
+    cpu->optimize = true;
+    cpu->profiling = false;
+    cpu->profile_size = 0;
+    cpu->release_on_exit = false;
+    cpu->background = false;
+    cpu->ctrl_held = false;
+    cpu->cancel = false;
+    cpu->task_id = -1;
+    cpu->status = MPOP_SUCCESS;
     
-    cpu_initialized = true;
-    return &static_cpu;
+    return cpu;
 }
 
 void mpop_cleanup(mpop_cpu_t* cpu) {
-    // Nothing to clean up with static allocation
+    if (!cpu) return;
+    
+    // A background task still owns the CPU, it gives it back when done
+    uint32_t flags = spin_lock_irqsave(&mpop_pool_lock);
+    if (cpu->task_active) {
+        cpu->release_on_exit = true;
+    } else {
+        cpu->in_use = false;
+    }
+    spin_unlock_irqrestore(&mpop_pool_lock, flags);
 }
 
 void mpop_reset(mpop_cpu_t* cpu) {
@@ -266,6 +332,7 @@ void mpop_reset(mpop_cpu_t* cpu) {
     cpu->carry_flag = false;
     cpu->negative_flag = false;
     cpu->running = false;
+    cpu->cancel = false;
 }
 
 const char* mpop_get_error_string(int error) {
@@ -280,89 +347,152 @@ const char* mpop_get_error_string(int error) {
         case MPOP_ERROR_LABEL_NOT_FOUND: return "Label not found";
         case MPOP_ERROR_PROGRAM_TOO_LARGE: return "Program too large";
         case MPOP_ERROR_PARSE_ERROR: return "Parse error";
+        case MPOP_ERROR_DUPLICATE_LABEL: return "Duplicate label";
+        case MPOP_ERROR_CANCELLED: return "Cancelled";
+        case MPOP_ERROR_NO_INPUT: return "No keyboard in the background";
+        case MPOP_ERROR_BUSY: return "Program is running";
+        case MPOP_ERROR_NO_TASK: return "No task available for the program";
         default: return "Unknown error";
     }
 }
 
-int mpop_parse_operand(const char* str, mpop_operand_t* operand) {
-    if (!str || !operand) return MPOP_ERROR_PARSE_ERROR;
-    
-    // Skip whitespace
-    while (*str == ' ' || *str == '\t') str++;
+void mpop_print_load_error(mpop_cpu_t* cpu, int error) {
+    printr("Failed to load program: %s", mpop_get_error_string(error));
+    if (cpu && cpu->error_line) {
+        printr(" (line %d, column %d)", cpu->error_line, cpu->error_column);
+    }
+    printr("\n");
+}
+
+// Characters that end an operand or mnemonic in assembly text
+static bool mpop_is_delimiter(char c) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == ';';
+}
+
+// Read one operand at *cursor and leave the cursor on the character after it.
+// A register is R or r followed only by digits, so labels like "result" stay labels
+static int mpop_scan_operand(const char** cursor, mpop_operand_t* operand) {
+    const char* str = *cursor;
     
-    if (*str == 'R' || *str == 'r') {
-        // Register operand (R0, R1, etc.)
+    if (*str == '[') {
+        // Memory address [123]
         str++;
-        int reg_num = 0;
+        uint32_t address = 0;
+        const char* digits = str;
         while (*str >= '0' && *str <= '9') {
-            reg_num = reg_num * 10 + (*str - '0');
+            address = address * 10 + (*str - '0');
             str++;
         }
         
-        if (!MPOP_IS_VALID_REGISTER(reg_num)) {
-            return MPOP_ERROR_INVALID_REGISTER;
+        if (str == digits || *str != ']') return MPOP_ERROR_PARSE_ERROR;
+        str++;
+        
+        if (!MPOP_IS_VALID_ADDRESS(address)) {
+            return MPOP_ERROR_INVALID_ADDRESS;
         }
         
-        operand->type = MPOP_OPERAND_REGISTER;
-        operand->value.reg_num = reg_num;
-        return MPOP_SUCCESS;
-    } else if (*str >= '0' && *str <= '9') {
+        operand->type = MPOP_OPERAND_MEMORY;
+        operand->value.address = address;
+    } else if (*str == '-' || (*str >= '0' && *str <= '9')) {
         // Immediate value
-        int32_t value = 0;
-        bool negative = false;
-        
-        if (*str == '-') {
-            negative = true;
-            str++;
-        }
+        bool negative = *str == '-';
+        if (negative) str++;
         
+        int32_t value = 0;
+        const char* digits = str;
         while (*str >= '0' && *str <= '9') {
             value = value * 10 + (*str - '0');
             str++;
         }
         
-        if (negative) value = -value;
+        if (str == digits) return MPOP_ERROR_PARSE_ERROR;
         
         operand->type = MPOP_OPERAND_IMMEDIATE;
-        operand->value.immediate = value;
-        return MPOP_SUCCESS;
-    } else if (*str == '[') {
-        // Memory address [123]
-        str++; // Skip '['
-        uint32_t address = 0;
-        
-        while (*str >= '0' && *str <= '9') {
-            address = address * 10 + (*str - '0');
-            str++;
-        }
-        
-        if (*str != ']') return MPOP_ERROR_PARSE_ERROR;
-        
-        if (!MPOP_IS_VALID_ADDRESS(address)) {
-            return MPOP_ERROR_INVALID_ADDRESS;
-        }
-        
-        operand->type = MPOP_OPERAND_MEMORY;
-        operand->value.address = address;
-        return MPOP_SUCCESS;
+        operand->value.immediate = negative ? -value : value;
     } else {
-        // Label
-        int i = 0;
-        while (*str && *str != ' ' && *str != '\t' && *str != '\n' && 
-               *str != ',' && i < MPOP_MAX_LABEL_NAME - 1) {
-            operand->value.label[i++] = *str++;
-        }
-        operand->value.label[i] = '\0';
+        const char* digits = str + 1;
+        const char* end = digits;
+        while (*end >= '0' && *end <= '9') end++;
         
-        operand->type = MPOP_OPERAND_LABEL;
-        return MPOP_SUCCESS;
+        if ((*str == 'R' || *str == 'r') && end != digits && mpop_is_delimiter(*end)) {
+            // Register operand (R0, R1, etc.)
+            int reg_num = 0;
+            for (str = digits; str < end; str++) {
+                reg_num = reg_num * 10 + (*str - '0');
+            }
+            
+            if (!MPOP_IS_VALID_REGISTER(reg_num)) {
+                return MPOP_ERROR_INVALID_REGISTER;
+            }
+            
+            operand->type = MPOP_OPERAND_REGISTER;
+            operand->value.reg_num = reg_num;
+        } else {
+            // Label
+            int i = 0;
+            while (!mpop_is_delimiter(*str)) {
+                if (i >= MPOP_MAX_LABEL_NAME - 1) return MPOP_ERROR_PARSE_ERROR;
+                operand->value.label[i++] = *str++;
+            }
+            operand->value.label[i] = '\0';
+            
+            operand->type = MPOP_OPERAND_LABEL;
+        }
     }
+    
+    if (!mpop_is_delimiter(*str)) return MPOP_ERROR_PARSE_ERROR;
+    *cursor = str;
+    return MPOP_SUCCESS;
 }
 
-int mpop_add_label(mpop_cpu_t* cpu, const char* name, uint32_t address) {
-    if (!cpu || !name || cpu->label_count >= MPOP_MAX_LABELS) {
-        return MPOP_ERROR_PROGRAM_TOO_LARGE;
+int mpop_parse_operand(const char* str, mpop_operand_t* operand) {
+    if (!str || !operand) return MPOP_ERROR_PARSE_ERROR;
+    
+    // Skip whitespace
+    while (*str == ' ' || *str == '\t') str++;
+    
+    return mpop_scan_operand(&str, operand);
+}
+
+// FNV-1a over at most MPOP_MAX_LABEL_NAME - 1 characters, the part of a
+// name that is actually stored
+static uint32_t mpop_label_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; name[i] && i < MPOP_MAX_LABEL_NAME - 1; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash slot holding name, or the empty slot where it would go
+static uint32_t mpop_label_slot(mpop_cpu_t* cpu, const char* name) {
+    uint32_t slot = mpop_label_hash(name) & (MPOP_LABEL_HASH_SIZE - 1);
+    while (cpu->label_hash[slot] != 0 &&
+           strncmp(cpu->labels[cpu->label_hash[slot] - 1].name, name, MPOP_MAX_LABEL_NAME - 1) != 0) {
+        slot = (slot + 1) & (MPOP_LABEL_HASH_SIZE - 1);
+    }
+    return slot;
+}
+
+static void mpop_clear_labels(mpop_cpu_t* cpu) {
+    cpu->label_count = 0;
+    for (int i = 0; i < MPOP_LABEL_HASH_SIZE; i++) {
+        cpu->label_hash[i] = 0;
+    }
+}
+
+// Index of the label called name, entered as undefined if it is new.
+// Returns -1 when the table is full
+static int mpop_label_index(mpop_cpu_t* cpu, const char* name) {
+    uint32_t slot = mpop_label_slot(cpu, name);
+    if (cpu->label_hash[slot] != 0) {
+        return cpu->label_hash[slot] - 1;
+    }
+    if (cpu->label_count >= MPOP_MAX_LABELS) {
+        return -1;
     }
+    cpu->label_hash[slot] = cpu->label_count + 1;
     
     // Copy label name
     int i = 0;
@@ -371,167 +501,676 @@ int mpop_add_label(mpop_cpu_t* cpu, const char* name, uint32_t address) {
         i++;
     }
     cpu->labels[cpu->label_count].name[i] = '\0';
-    cpu->labels[cpu->label_count].address = address;
-    cpu->label_count++;
+    cpu->labels[cpu->label_count].address = MPOP_LABEL_UNDEFINED;
+    return cpu->label_count++;
+}
+
+int mpop_add_label(mpop_cpu_t* cpu, const char* name, uint32_t address) {
+    if (!cpu || !name) {
+        return MPOP_ERROR_PARSE_ERROR;
+    }
+    
+    int index = mpop_label_index(cpu, name);
+    if (index < 0) {
+        return MPOP_ERROR_PROGRAM_TOO_LARGE;
+    }
+    if (cpu->labels[index].address != MPOP_LABEL_UNDEFINED) {
+        return MPOP_ERROR_DUPLICATE_LABEL;
+    }
+    cpu->labels[index].address = address;
     
     return MPOP_SUCCESS;
 }
 
+// Label defined at address, for the disassembler
+static const char* mpop_label_at(mpop_cpu_t* cpu, uint32_t address) {
+    for (uint32_t i = 0; i < cpu->label_count; i++) {
+        if (cpu->labels[i].address == address) {
+            return cpu->labels[i].name;
+        }
+    }
+    return NULL;
+}
+
 int mpop_resolve_label(mpop_cpu_t* cpu, const char* label_name) {
     if (!cpu || !label_name) return -1;
     
-    for (uint32_t i = 0; i < cpu->label_count; i++) {
-        if (strcmp(cpu->labels[i].name, label_name) == 0) {
-            return cpu->labels[i].address;
+    uint32_t slot = mpop_label_slot(cpu, label_name);
+    if (cpu->label_hash[slot] == 0 ||
+        cpu->labels[cpu->label_hash[slot] - 1].address == MPOP_LABEL_UNDEFINED) {
+        return -1;
+    }
+    return cpu->labels[cpu->label_hash[slot] - 1].address;
+}
+
+// Assembler mnemonics with the operand counts they accept. ALU instructions
+// take an optional source register: ADD Rd, Rs (Rd += Rs) or ADD Rd, Ra, Rb
+typedef struct {
+    const char* name;
+    mpop_opcode_t opcode;
+    uint8_t min_operands;
+    uint8_t max_operands;
+} mpop_mnemonic_t;
+
+static const mpop_mnemonic_t mpop_mnemonics[] = {
+    { "nop",    MPOP_NOP,    0, 0 }, { "mov",    MPOP_MOV,    2, 2 },
+    { "load",   MPOP_LOAD,   2, 2 }, { "store",  MPOP_STORE,  2, 2 },
+    { "add",    MPOP_ADD,    2, 3 }, { "sub",    MPOP_SUB,    2, 3 },
+    { "mul",    MPOP_MUL,    2, 3 }, { "div",    MPOP_DIV,    2, 3 },
+    { "mod",    MPOP_MOD,    2, 3 }, { "inc",    MPOP_INC,    1, 1 },
+    { "dec",    MPOP_DEC,    1, 1 }, { "and",    MPOP_AND,    2, 3 },
+    { "or",     MPOP_OR,     2, 3 }, { "xor",    MPOP_XOR,    2, 3 },
+    { "not",    MPOP_NOT,    1, 1 }, { "shl",    MPOP_SHL,    2, 3 },
+    { "shr",    MPOP_SHR,    2, 3 }, { "cmp",    MPOP_CMP,    2, 2 },
+    { "test",   MPOP_TEST,   2, 2 }, { "jmp",    MPOP_JMP,    1, 1 },
+    { "jz",     MPOP_JZ,     1, 1 }, { "jnz",    MPOP_JNZ,    1, 1 },
+    { "je",     MPOP_JE,     1, 1 }, { "jne",    MPOP_JNE,    1, 1 },
+    { "jl",     MPOP_JL,     1, 1 }, { "jg",     MPOP_JG,     1, 1 },
+    { "jle",    MPOP_JLE,    1, 1 }, { "jge",    MPOP_JGE,    1, 1 },
+    { "call",   MPOP_CALL,   1, 1 }, { "ret",    MPOP_RET,    0, 0 },
+    { "push",   MPOP_PUSH,   1, 1 }, { "pop",    MPOP_POP,    1, 1 },
+    { "print",  MPOP_PRINT,  1, 1 }, { "printc", MPOP_PRINTC, 1, 1 },
+    { "prints", MPOP_PRINTS, 1, 1 }, { "input",  MPOP_INPUT,  1, 1 },
+    { "halt",   MPOP_HALT,   0, 0 },
+};
+
+#define MPOP_MNEMONIC_COUNT     (sizeof(mpop_mnemonics) / sizeof(mpop_mnemonics[0]))
+#define MPOP_MNEMONIC_SLOTS     128     // Power of two, well above the mnemonic count
+#define MPOP_MNEMONIC_MAX       8       // Longest mnemonic plus the terminator
+
+static uint8_t mpop_mnemonic_slots[MPOP_MNEMONIC_SLOTS];   // mpop_mnemonics index + 1
+static bool mpop_mnemonics_ready = false;
+
+// Mixes the first two and the last character with the length. Every mnemonic
+// above gets a slot of its own, so a lookup is one probe and one strcmp
+static uint32_t mpop_mnemonic_hash(const char* name, uint32_t length) {
+    return ((uint8_t) name[0] ^ (uint8_t) name[1] ^ ((uint8_t) name[length - 1] * 18) ^ (length * 13))
+           & (MPOP_MNEMONIC_SLOTS - 1);
+}
+
+static void mpop_build_mnemonics(void) {
+    for (uint32_t i = 0; i < MPOP_MNEMONIC_COUNT; i++) {
+        const char* name = mpop_mnemonics[i].name;
+        uint32_t slot = mpop_mnemonic_hash(name, strlen(name));
+        // Linear probing keeps the table correct if a mnemonic is added that collides
+        while (mpop_mnemonic_slots[slot]) {
+            slot = (slot + 1) & (MPOP_MNEMONIC_SLOTS - 1);
         }
+        mpop_mnemonic_slots[slot] = i + 1;
+    }
+    mpop_mnemonics_ready = true;
+}
+
+// Lowercase, NUL-terminated name of the given length
+static const mpop_mnemonic_t* mpop_find_mnemonic(const char* name, uint32_t length) {
+    if (!mpop_mnemonics_ready) {
+        mpop_build_mnemonics();
     }
     
-    return -1;
+    uint32_t slot = mpop_mnemonic_hash(name, length);
+    while (mpop_mnemonic_slots[slot]) {
+        const mpop_mnemonic_t* mnemonic = &mpop_mnemonics[mpop_mnemonic_slots[slot] - 1];
+        if (strcmp(mnemonic->name, name) == 0) {
+            return mnemonic;
+        }
+        slot = (slot + 1) & (MPOP_MNEMONIC_SLOTS - 1);
+    }
+    return NULL;
 }
 
-int mpop_load_program(mpop_cpu_t* cpu, const char* assembly) {
-    if (!cpu || !assembly) return MPOP_ERROR_PARSE_ERROR;
+static int mpop_alu_op(mpop_opcode_t opcode) {
+    switch (opcode) {
+        case MPOP_ADD: return VOP_ADD_RR;
+        case MPOP_SUB: return VOP_SUB_RR;
+        case MPOP_MUL: return VOP_MUL_RR;
+        case MPOP_DIV: return VOP_DIV_RR;
+        case MPOP_MOD: return VOP_MOD_RR;
+        case MPOP_AND: return VOP_AND_RR;
+        case MPOP_OR:  return VOP_OR_RR;
+        case MPOP_XOR: return VOP_XOR_RR;
+        case MPOP_SHL: return VOP_SHL_RR;
+        case MPOP_SHR: return VOP_SHR_RR;
+        case MPOP_CMP: return VOP_CMP_RR;
+        default:       return -1;
+    }
+}
+
+// Page-allocated array of entry_size entries that holds at least needed, keeping
+// the old contents. Returns NULL when the allocator runs out
+static void* mpop_grow(void* array, uint32_t* capacity, uint32_t needed, uint32_t entry_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
     
-    cpu->program_size = 0;
-    cpu->label_count = 0;
+    uint32_t new_capacity = *capacity ? *capacity : PAGE_SIZE / entry_size;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
     
-    char line[256];
-    int line_pos = 0;
-    int asm_pos = 0;
-    uint32_t instruction_count = 0;
+    uint32_t pages = (new_capacity * entry_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    void* grown = (void*) allocate_contiguous_pages(pages);
+    if (!grown) {
+        return NULL;
+    }
     
-    // First pass: collect labels
-    while (assembly[asm_pos]) {
-        // Read line
-        line_pos = 0;
-        while (assembly[asm_pos] && assembly[asm_pos] != '\n' && line_pos < 255) {
-            line[line_pos++] = assembly[asm_pos++];
+    if (array) {
+        memcpy(grown, array, *capacity * entry_size);
+        free_contiguous_pages((uint32_t) array, (*capacity * entry_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+// Pack one parsed instruction into program[index]. Label operands must
+// already be addresses. op3 is only given for the three-operand ALU form
+static int mpop_encode(mpop_cpu_t* cpu, uint32_t index, mpop_opcode_t opcode,
+                       mpop_operand_t* op1, mpop_operand_t* op2, mpop_operand_t* op3) {
+    mpop_instruction_t* code = &cpu->program[index];
+    bool reg1 = op1->type == MPOP_OPERAND_REGISTER;
+    bool reg2 = op2->type == MPOP_OPERAND_REGISTER;
+    bool imm2 = op2->type == MPOP_OPERAND_IMMEDIATE;
+
+    // Anything not matched below runs through mpop_step_slow
+    code->op = VOP_GENERIC;
+    code->a = code->b = code->c = 0;
+    code->imm = 0;
+
+    // ADD Rd, Rs reads Rd itself, ADD Rd, Ra, Rb reads Ra
+    int alu = mpop_alu_op(opcode);
+    mpop_operand_t* left = op1;
+    mpop_operand_t* right = op2;
+    if (op3->type != MPOP_OPERAND_NONE) {
+        left = op2;
+        right = op3;
+    }
+    bool reg_right = right->type == MPOP_OPERAND_REGISTER;
+    if (alu >= 0 && reg1 && left->type == MPOP_OPERAND_REGISTER &&
+        (reg_right || right->type == MPOP_OPERAND_IMMEDIATE)) {
+        code->op = reg_right ? alu : alu + 1;
+        code->a = op1->value.reg_num;
+        code->b = left->value.reg_num;
+        if (reg_right) code->c = right->value.reg_num;
+        else code->imm = right->value.immediate;
+        return MPOP_SUCCESS;
+    }
+
+    // The slow path has no third operand
+    if (op3->type != MPOP_OPERAND_NONE) {
+        return MPOP_ERROR_PARSE_ERROR;
+    }
+
+    switch (opcode) {
+        case MPOP_NOP:
+            code->op = VOP_NOP;
+            break;
+
+        case MPOP_HALT:
+            code->op = VOP_HALT;
+            break;
+
+        case MPOP_MOV:
+            if (reg1 && reg2) {
+                code->op = VOP_MOV_RR;
+                code->a = op1->value.reg_num;
+                code->b = op2->value.reg_num;
+            } else if (reg1 && imm2) {
+                code->op = VOP_MOV_RI;
+                code->a = op1->value.reg_num;
+                code->imm = op2->value.immediate;
+            }
+            break;
+
+        case MPOP_INC:
+        case MPOP_DEC:
+        case MPOP_NOT:
+            if (reg1) {
+                code->op = opcode == MPOP_INC ? VOP_INC :
+                           opcode == MPOP_DEC ? VOP_DEC : VOP_NOT;
+                code->a = op1->value.reg_num;
+            }
+            break;
+
+        case MPOP_JMP:
+        case MPOP_JZ:
+        case MPOP_JNZ:
+        case MPOP_JE:
+        case MPOP_JNE:
+        case MPOP_JL:
+        case MPOP_JG:
+        case MPOP_JLE:
+        case MPOP_JGE:
+        case MPOP_CALL: {
+            // Computed targets are left to the slow path. Targets past the
+            // end are clamped by mpop_finish once the size is known
+            if (op1->type != MPOP_OPERAND_IMMEDIATE) {
+                break;
+            }
+
+            switch (opcode) {
+                case MPOP_JMP:  code->op = VOP_JMP;  break;
+                case MPOP_JZ:
+                case MPOP_JE:   code->op = VOP_JZ;   break;
+                case MPOP_JNZ:
+                case MPOP_JNE:  code->op = VOP_JNZ;  break;
+                case MPOP_JL:   code->op = VOP_JL;   break;
+                case MPOP_JG:   code->op = VOP_JG;   break;
+                case MPOP_JLE:  code->op = VOP_JLE;  break;
+                case MPOP_JGE:  code->op = VOP_JGE;  break;
+                default:        code->op = VOP_CALL; break;
+            }
+            code->imm = op1->value.immediate;
+            break;
         }
-        line[line_pos] = '\0';
-        
-        if (assembly[asm_pos] == '\n') asm_pos++;
+
+        case MPOP_RET:
+            code->op = VOP_RET;
+            break;
+
+        case MPOP_PUSH:
+            if (reg1) {
+                code->op = VOP_PUSH_R;
+                code->a = op1->value.reg_num;
+            } else if (op1->type == MPOP_OPERAND_IMMEDIATE) {
+                code->op = VOP_PUSH_I;
+                code->imm = op1->value.immediate;
+            }
+            break;
+
+        case MPOP_POP:
+            if (reg1) {
+                code->op = VOP_POP;
+                code->a = op1->value.reg_num;
+            }
+            break;
+
+        case MPOP_PRINT:
+            if (reg1) {
+                code->op = VOP_PRINT;
+                code->a = op1->value.reg_num;
+            }
+            break;
+
+        case MPOP_PRINTC:
+            if (reg1) {
+                code->op = VOP_PRINTC_R;
+                code->a = op1->value.reg_num;
+            } else if (op1->type == MPOP_OPERAND_IMMEDIATE) {
+                code->op = VOP_PRINTC_I;
+                code->imm = op1->value.immediate;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    if (code->op == VOP_GENERIC) {
+        mpop_slow_instruction_t* slow = mpop_grow(cpu->slow, &cpu->slow_capacity, cpu->slow_count + 1,
+                                                  sizeof(mpop_slow_instruction_t));
+        if (!slow) return MPOP_ERROR_PROGRAM_TOO_LARGE;
+        cpu->slow = slow;
+        slow[cpu->slow_count].opcode = opcode;
+        slow[cpu->slow_count].operand1 = *op1;
+        slow[cpu->slow_count].operand2 = *op2;
+        code->imm = cpu->slow_count++;
+    }
+
+    return MPOP_SUCCESS;
+}
+
+// Close off an assembled program of size instructions
+static void mpop_finish(mpop_cpu_t* cpu, uint32_t size) {
+    // Branches past the end land on the end marker
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t op = cpu->program[i].op;
+        if (op >= VOP_JMP && op <= VOP_CALL && (uint32_t) cpu->program[i].imm > size) {
+            cpu->program[i].imm = size;
+        }
+    }
+
+    // Falling off the end stops the program like HALT
+    cpu->program[size].op = VOP_END;
+    cpu->program_size = size;
+    cpu->threaded = false;
+    cpu->jit_ready = false;
+}
+
+#define MPOP_FLAGS_SCAN 8   // Instructions mpop_flags_dead looks ahead
+
+uint8_t mpop_base_op(uint8_t op) {
+    if (op >= VOP_CMP_RR_JZ && op <= VOP_CMP_RR_JGE) return VOP_CMP_RR;
+    if (op >= VOP_CMP_RI_JZ && op <= VOP_CMP_RI_JGE) return VOP_CMP_RI;
+    switch (op) {
+        case VOP_INC_CMP_RR_JL: case VOP_INC_CMP_RI_JL: return VOP_INC;
+        case VOP_MOV_RR_ADD_RR: case VOP_MOV_RR_ADD_RI: return VOP_MOV_RR;
+        case VOP_MOV_RI_ADD_RR: case VOP_MOV_RI_ADD_RI: return VOP_MOV_RI;
+        default: return op;
+    }
+}
+
+// How an operation touches the flags. DIV and MOD count as reads because a
+// zero divisor stops the program with the old flags in place
+enum { MPOP_FLAGS_KEEP, MPOP_FLAGS_WRITE, MPOP_FLAGS_READ };
+
+static int mpop_flag_use(uint8_t op) {
+    switch (op) {
+        case VOP_NOP: case VOP_MOV_RR: case VOP_MOV_RI: case VOP_JMP:
+            return MPOP_FLAGS_KEEP;
+        case VOP_DIV_RR: case VOP_DIV_RI: case VOP_MOD_RR: case VOP_MOD_RI:
+            return MPOP_FLAGS_READ;
+        case VOP_CMP_RR: case VOP_CMP_RI: case VOP_INC: case VOP_DEC: case VOP_NOT:
+            return MPOP_FLAGS_WRITE;
+        default:
+            return op >= VOP_ADD_RR && op <= VOP_SHR_RI ? MPOP_FLAGS_WRITE : MPOP_FLAGS_READ;
+    }
+}
+
+bool mpop_flags_dead(mpop_cpu_t* cpu, uint32_t index) {
+    uint32_t pc = index + 1;
+    
+    // The step limit also ends JMP cycles
+    for (int steps = 0; steps < MPOP_FLAGS_SCAN && pc < cpu->program_size; steps++) {
+        mpop_instruction_t* instr = &cpu->program[pc];
+        uint8_t op = mpop_base_op(instr->op);
         
-        // Skip empty lines and comments
-        if (line_pos == 0 || line[0] == ';') continue;
+        switch (mpop_flag_use(op)) {
+            case MPOP_FLAGS_WRITE: return true;
+            case MPOP_FLAGS_READ:  return false;
+            default: break;
+        }
+        pc = op == VOP_JMP ? (uint32_t) instr->imm : pc + 1;
+    }
+    return false;
+}
+
+// Superinstruction for the instructions starting at index, or the base
+// operation when no pattern matches. Covered instructions are read through
+// mpop_base_op, they may have been fused themselves
+static uint8_t mpop_fuse(mpop_cpu_t* cpu, uint32_t index, uint32_t* covered) {
+    uint32_t size = cpu->program_size;
+    mpop_instruction_t* code = &cpu->program[index];
+    uint8_t op = mpop_base_op(code[0].op);
+    uint8_t next = index + 1 < size ? mpop_base_op(code[1].op) : VOP_END;
+    uint8_t third = index + 2 < size ? mpop_base_op(code[2].op) : VOP_END;
+    bool compare = next == VOP_CMP_RR || next == VOP_CMP_RI;
+    
+    *covered = 1;
+    if (op == VOP_INC && compare && third == VOP_JL) {
+        *covered = 3;
+        return next == VOP_CMP_RR ? VOP_INC_CMP_RR_JL : VOP_INC_CMP_RI_JL;
+    }
+    if ((op == VOP_CMP_RR || op == VOP_CMP_RI) && next >= VOP_JZ && next <= VOP_JGE) {
+        *covered = 2;
+        return (op == VOP_CMP_RR ? VOP_CMP_RR_JZ : VOP_CMP_RI_JZ) + (next - VOP_JZ);
+    }
+    if ((op == VOP_MOV_RR || op == VOP_MOV_RI) && (next == VOP_ADD_RR || next == VOP_ADD_RI)) {
+        *covered = 2;
+        return (op == VOP_MOV_RR ? VOP_MOV_RR_ADD_RR : VOP_MOV_RI_ADD_RR) + (next - VOP_ADD_RR);
+    }
+    return op;
+}
+
+// Drop compares nobody reads and fuse common sequences into superinstructions
+static void mpop_peephole(mpop_cpu_t* cpu) {
+    uint32_t size = cpu->program_size;
+    mpop_instruction_t* code = cpu->program;
+    
+    cpu->fused_count = 0;
+    cpu->dead_flag_count = 0;
+    
+    // A dead compare goes away. The JIT leaves out the flag update of the
+    // others, which the interpreter gets for free
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t op = code[i].op;
+        switch (op) {
+            case VOP_CMP_RR: case VOP_CMP_RI: case VOP_MUL_RR: case VOP_MUL_RI:
+            case VOP_DIV_RR: case VOP_DIV_RI: case VOP_MOD_RR: case VOP_MOD_RI:
+            case VOP_SHL_RR: case VOP_SHL_RI: case VOP_SHR_RR: case VOP_SHR_RI:
+            case VOP_NOT:
+                break;
+            default:
+                continue;
+        }
+        if (!mpop_flags_dead(cpu, i)) continue;
         
-        // Check for label (ends with ':')
-        if (line[line_pos - 1] == ':') {
-            line[line_pos - 1] = '\0'; // Remove ':'
-            mpop_add_label(cpu, line, instruction_count);
-        } else {
-            instruction_count++;
+        if (op == VOP_CMP_RR || op == VOP_CMP_RI) {
+            code[i].op = VOP_NOP;
         }
+        cpu->dead_flag_count++;
     }
     
-    // Second pass: parse instructions
-    asm_pos = 0;
-    instruction_count = 0;
+    // Every position gets its superinstruction, since a jump may land on any
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t covered;
+        uint8_t fused = mpop_fuse(cpu, i, &covered);
+        if (covered > 1) {
+            code[i].op = fused;
+            cpu->fused_count++;
+        }
+    }
     
-    while (assembly[asm_pos] && instruction_count < MPOP_MAX_CODE_SIZE) {
-        // Read line
-        line_pos = 0;
-        while (assembly[asm_pos] && assembly[asm_pos] != '\n' && line_pos < 255) {
-            line[line_pos++] = assembly[asm_pos++];
+    cpu->dispatch_count = 0;
+    for (uint32_t i = 0; i < size; ) {
+        uint32_t covered;
+        mpop_fuse(cpu, i, &covered);
+        i += covered;
+        cpu->dispatch_count++;
+    }
+    cpu->threaded = false;
+}
+
+// Label reference waiting for its definition during mpop_load_program
+typedef struct {
+    uint16_t index;     // Instruction holding the reference
+    uint8_t operand;    // 1 to 3
+    uint8_t label;      // labels[] index
+    uint16_t line;      // Source position of the reference, for errors
+    uint16_t column;
+} mpop_fixup_t;
+
+static mpop_fixup_t mpop_fixups[MPOP_MAX_FIXUPS];
+
+// Record where assembly stopped and pass the error on
+static int mpop_load_error(mpop_cpu_t* cpu, int error, uint32_t line, const char* line_start, const char* at) {
+    cpu->error_line = line;
+    cpu->error_column = (uint32_t) (at - line_start) + 1;
+    return error;
+}
+
+int mpop_load_program(mpop_cpu_t* cpu, const char* assembly) {
+    if (!cpu || !assembly) return MPOP_ERROR_PARSE_ERROR;
+    
+    // Keep the arrays of the last program, they only ever grow
+    cpu->program_size = 0;
+    cpu->slow_count = 0;
+    cpu->threaded = false;
+    cpu->jit_ready = false;
+    cpu->profile_size = 0;
+    cpu->fused_count = 0;
+    cpu->dead_flag_count = 0;
+    cpu->dispatch_count = 0;
+    cpu->error_line = 0;
+    cpu->error_column = 0;
+    mpop_clear_labels(cpu);
+    if (cpu->program) {
+        cpu->program[0].op = VOP_END;
+    }
+    
+    const char* cursor = assembly;
+    const char* line_start = assembly;
+    uint32_t line = 1;
+    uint32_t instruction_count = 0;
+    uint32_t fixup_count = 0;
+    
+    // Single pass straight over the text: labels are defined as they appear,
+    // references to labels further down are patched once the whole text is read
+    while (*cursor) {
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') cursor++;
+        
+        if (*cursor == '\n') {
+            line_start = ++cursor;
+            line++;
+            continue;
         }
-        line[line_pos] = '\0';
         
-        if (assembly[asm_pos] == '\n') asm_pos++;
+        // Comments run to the end of the line
+        if (*cursor == ';') {
+            while (*cursor && *cursor != '\n') cursor++;
+            continue;
+        }
         
-        // Skip empty lines, comments, and labels
-        if (line_pos == 0 || line[0] == ';' || line[line_pos - 1] == ':') continue;
+        if (!*cursor) break;
         
-        // Parse instruction
-        char* token = line;
+        const char* token = cursor;
+        while (!mpop_is_delimiter(*cursor) && *cursor != ':') cursor++;
+        uint32_t length = cursor - token;
         
-        // Skip whitespace
-        while (*token == ' ' || *token == '\t') token++;
+        // "name:" defines a label, an instruction may follow on the same line
+        if (*cursor == ':') {
+            if (length == 0 || length >= MPOP_MAX_LABEL_NAME) {
+                return mpop_load_error(cpu, MPOP_ERROR_PARSE_ERROR, line, line_start, token);
+            }
+            
+            char name[MPOP_MAX_LABEL_NAME];
+            memcpy(name, token, length);
+            name[length] = '\0';
+            
+            int result = mpop_add_label(cpu, name, instruction_count);
+            if (result != MPOP_SUCCESS) return mpop_load_error(cpu, result, line, line_start, token);
+            cursor++;
+            continue;
+        }
         
-        // Get opcode
-        char opcode_str[16];
-        int i = 0;
-        while (*token && *token != ' ' && *token != '\t' && i < 15) {
-            opcode_str[i++] = *token++;
+        // Mnemonics are case-insensitive
+        const mpop_mnemonic_t* mnemonic = NULL;
+        if (length > 0 && length < MPOP_MNEMONIC_MAX) {
+            char name[MPOP_MNEMONIC_MAX];
+            for (uint32_t i = 0; i < length; i++) {
+                char c = token[i];
+                name[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+            }
+            name[length] = '\0';
+            mnemonic = mpop_find_mnemonic(name, length);
+        }
+        if (!mnemonic) {
+            return mpop_load_error(cpu, MPOP_ERROR_INVALID_OPCODE, line, line_start, token);
         }
-        opcode_str[i] = '\0';
         
-        // Convert opcode string to enum
-        mpop_opcode_t opcode = MPOP_NOP;
-        if (strcmp(opcode_str, "nop") == 0) opcode = MPOP_NOP;
-        else if (strcmp(opcode_str, "mov") == 0) opcode = MPOP_MOV;
-        else if (strcmp(opcode_str, "load") == 0) opcode = MPOP_LOAD;
-        else if (strcmp(opcode_str, "store") == 0) opcode = MPOP_STORE;
-        else if (strcmp(opcode_str, "add") == 0) opcode = MPOP_ADD;
-        else if (strcmp(opcode_str, "sub") == 0) opcode = MPOP_SUB;
-        else if (strcmp(opcode_str, "mul") == 0) opcode = MPOP_MUL;
-        else if (strcmp(opcode_str, "div") == 0) opcode = MPOP_DIV;
-        else if (strcmp(opcode_str, "mod") == 0) opcode = MPOP_MOD;
-        else if (strcmp(opcode_str, "inc") == 0) opcode = MPOP_INC;
-        else if (strcmp(opcode_str, "dec") == 0) opcode = MPOP_DEC;
-        else if (strcmp(opcode_str, "and") == 0) opcode = MPOP_AND;
-        else if (strcmp(opcode_str, "or") == 0) opcode = MPOP_OR;
-        else if (strcmp(opcode_str, "xor") == 0) opcode = MPOP_XOR;
-        else if (strcmp(opcode_str, "not") == 0) opcode = MPOP_NOT;
-        else if (strcmp(opcode_str, "shl") == 0) opcode = MPOP_SHL;
-        else if (strcmp(opcode_str, "shr") == 0) opcode = MPOP_SHR;
-        else if (strcmp(opcode_str, "cmp") == 0) opcode = MPOP_CMP;
-        else if (strcmp(opcode_str, "test") == 0) opcode = MPOP_TEST;
-        else if (strcmp(opcode_str, "jmp") == 0) opcode = MPOP_JMP;
-        else if (strcmp(opcode_str, "jz") == 0) opcode = MPOP_JZ;
-        else if (strcmp(opcode_str, "jnz") == 0) opcode = MPOP_JNZ;
-        else if (strcmp(opcode_str, "je") == 0) opcode = MPOP_JE;
-        else if (strcmp(opcode_str, "jne") == 0) opcode = MPOP_JNE;
-        else if (strcmp(opcode_str, "jl") == 0) opcode = MPOP_JL;
-        else if (strcmp(opcode_str, "jg") == 0) opcode = MPOP_JG;
-        else if (strcmp(opcode_str, "call") == 0) opcode = MPOP_CALL;
-        else if (strcmp(opcode_str, "ret") == 0) opcode = MPOP_RET;
-        else if (strcmp(opcode_str, "push") == 0) opcode = MPOP_PUSH;
-        else if (strcmp(opcode_str, "pop") == 0) opcode = MPOP_POP;
-        else if (strcmp(opcode_str, "print") == 0) opcode = MPOP_PRINT;
-        else if (strcmp(opcode_str, "printc") == 0) opcode = MPOP_PRINTC;
-        else if (strcmp(opcode_str, "prints") == 0) opcode = MPOP_PRINTS;
-        else if (strcmp(opcode_str, "input") == 0) opcode = MPOP_INPUT;
-        else if (strcmp(opcode_str, "halt") == 0) opcode = MPOP_HALT;
-        else return MPOP_ERROR_INVALID_OPCODE;
-
+        // Operands, the comma between them is optional
+        mpop_operand_t operands[3];
+        const char* operand_at[3];
+        uint32_t operand_count = 0;
+        for (int n = 0; n < 3; n++) {
+            operands[n].type = MPOP_OPERAND_NONE;
+        }
         
-        cpu->program[instruction_count].opcode = opcode;
+        while (true) {
+            while (*cursor == ' ' || *cursor == '\t') cursor++;
+            if (operand_count > 0 && *cursor == ',') {
+                cursor++;
+                while (*cursor == ' ' || *cursor == '\t') cursor++;
+            }
+            if (*cursor == '\0' || *cursor == '\n' || *cursor == '\r' || *cursor == ';') break;
+            
+            if (operand_count == mnemonic->max_operands) {
+                return mpop_load_error(cpu, MPOP_ERROR_PARSE_ERROR, line, line_start, cursor);
+            }
+            
+            operand_at[operand_count] = cursor;
+            int result = mpop_scan_operand(&cursor, &operands[operand_count]);
+            if (result != MPOP_SUCCESS) return mpop_load_error(cpu, result, line, line_start, cursor);
+            operand_count++;
+        }
         
-        // Parse operands
-        while (*token == ' ' || *token == '\t') token++;
+        if (operand_count < mnemonic->min_operands) {
+            return mpop_load_error(cpu, MPOP_ERROR_PARSE_ERROR, line, line_start, cursor);
+        }
         
-        if (*token) {
-            // First operand
-            char operand1_str[64];
-            i = 0;
-            while (*token && *token != ',' && *token != ' ' && *token != '\t' && i < 63) {
-                operand1_str[i++] = *token++;
+        // The three-operand form reads two registers and a register or value
+        if (operand_count == 3) {
+            for (int n = 0; n < 2; n++) {
+                if (operands[n].type != MPOP_OPERAND_REGISTER) {
+                    return mpop_load_error(cpu, MPOP_ERROR_PARSE_ERROR, line, line_start, operand_at[n]);
+                }
             }
-            operand1_str[i] = '\0';
-            
-            int result = mpop_parse_operand(operand1_str, &cpu->program[instruction_count].operand1);
-            if (result != MPOP_SUCCESS) return result;
+            if (operands[2].type == MPOP_OPERAND_MEMORY) {
+                return mpop_load_error(cpu, MPOP_ERROR_PARSE_ERROR, line, line_start, operand_at[2]);
+            }
+        }
+        
+        // One more slot than instructions for the end marker
+        if (instruction_count >= MPOP_MAX_CODE_SIZE) {
+            return mpop_load_error(cpu, MPOP_ERROR_PROGRAM_TOO_LARGE, line, line_start, token);
+        }
+        mpop_instruction_t* program = mpop_grow(cpu->program, &cpu->program_capacity,
+                                                instruction_count + 2, sizeof(mpop_instruction_t));
+        if (!program) {
+            return mpop_load_error(cpu, MPOP_ERROR_PROGRAM_TOO_LARGE, line, line_start, token);
+        }
+        cpu->program = program;
+        
+        // Labels become plain addresses, so nothing looks them up at run time.
+        // One defined further down is encoded as 0 and patched at the end
+        int pending[3] = { -1, -1, -1 };
+        for (uint32_t n = 0; n < operand_count; n++) {
+            if (operands[n].type != MPOP_OPERAND_LABEL) continue;
             
-            // Skip comma and whitespace
-            while (*token == ',' || *token == ' ' || *token == '\t') token++;
+            int label = mpop_label_index(cpu, operands[n].value.label);
+            if (label < 0) return mpop_load_error(cpu, MPOP_ERROR_PROGRAM_TOO_LARGE, line, line_start, operand_at[n]);
             
-            if (*token) {
-                // Second operand
-                char operand2_str[64];
-                i = 0;
-                while (*token && *token != ' ' && *token != '\t' && i < 63) {
-                    operand2_str[i++] = *token++;
-                }
-                operand2_str[i] = '\0';
-                
-                result = mpop_parse_operand(operand2_str, &cpu->program[instruction_count].operand2);
-                if (result != MPOP_SUCCESS) return result;
+            uint32_t address = cpu->labels[label].address;
+            operands[n].type = MPOP_OPERAND_IMMEDIATE;
+            operands[n].value.immediate = address == MPOP_LABEL_UNDEFINED ? 0 : (int32_t) address;
+            if (address == MPOP_LABEL_UNDEFINED) pending[n] = label;
+        }
+        
+        int result = mpop_encode(cpu, instruction_count, mnemonic->opcode, &operands[0], &operands[1], &operands[2]);
+        if (result != MPOP_SUCCESS) return mpop_load_error(cpu, result, line, line_start, token);
+        
+        for (uint32_t n = 0; n < operand_count; n++) {
+            if (pending[n] < 0) continue;
+            if (fixup_count >= MPOP_MAX_FIXUPS) {
+                return mpop_load_error(cpu, MPOP_ERROR_PROGRAM_TOO_LARGE, line, line_start, operand_at[n]);
             }
+            mpop_fixups[fixup_count].index = instruction_count;
+            mpop_fixups[fixup_count].operand = n + 1;
+            mpop_fixups[fixup_count].label = pending[n];
+            mpop_fixups[fixup_count].line = line;
+            mpop_fixups[fixup_count].column = (operand_at[n] - line_start) + 1;
+            fixup_count++;
         }
         
         instruction_count++;
     }
     
-    cpu->program_size = instruction_count;
+    // Forward references, every label is known now. A packed instruction keeps
+    // its label operand in imm, a slow one in the full operand
+    for (uint32_t i = 0; i < fixup_count; i++) {
+        mpop_fixup_t* fixup = &mpop_fixups[i];
+        uint32_t address = cpu->labels[fixup->label].address;
+        if (address == MPOP_LABEL_UNDEFINED) {
+            cpu->error_line = fixup->line;
+            cpu->error_column = fixup->column;
+            return MPOP_ERROR_LABEL_NOT_FOUND;
+        }
+        
+        mpop_instruction_t* instr = &cpu->program[fixup->index];
+        if (instr->op == VOP_GENERIC) {
+            mpop_slow_instruction_t* slow = &cpu->slow[instr->imm];
+            mpop_operand_t* operand = fixup->operand == 1 ? &slow->operand1 : &slow->operand2;
+            operand->value.immediate = address;
+        } else {
+            instr->imm = address;
+        }
+    }
+    
+    if (instruction_count == 0) {
+        return MPOP_SUCCESS;
+    }
+    mpop_finish(cpu, instruction_count);
+    if (cpu->optimize) {
+        mpop_peephole(cpu);
+    }
     return MPOP_SUCCESS;
 }
 
@@ -569,19 +1208,11 @@ void mpop_update_flags(mpop_cpu_t* cpu, int32_t result) {
     cpu->carry_flag = false; // Simplified for now
 }
 
-int mpop_step(mpop_cpu_t* cpu) {
-    if (!cpu || cpu->pc >= cpu->program_size) {
-        cpu->running = false;
-        return MPOP_SUCCESS;
-    }
-    
-    mpop_instruction_t* instr = &cpu->program[cpu->pc];
+// Reference interpreter for the instructions mpop_encode could not pack,
+// run with cpu->pc at the instruction
+static int mpop_step_slow(mpop_cpu_t* cpu, mpop_slow_instruction_t* instr) {
     int32_t val1, val2, result;
     
-    if (cpu->debug_mode) {
-        printr("PC: %d, Opcode: %d\n", cpu->pc, instr->opcode);
-    }
-    
     switch (instr->opcode) {
         case MPOP_NOP:
             break;
@@ -701,6 +1332,28 @@ int mpop_step(mpop_cpu_t* cpu) {
             mpop_update_flags(cpu, result);
             break;
             
+        case MPOP_TEST:
+            val1 = mpop_get_operand_value(cpu, &instr->operand1);
+            val2 = mpop_get_operand_value(cpu, &instr->operand2);
+            mpop_update_flags(cpu, val1 & val2);
+            break;
+            
+        case MPOP_LOAD:
+            // LOAD reg, addr - the address may come from a register
+            val2 = mpop_get_operand_value(cpu, &instr->operand2);
+            if (instr->operand2.type == MPOP_OPERAND_MEMORY) val2 = instr->operand2.value.address;
+            if (!MPOP_IS_VALID_ADDRESS((uint32_t) val2)) return MPOP_ERROR_INVALID_ADDRESS;
+            mpop_set_operand_value(cpu, &instr->operand1, cpu->memory[val2]);
+            break;
+            
+        case MPOP_STORE:
+            // STORE addr, reg
+            val1 = mpop_get_operand_value(cpu, &instr->operand1);
+            if (instr->operand1.type == MPOP_OPERAND_MEMORY) val1 = instr->operand1.value.address;
+            if (!MPOP_IS_VALID_ADDRESS((uint32_t) val1)) return MPOP_ERROR_INVALID_ADDRESS;
+            cpu->memory[val1] = (uint8_t) mpop_get_operand_value(cpu, &instr->operand2);
+            break;
+            
             
         case MPOP_JMP:
             val1 = mpop_get_operand_value(cpu, &instr->operand1);
@@ -731,24 +1384,40 @@ int mpop_step(mpop_cpu_t* cpu) {
             }
             break;
             
-        case MPOP_JNE:
-            if (!cpu->zero_flag) {
+        case MPOP_JNE:
+            if (!cpu->zero_flag) {
+                val1 = mpop_get_operand_value(cpu, &instr->operand1);
+                cpu->pc = val1;
+                return MPOP_SUCCESS;
+            }
+            break;
+            
+        case MPOP_JL:
+            if (cpu->negative_flag) {
+                val1 = mpop_get_operand_value(cpu, &instr->operand1);
+                cpu->pc = val1;
+                return MPOP_SUCCESS;
+            }
+            break;
+            
+        case MPOP_JG:
+            if (!cpu->negative_flag && !cpu->zero_flag) {
                 val1 = mpop_get_operand_value(cpu, &instr->operand1);
                 cpu->pc = val1;
                 return MPOP_SUCCESS;
             }
             break;
             
-        case MPOP_JL:
-            if (cpu->negative_flag) {
+        case MPOP_JLE:
+            if (cpu->negative_flag || cpu->zero_flag) {
                 val1 = mpop_get_operand_value(cpu, &instr->operand1);
                 cpu->pc = val1;
                 return MPOP_SUCCESS;
             }
             break;
             
-        case MPOP_JG:
-            if (!cpu->negative_flag && !cpu->zero_flag) {
+        case MPOP_JGE:
+            if (!cpu->negative_flag) {
                 val1 = mpop_get_operand_value(cpu, &instr->operand1);
                 cpu->pc = val1;
                 return MPOP_SUCCESS;
@@ -781,14 +1450,14 @@ int mpop_step(mpop_cpu_t* cpu) {
             
         case MPOP_PRINT:
             val1 = mpop_get_operand_value(cpu, &instr->operand1);
-            printr("%d ", val1);
+            if (!cpu->quiet) printr("%d ", val1);
             break;
             
         case MPOP_PRINTC:
             val1 = mpop_get_operand_value(cpu, &instr->operand1);
             {
                 char output[2] = {(char)val1, '\0'};
-                printr(output);
+                if (!cpu->quiet) printr(output);
             }
             break;
             
@@ -796,15 +1465,16 @@ int mpop_step(mpop_cpu_t* cpu) {
             val1 = mpop_get_operand_value(cpu, &instr->operand1);
             if (MPOP_IS_VALID_ADDRESS(val1)) {
                 char* str = (char*)&cpu->memory[val1];
-                printr(str);
+                if (!cpu->quiet) printr(str);
             }
             break;
             
         case MPOP_INPUT:
             {
-                char input[256];
+                char input[COMMAND_BUFFER_SIZE];
+                if (cpu->background) return MPOP_ERROR_NO_INPUT;
                 printr("Input: ");
-                keyboard_input(input);
+                if (keyboard_input(input)) return MPOP_ERROR_CANCELLED;
                 int value = 0;
                 // Simple integer parsing
                 int i = 0;
@@ -834,37 +1504,495 @@ int mpop_step(mpop_cpu_t* cpu) {
     return MPOP_SUCCESS;
 }
 
-int mpop_run(mpop_cpu_t* cpu) {
-    if (!cpu) return MPOP_ERROR_PARSE_ERROR;
+// Threaded interpreter over program[]. Every handler ends in its own indirect
+// jump to the next one, so there is no central switch to mispredict. Runs at
+// most budget instructions and reports how many it did in *executed.
+static int mpop_execute(mpop_cpu_t* cpu, uint32_t budget, uint32_t* executed) {
+    static const void* const dispatch[VOP_COUNT] = {
+        [VOP_END] = &&op_end, [VOP_GENERIC] = &&op_generic,
+        [VOP_NOP] = &&op_nop, [VOP_HALT] = &&op_halt,
+        [VOP_MOV_RR] = &&op_mov_rr, [VOP_MOV_RI] = &&op_mov_ri,
+        [VOP_ADD_RR] = &&op_add_rr, [VOP_ADD_RI] = &&op_add_ri,
+        [VOP_SUB_RR] = &&op_sub_rr, [VOP_SUB_RI] = &&op_sub_ri,
+        [VOP_MUL_RR] = &&op_mul_rr, [VOP_MUL_RI] = &&op_mul_ri,
+        [VOP_DIV_RR] = &&op_div_rr, [VOP_DIV_RI] = &&op_div_ri,
+        [VOP_MOD_RR] = &&op_mod_rr, [VOP_MOD_RI] = &&op_mod_ri,
+        [VOP_AND_RR] = &&op_and_rr, [VOP_AND_RI] = &&op_and_ri,
+        [VOP_OR_RR] = &&op_or_rr, [VOP_OR_RI] = &&op_or_ri,
+        [VOP_XOR_RR] = &&op_xor_rr, [VOP_XOR_RI] = &&op_xor_ri,
+        [VOP_SHL_RR] = &&op_shl_rr, [VOP_SHL_RI] = &&op_shl_ri,
+        [VOP_SHR_RR] = &&op_shr_rr, [VOP_SHR_RI] = &&op_shr_ri,
+        [VOP_CMP_RR] = &&op_cmp_rr, [VOP_CMP_RI] = &&op_cmp_ri,
+        [VOP_INC] = &&op_inc, [VOP_DEC] = &&op_dec, [VOP_NOT] = &&op_not,
+        [VOP_JMP] = &&op_jmp, [VOP_JZ] = &&op_jz, [VOP_JNZ] = &&op_jnz,
+        [VOP_JL] = &&op_jl, [VOP_JG] = &&op_jg, [VOP_JLE] = &&op_jle, [VOP_JGE] = &&op_jge,
+        [VOP_CALL] = &&op_call, [VOP_RET] = &&op_ret,
+        [VOP_PUSH_R] = &&op_push_r, [VOP_PUSH_I] = &&op_push_i, [VOP_POP] = &&op_pop,
+        [VOP_PRINT] = &&op_print, [VOP_PRINTC_R] = &&op_printc_r, [VOP_PRINTC_I] = &&op_printc_i,
+        [VOP_CMP_RR_JZ] = &&op_cmp_rr_jz, [VOP_CMP_RR_JNZ] = &&op_cmp_rr_jnz,
+        [VOP_CMP_RR_JL] = &&op_cmp_rr_jl, [VOP_CMP_RR_JG] = &&op_cmp_rr_jg,
+        [VOP_CMP_RR_JLE] = &&op_cmp_rr_jle, [VOP_CMP_RR_JGE] = &&op_cmp_rr_jge,
+        [VOP_CMP_RI_JZ] = &&op_cmp_ri_jz, [VOP_CMP_RI_JNZ] = &&op_cmp_ri_jnz,
+        [VOP_CMP_RI_JL] = &&op_cmp_ri_jl, [VOP_CMP_RI_JG] = &&op_cmp_ri_jg,
+        [VOP_CMP_RI_JLE] = &&op_cmp_ri_jle, [VOP_CMP_RI_JGE] = &&op_cmp_ri_jge,
+        [VOP_INC_CMP_RR_JL] = &&op_inc_cmp_rr_jl, [VOP_INC_CMP_RI_JL] = &&op_inc_cmp_ri_jl,
+        [VOP_MOV_RR_ADD_RR] = &&op_mov_rr_add_rr, [VOP_MOV_RR_ADD_RI] = &&op_mov_rr_add_ri,
+        [VOP_MOV_RI_ADD_RR] = &&op_mov_ri_add_rr, [VOP_MOV_RI_ADD_RI] = &&op_mov_ri_add_ri,
+    };
+
+    if (cpu->program_size == 0) {
+        cpu->running = false;
+        if (executed) *executed = 0;
+        return MPOP_SUCCESS;
+    }
     
-    cpu->running = true;
-    cpu->pc = 0;
+    mpop_instruction_t* code = cpu->program;
+    if (!cpu->threaded) {
+        for (uint32_t i = 0; i <= cpu->program_size; i++) {
+            code[i].handler = dispatch[code[i].op];
+        }
+        cpu->threaded = true;
+    }
+
+    int32_t* regs = cpu->registers;
+    mpop_instruction_t* ip = code + (cpu->pc < cpu->program_size ? cpu->pc : cpu->program_size);
+    uint32_t count = 0;
+    int status = MPOP_SUCCESS;
+    int32_t divisor;
+
+    // Flags are kept as the last result and only turned back into bits on exit
+    int32_t flags = cpu->zero_flag ? 0 : (cpu->negative_flag ? -1 : 1);
+
+#define DISPATCH() do { if (count == budget) goto out; count++; goto *ip->handler; } while (0)
+#define NEXT()     do { ip++; DISPATCH(); } while (0)
+#define JUMP(t)    do { ip = code + (t); DISPATCH(); } while (0)
+#define ALU_RR(e)  do { flags = regs[ip->a] = (e); NEXT(); } while (0)
+
+    // A single step runs the instruction at pc as written, never a
+    // superinstruction that would take the ones it covers along with it
+    if (budget == 1) {
+        count++;
+        goto *dispatch[mpop_base_op(ip->op)];
+    }
+    DISPATCH();
+
+op_end:
+    cpu->running = false;
+    count--; // The end marker is not an instruction
+    goto out;
+
+op_halt:
+    cpu->running = false;
+    goto out;
+
+op_generic:
+    cpu->pc = ip - code;
+    cpu->zero_flag = flags == 0;
+    cpu->negative_flag = flags < 0;
+    status = mpop_step_slow(cpu, &cpu->slow[ip->imm]);
+    flags = cpu->zero_flag ? 0 : (cpu->negative_flag ? -1 : 1);
+    if (status != MPOP_SUCCESS || !cpu->running) {
+        ip = code + (cpu->pc < cpu->program_size ? cpu->pc : cpu->program_size);
+        goto out;
+    }
+    JUMP(cpu->pc < cpu->program_size ? cpu->pc : cpu->program_size);
+
+op_nop:
+    NEXT();
+
+op_mov_rr:
+    regs[ip->a] = regs[ip->b];
+    NEXT();
+op_mov_ri:
+    regs[ip->a] = ip->imm;
+    NEXT();
+
+op_add_rr: ALU_RR(regs[ip->b] + regs[ip->c]);
+op_add_ri: ALU_RR(regs[ip->b] + ip->imm);
+op_sub_rr: ALU_RR(regs[ip->b] - regs[ip->c]);
+op_sub_ri: ALU_RR(regs[ip->b] - ip->imm);
+op_mul_rr: ALU_RR(regs[ip->b] * regs[ip->c]);
+op_mul_ri: ALU_RR(regs[ip->b] * ip->imm);
+op_and_rr: ALU_RR(regs[ip->b] & regs[ip->c]);
+op_and_ri: ALU_RR(regs[ip->b] & ip->imm);
+op_or_rr:  ALU_RR(regs[ip->b] | regs[ip->c]);
+op_or_ri:  ALU_RR(regs[ip->b] | ip->imm);
+op_xor_rr: ALU_RR(regs[ip->b] ^ regs[ip->c]);
+op_xor_ri: ALU_RR(regs[ip->b] ^ ip->imm);
+op_shl_rr: ALU_RR(regs[ip->b] << regs[ip->c]);
+op_shl_ri: ALU_RR(regs[ip->b] << ip->imm);
+op_shr_rr: ALU_RR(regs[ip->b] >> regs[ip->c]);
+op_shr_ri: ALU_RR(regs[ip->b] >> ip->imm);
+
+op_div_rr:
+    divisor = regs[ip->c];
+    goto do_div;
+op_div_ri:
+    divisor = ip->imm;
+do_div:
+    if (divisor == 0) {
+        status = MPOP_ERROR_DIVISION_BY_ZERO;
+        goto out;
+    }
+    ALU_RR(regs[ip->b] / divisor);
+
+op_mod_rr:
+    divisor = regs[ip->c];
+    goto do_mod;
+op_mod_ri:
+    divisor = ip->imm;
+do_mod:
+    if (divisor == 0) {
+        status = MPOP_ERROR_DIVISION_BY_ZERO;
+        goto out;
+    }
+    ALU_RR(regs[ip->b] % divisor);
+
+op_cmp_rr:
+    flags = regs[ip->b] - regs[ip->c];
+    NEXT();
+op_cmp_ri:
+    flags = regs[ip->b] - ip->imm;
+    NEXT();
+
+op_inc: ALU_RR(regs[ip->a] + 1);
+op_dec: ALU_RR(regs[ip->a] - 1);
+op_not: ALU_RR(~regs[ip->a]);
+
+op_jmp:
+    JUMP(ip->imm);
+op_jz:
+    if (flags == 0) JUMP(ip->imm);
+    NEXT();
+op_jnz:
+    if (flags != 0) JUMP(ip->imm);
+    NEXT();
+op_jl:
+    if (flags < 0) JUMP(ip->imm);
+    NEXT();
+op_jg:
+    if (flags > 0) JUMP(ip->imm);
+    NEXT();
+op_jle:
+    if (flags <= 0) JUMP(ip->imm);
+    NEXT();
+op_jge:
+    if (flags >= 0) JUMP(ip->imm);
+    NEXT();
+
+op_call:
+    if (cpu->sp >= MPOP_STACK_SIZE) {
+        status = MPOP_ERROR_STACK_OVERFLOW;
+        goto out;
+    }
+    cpu->stack[cpu->sp++] = (ip - code) + 1;
+    JUMP(ip->imm);
+op_ret:
+    if (cpu->sp == 0) {
+        status = MPOP_ERROR_STACK_UNDERFLOW;
+        goto out;
+    }
+    {
+        uint32_t target = (uint32_t) cpu->stack[--cpu->sp];
+        JUMP(target < cpu->program_size ? target : cpu->program_size);
+    }
+
+op_push_r:
+    divisor = regs[ip->a];
+    goto do_push;
+op_push_i:
+    divisor = ip->imm;
+do_push:
+    if (cpu->sp >= MPOP_STACK_SIZE) {
+        status = MPOP_ERROR_STACK_OVERFLOW;
+        goto out;
+    }
+    cpu->stack[cpu->sp++] = divisor;
+    NEXT();
+op_pop:
+    if (cpu->sp == 0) {
+        status = MPOP_ERROR_STACK_UNDERFLOW;
+        goto out;
+    }
+    regs[ip->a] = cpu->stack[--cpu->sp];
+    NEXT();
+
+op_print:
+    if (!cpu->quiet) printr("%d ", regs[ip->a]);
+    NEXT();
+op_printc_r:
+    if (!cpu->quiet) printr("%c", regs[ip->a]);
+    NEXT();
+op_printc_i:
+    if (!cpu->quiet) printr("%c", ip->imm);
+    NEXT();
+
+// Superinstructions. The covered instructions follow at ip[1] and ip[2]
+// and supply their own operands and targets
+#define CMP_JUMP(rhs, cond) \
+    do { flags = regs[ip->b] - (rhs); if (cond) JUMP(ip[1].imm); ip += 2; DISPATCH(); } while (0)
+#define INC_CMP_JL(rhs) \
+    do { regs[ip->a]++; flags = regs[ip[1].b] - (rhs); if (flags < 0) JUMP(ip[2].imm); ip += 3; DISPATCH(); } while (0)
+#define MOV_ADD(src, rhs) \
+    do { regs[ip->a] = (src); flags = regs[ip[1].a] = regs[ip[1].b] + (rhs); ip += 2; DISPATCH(); } while (0)
+
+op_cmp_rr_jz:  CMP_JUMP(regs[ip->c], flags == 0);
+op_cmp_rr_jnz: CMP_JUMP(regs[ip->c], flags != 0);
+op_cmp_rr_jl:  CMP_JUMP(regs[ip->c], flags < 0);
+op_cmp_rr_jg:  CMP_JUMP(regs[ip->c], flags > 0);
+op_cmp_rr_jle: CMP_JUMP(regs[ip->c], flags <= 0);
+op_cmp_rr_jge: CMP_JUMP(regs[ip->c], flags >= 0);
+op_cmp_ri_jz:  CMP_JUMP(ip->imm, flags == 0);
+op_cmp_ri_jnz: CMP_JUMP(ip->imm, flags != 0);
+op_cmp_ri_jl:  CMP_JUMP(ip->imm, flags < 0);
+op_cmp_ri_jg:  CMP_JUMP(ip->imm, flags > 0);
+op_cmp_ri_jle: CMP_JUMP(ip->imm, flags <= 0);
+op_cmp_ri_jge: CMP_JUMP(ip->imm, flags >= 0);
+
+// The increment never reaches the flags, the compare overwrites them
+op_inc_cmp_rr_jl: INC_CMP_JL(regs[ip[1].c]);
+op_inc_cmp_ri_jl: INC_CMP_JL(ip[1].imm);
+
+op_mov_rr_add_rr: MOV_ADD(regs[ip->b], regs[ip[1].c]);
+op_mov_rr_add_ri: MOV_ADD(regs[ip->b], ip[1].imm);
+op_mov_ri_add_rr: MOV_ADD(ip->imm, regs[ip[1].c]);
+op_mov_ri_add_ri: MOV_ADD(ip->imm, ip[1].imm);
+
+#undef CMP_JUMP
+#undef INC_CMP_JL
+#undef MOV_ADD
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef ALU_RR
+
+out:
+    cpu->pc = ip - code;
+    cpu->zero_flag = flags == 0;
+    cpu->negative_flag = flags < 0;
+    cpu->carry_flag = false;
+    if (executed) *executed = count;
+    return status;
+}
+
+int mpop_step(mpop_cpu_t* cpu) {
+    if (!cpu) return MPOP_ERROR_PARSE_ERROR;
+    if (cpu->pc >= cpu->program_size) {
+        cpu->running = false;
+        return MPOP_SUCCESS;
+    }
+    return mpop_execute(cpu, 1, NULL);
+}
+
+// Scancodes the Ctrl+C check looks for
+#define MPOP_SCAN_CTRL          0x1D
+#define MPOP_SCAN_CTRL_RELEASE  0x9D
+#define MPOP_SCAN_C             0x2E
+
+// Drains the keys typed while a foreground program runs, true on Ctrl+C
+static bool mpop_interrupted(mpop_cpu_t* cpu) {
+    uint8_t scan_code;
     
-    int instruction_count = 0;
-    const int MAX_INSTRUCTIONS = 10000; // Prevent infinite loops
+    while (keyboard_poll_scancode(&scan_code)) {
+        if (scan_code == MPOP_SCAN_CTRL) {
+            cpu->ctrl_held = true;
+        } else if (scan_code == MPOP_SCAN_CTRL_RELEASE) {
+            cpu->ctrl_held = false;
+        } else if (scan_code == MPOP_SCAN_C && cpu->ctrl_held) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Clears the counters for a run of the loaded program and measures what a
+// pair of TSC reads costs, so it can be taken off every sample
+static int mpop_profile_begin(mpop_cpu_t* cpu) {
+    mpop_profile_entry_t* profile = mpop_grow(cpu->profile, &cpu->profile_capacity,
+                                              cpu->program_size, sizeof(mpop_profile_entry_t));
+    if (!profile) {
+        return MPOP_ERROR_PROGRAM_TOO_LARGE;
+    }
+    cpu->profile = profile;
+    cpu->profile_size = cpu->program_size;
+    memset(profile, 0, cpu->program_size * sizeof(mpop_profile_entry_t));
     
-    while (cpu->running && instruction_count < MAX_INSTRUCTIONS) {
+    uint64_t overhead = 0;
+    for (int i = 0; i < 16; i++) {
+        uint64_t start = get_cpu_timestamp();
+        uint64_t cycles = get_cpu_timestamp() - start;
+        if (i == 0 || cycles < overhead) {
+            overhead = cycles;
+        }
+    }
+    cpu->profile_overhead = (uint32_t) overhead;
+    return MPOP_SUCCESS;
+}
+
+// One slice of a profiled run. Each instruction is stepped on its own and
+// charged the cycles it took
+static int mpop_profile_slice(mpop_cpu_t* cpu, uint32_t budget) {
+    for (uint32_t i = 0; i < budget && cpu->running; i++) {
+        uint32_t pc = cpu->pc;
+        
+        uint64_t start = get_cpu_timestamp();
         int result = mpop_step(cpu);
+        uint64_t cycles = get_cpu_timestamp() - start;
+        
+        if (pc < cpu->profile_size) {
+            mpop_profile_entry_t* entry = &cpu->profile[pc];
+            entry->count++;
+            entry->cycles += cycles > cpu->profile_overhead ? cycles - cpu->profile_overhead : 0;
+        }
         if (result != MPOP_SUCCESS) {
             return result;
         }
-        instruction_count++;
+    }
+    return MPOP_SUCCESS;
+}
+
+// Runs the program in bounded slices, yielding the CPU between them so an
+// endless loop never holds up the rest of the system
+static int mpop_run_slices(mpop_cpu_t* cpu) {
+    if (cpu->profiling) {
+        int result = mpop_profile_begin(cpu);
+        if (result != MPOP_SUCCESS) {
+            return result;
+        }
+    }
+    
+    while (cpu->running) {
+        if (cpu->cancel) {
+            return MPOP_ERROR_CANCELLED;
+        }
+        if (!cpu->background && mpop_interrupted(cpu)) {
+            printr("^C\n");
+            return MPOP_ERROR_CANCELLED;
+        }
+        
+        // The JIT budget counts backward branches rather than instructions
+        int result;
+        if (cpu->profiling) {
+            result = mpop_profile_slice(cpu, MPOP_SLICE_INSTRUCTIONS);
+        } else if (cpu->jit_enabled) {
+            result = mpop_jit_run(cpu, MPOP_SLICE_BRANCHES);
+        } else {
+            result = mpop_execute(cpu, MPOP_SLICE_INSTRUCTIONS, NULL);
+        }
+        if (result != MPOP_SUCCESS) {
+            return result;
+        }
+        
+        if (cpu->running && scheduler_ready()) {
+            task_yield();
+        }
+    }
+    return MPOP_SUCCESS;
+}
+
+// Body of the task that owns a running program
+static void mpop_task(void* arg) {
+    mpop_cpu_t* cpu = (mpop_cpu_t*) arg;
+    
+    cpu->status = mpop_run_slices(cpu);
+    cpu->running = false;
+    
+    if (cpu->background) {
+        int index = (int) (cpu - mpop_instances);
+        if (cpu->status == MPOP_SUCCESS) {
+            printr("[mpop %d] finished\n", index);
+        } else {
+            printr("[mpop %d] %s\n", index, mpop_get_error_string(cpu->status));
+        }
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&mpop_pool_lock);
+    if (cpu->release_on_exit) {
+        cpu->release_on_exit = false;
+        cpu->in_use = false;
+    }
+    cpu->task_active = false;
+    spin_unlock_irqrestore(&mpop_pool_lock, flags);
+    
+    wake_up(&cpu->done);
+}
+
+// Hands the loaded program to a new task, -1 if none could be created
+static int mpop_spawn(mpop_cpu_t* cpu, bool background) {
+    cpu->background = background;
+    cpu->cancel = false;
+    cpu->ctrl_held = false;
+    cpu->pc = 0;
+    cpu->running = true;
+    cpu->task_active = true;
+    
+    cpu->task_id = kthread_create("mpop", mpop_task, cpu);
+    if (cpu->task_id < 0) {
+        cpu->running = false;
+        cpu->task_active = false;
+    }
+    return cpu->task_id;
+}
+
+int mpop_run(mpop_cpu_t* cpu) {
+    if (!cpu) return MPOP_ERROR_PARSE_ERROR;
+    if (cpu->task_active) return MPOP_ERROR_BUSY;
+    
+    if (cpu->debug_mode) {
+        cpu->running = true;
+        cpu->pc = 0;
         
-        if (cpu->debug_mode) {
+        while (cpu->running) {
+            printr("PC: %d, Opcode: %d\n", cpu->pc, cpu->program[cpu->pc].op);
+            int result = mpop_step(cpu);
+            if (result != MPOP_SUCCESS) {
+                return result;
+            }
+            
             mpop_debug_print(cpu);
             printr("Press Enter to continue...\n");
-            char temp[2];
-            keyboard_input(temp);
+            char temp[COMMAND_BUFFER_SIZE];
+            if (keyboard_input(temp)) {
+                cpu->running = false;
+                return MPOP_ERROR_CANCELLED;
+            }
         }
+        return MPOP_SUCCESS;
     }
     
-    if (instruction_count >= MAX_INSTRUCTIONS) {
-        printr("Warning: Maximum instruction limit reached\n");
+    // The program gets a task of its own and the caller sleeps until it ends.
+    // Before the scheduler is up, or with the task table full, the slices
+    // run right here; they still yield between slices
+    if (scheduler_ready() && mpop_spawn(cpu, false) >= 0) {
+        wait_event(cpu->done, !cpu->task_active);
+        return cpu->status;
     }
     
+    cpu->background = false;
+    cpu->cancel = false;
+    cpu->running = true;
+    cpu->pc = 0;
+    cpu->status = mpop_run_slices(cpu);
+    cpu->running = false;
+    return cpu->status;
+}
+
+int mpop_start(mpop_cpu_t* cpu) {
+    if (!cpu) return MPOP_ERROR_PARSE_ERROR;
+    if (cpu->task_active) return MPOP_ERROR_BUSY;
+    
+    if (!scheduler_ready() || mpop_spawn(cpu, true) < 0) {
+        return MPOP_ERROR_NO_TASK;
+    }
     return MPOP_SUCCESS;
 }
 
+void mpop_cancel(mpop_cpu_t* cpu) {
+    if (cpu) {
+        cpu->cancel = true;
+    }
+}
+
 void mpop_set_debug(mpop_cpu_t* cpu, bool debug) {
     if (cpu) {
         cpu->debug_mode = debug;
@@ -892,6 +2020,224 @@ void mpop_debug_print(mpop_cpu_t* cpu) {
     printr("=====================\n\n");
 }
 
+#define MPOP_PROFILE_TOP    10  // Instructions listed by mpop_profile_report
+
+// Index of the label whose code holds pc, the one with the highest address
+// not past it. -1 before the first label
+static int mpop_label_owner(mpop_cpu_t* cpu, uint32_t pc) {
+    int owner = -1;
+    for (uint32_t i = 0; i < cpu->label_count; i++) {
+        uint32_t address = cpu->labels[i].address;
+        if (address <= pc && (owner < 0 || address > cpu->labels[owner].address)) {
+            owner = i;
+        }
+    }
+    return owner;
+}
+
+// Share of total in tenths of a percent, without 64-bit division
+static uint32_t mpop_profile_share(uint64_t cycles, uint64_t total) {
+    // Small enough that cycles * 1000 still fits in 32 bits
+    while (total > 0x3FFFFF) {
+        cycles >>= 1;
+        total >>= 1;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    return (uint32_t) cycles * 1000 / (uint32_t) total;
+}
+
+static void mpop_profile_line(uint32_t count, uint64_t cycles, uint64_t total) {
+    uint32_t share = mpop_profile_share(cycles, total);
+    printr("%10u  %10u  %3u.%u%%  ", count, cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) cycles,
+           share / 10, share % 10);
+}
+
+void mpop_profile_report(mpop_cpu_t* cpu) {
+    if (!cpu || cpu->profile_size == 0) {
+        printr("No profile recorded, turn it on with 'profile on' and run\n");
+        return;
+    }
+    
+    // Totals, and the time of every label with the code before the first
+    // label kept in the last slot
+    static uint32_t label_counts[MPOP_MAX_LABELS + 1];
+    static uint64_t label_cycles[MPOP_MAX_LABELS + 1];
+    uint32_t hot[MPOP_PROFILE_TOP];
+    uint32_t hot_count = 0;
+    uint64_t total_cycles = 0;
+    uint32_t total_count = 0;
+    
+    for (uint32_t i = 0; i <= MPOP_MAX_LABELS; i++) {
+        label_counts[i] = 0;
+        label_cycles[i] = 0;
+    }
+    
+    for (uint32_t pc = 0; pc < cpu->profile_size; pc++) {
+        mpop_profile_entry_t* entry = &cpu->profile[pc];
+        if (entry->count == 0) continue;
+        
+        total_cycles += entry->cycles;
+        total_count += entry->count;
+        
+        int owner = mpop_label_owner(cpu, pc);
+        uint32_t slot = owner < 0 ? MPOP_MAX_LABELS : (uint32_t) owner;
+        label_counts[slot] += entry->count;
+        label_cycles[slot] += entry->cycles;
+        
+        // Keep the hottest instructions in order, dropping the coolest
+        uint32_t at = hot_count < MPOP_PROFILE_TOP ? hot_count++ : MPOP_PROFILE_TOP;
+        while (at > 0 && cpu->profile[hot[at - 1]].cycles < entry->cycles) {
+            if (at < MPOP_PROFILE_TOP) hot[at] = hot[at - 1];
+            at--;
+        }
+        if (at < MPOP_PROFILE_TOP) hot[at] = pc;
+    }
+    
+    printr("Profile: %u instructions executed, %u cycles\n", total_count,
+           total_cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) total_cycles);
+    
+    printr("\n  pc       count      cycles    share  where\n");
+    for (uint32_t i = 0; i < hot_count; i++) {
+        uint32_t pc = hot[i];
+        printr("%4u  ", pc);
+        mpop_profile_line(cpu->profile[pc].count, cpu->profile[pc].cycles, total_cycles);
+        
+        int owner = mpop_label_owner(cpu, pc);
+        if (owner < 0) {
+            printr("%u\n", pc);
+        } else {
+            printr("%s+%u\n", cpu->labels[owner].name, pc - cpu->labels[owner].address);
+        }
+    }
+    
+    // Labels by time spent, a selection pass per line is plenty for 128
+    printr("\n     count      cycles    share  label\n");
+    static bool listed[MPOP_MAX_LABELS + 1];
+    for (uint32_t i = 0; i <= MPOP_MAX_LABELS; i++) {
+        listed[i] = false;
+    }
+    while (true) {
+        int best = -1;
+        for (uint32_t i = 0; i <= MPOP_MAX_LABELS; i++) {
+            if (listed[i] || label_counts[i] == 0) continue;
+            if (best < 0 || label_cycles[i] > label_cycles[best]) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        
+        listed[best] = true;
+        mpop_profile_line(label_counts[best], label_cycles[best], total_cycles);
+        printr("%s\n", best == MPOP_MAX_LABELS ? "(entry)" : cpu->labels[best].name);
+    }
+}
+
+#define MPOP_BENCH_RUNS     5
+#define MPOP_BENCH_BUDGET   100000000   // Instructions, or JIT branches, per run
+
+static void mpop_bench_reset(void* arg) {
+    mpop_cpu_t* cpu = arg;
+    mpop_reset(cpu);
+    cpu->running = true;
+}
+
+static int mpop_bench_interpret(void* arg) {
+    return mpop_execute(arg, MPOP_BENCH_BUDGET, NULL);
+}
+
+static int mpop_bench_native(void* arg) {
+    return mpop_jit_run(arg, MPOP_BENCH_BUDGET);
+}
+
+// Best of MPOP_BENCH_RUNS runs of the loaded program in TSC cycles, 0 if it fails
+static uint32_t mpop_bench_run(mpop_cpu_t* cpu, bool jit) {
+    return bench_best_cycles(MPOP_BENCH_RUNS, mpop_bench_reset,
+                             jit ? mpop_bench_native : mpop_bench_interpret, cpu);
+}
+
+// Time every built-in example with its output muted. Leaves the last one loaded
+static void mpop_bench(mpop_cpu_t* cpu) {
+    const char* names[] = { "hello", "fib", "fact", "primes", "sort", "test" };
+    const char* programs[] = { MPOP_HELLO_WORLD, MPOP_FIBONACCI, MPOP_FACTORIAL,
+                               MPOP_PRIMES, MPOP_BUBBLE_SORT, MPOP_TESTr };
+    
+    printr("program       interp         jit  speedup\n");
+    cpu->quiet = true;
+    for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        int result = mpop_load_program(cpu, programs[i]);
+        uint32_t interpreted = result == MPOP_SUCCESS ? mpop_bench_run(cpu, false) : 0;
+        uint32_t native = result == MPOP_SUCCESS ? mpop_bench_run(cpu, true) : 0;
+        
+        printr("%s", names[i]);
+        for (int pad = strlen(names[i]); pad < 8; pad++) {
+            printr(" ");
+        }
+        if (!interpreted || !native) {
+            printr("  failed\n");
+            continue;
+        }
+        
+        uint32_t tenths = native >= 10 ? interpreted / (native / 10) : 0;
+        printr("%10u  %10u  %4u.%ux\n", interpreted, native, tenths / 10, tenths % 10);
+    }
+    cpu->quiet = false;
+    mpop_reset(cpu);
+    printr("Cycles, best of %d runs\n", MPOP_BENCH_RUNS);
+}
+
+// What the peephole pass did to the program just loaded
+static void mpop_print_peephole(mpop_cpu_t* cpu) {
+    if (!cpu->optimize || cpu->program_size == 0) return;
+    printr("Peephole: %u instructions -> %u dispatches, %u superinstructions, "
+           "%u dead flag updates\n", cpu->program_size, cpu->dispatch_count,
+           cpu->fused_count, cpu->dead_flag_count);
+}
+
+// Shell commands that change the program or its state, refused while a
+// background task is running it
+static bool mpop_command_needs_idle(const char* input) {
+    return strncmp(input, "load", 4) == 0 || strcmp(input, "run") == 0 ||
+           strcmp(input, "start") == 0 || strcmp(input, "step") == 0 ||
+           strcmp(input, "reset") == 0 || strncmp(input, "set ", 4) == 0 ||
+           strncmp(input, "debug ", 6) == 0 || strncmp(input, "jit ", 4) == 0 ||
+           strncmp(input, "profile ", 8) == 0 || strncmp(input, "opt ", 4) == 0 ||
+           strcmp(input, "bench") == 0;
+}
+
+// Index after a command word, -1 unless it names an instance slot
+static int mpop_parse_instance(const char* text) {
+    if (*text < '0' || *text > '9' || text[1] != '\0') {
+        return -1;
+    }
+    int index = *text - '0';
+    return index < MPOP_MAX_INSTANCES ? index : -1;
+}
+
+// Returns every instance in the owned mask to the pool
+static void mpop_release_instances(uint32_t owned) {
+    for (int i = 0; i < MPOP_MAX_INSTANCES; i++) {
+        if (owned & (1u << i)) {
+            mpop_cleanup(&mpop_instances[i]);
+        }
+    }
+}
+
+// Lists the instances in use, * marks the one the shell works on
+static void mpop_list_instances(mpop_cpu_t* current) {
+    printr("  id  state     pc    program\n");
+    for (int i = 0; i < MPOP_MAX_INSTANCES; i++) {
+        mpop_cpu_t* cpu = &mpop_instances[i];
+        if (!cpu->in_use && !cpu->task_active) continue;
+        
+        const char* state = cpu->task_active ? (cpu->background ? "bg" : "fg")
+                          : (cpu->status == MPOP_SUCCESS ? "idle" : "error");
+        printr("%c %2d  %-8s %5u  %u instructions\n", cpu == current ? '*' : ' ',
+               i, state, cpu->pc, cpu->program_size);
+    }
+}
+
 void mpop_command(int argc, char* argv[]) {
     char input[COMMAND_BUFFER_SIZE];
     mpop_cpu_t* cpu = mpop_init();
@@ -900,10 +2246,12 @@ void mpop_command(int argc, char* argv[]) {
         printr("Error: Failed to initialize MPOP CPU\n");
         return;
     }
+    // Instances this shell took, background runs keep theirs until they end
+    uint32_t owned = 1u << (cpu - mpop_instances);
     
     printr("\nMPOP Virtual CPU\n");
     printr("Commands:\n");
-    printr("  load <program>  - load program (hello/fib/fact/test)\n");
+    printr("  load <program>  - load program (hello/fib/fact/primes/test)\n");
     printr("  run             - Execute loaded program\n");
     printr("  step            - Execute single instruction\n");
     printr("  debug on/off    - Toggle debug mode\n");
@@ -915,16 +2263,70 @@ void mpop_command(int argc, char* argv[]) {
     printr("  stack           - loads stack\n");
     printr("  labels          - Shows labels\n");
     printr("  tutorial        - Shows tutorial\n");
+    printr("  jit on/off      - Run through native code\n");
+    printr("  bench           - Time interpreter against JIT\n");
+    printr("  opt on/off      - Fuse instructions when loading\n");
+    printr("  profile on/off  - Count and time every instruction of a run\n");
+    printr("  profile         - Show the hot spots of the last profiled run\n");
+    printr("  start           - Run the program in the background\n");
+    printr("  ps              - List MPOP instances\n");
+    printr("  kill <n>        - Stop the program of instance n\n");
+    printr("  new             - Switch to a fresh instance, keeping this one\n");
+    printr("  use <n>         - Switch to instance n\n");
     printr("  exit            - Exit MPOP\n\n");
     
     while (true) {
         printr("mpop> ");
         if (keyboard_input(input)) {
+            mpop_release_instances(owned);
             return;
         }
         
+        if (cpu->task_active && mpop_command_needs_idle(input)) {
+            printr("Instance busy, wait for it or kill it\n");
+            continue;
+        }
+        
         if (strcmp(input, "exit") == 0) {
             break;
+        } else if (strcmp(input, "start") == 0) {
+            if (cpu->program_size == 0) {
+                printr("No program loaded\n");
+                continue;
+            }
+            int result = mpop_start(cpu);
+            if (result != MPOP_SUCCESS) {
+                printr("Error: %s\n", mpop_get_error_string(result));
+            } else {
+                printr("[mpop %d] started\n", (int) (cpu - mpop_instances));
+            }
+        } else if (strcmp(input, "ps") == 0) {
+            mpop_list_instances(cpu);
+        } else if (strncmp(input, "kill ", 5) == 0) {
+            int index = mpop_parse_instance(input + 5);
+            if (index < 0 || !mpop_instances[index].task_active) {
+                printr("No running instance %s\n", input + 5);
+                continue;
+            }
+            mpop_cancel(&mpop_instances[index]);
+        } else if (strcmp(input, "new") == 0) {
+            mpop_cpu_t* fresh = mpop_init();
+            if (!fresh) {
+                printr("All %d instances are in use\n", MPOP_MAX_INSTANCES);
+                continue;
+            }
+            cpu = fresh;
+            owned |= 1u << (cpu - mpop_instances);
+            printr("Using instance %d\n", (int) (cpu - mpop_instances));
+        } else if (strncmp(input, "use ", 4) == 0) {
+            int index = mpop_parse_instance(input + 4);
+            mpop_cpu_t* target = index < 0 ? NULL : &mpop_instances[index];
+            if (!target || !(owned & (1u << index))) {
+                printr("No instance %s\n", input + 4);
+                continue;
+            }
+            cpu = target;
+            printr("Using instance %d\n", index);
         } else if (strcmp(input, "help") == 0) {
             printr("MPOP Instruction Set:\n");
             printr("Data: mov, load, store\n");
@@ -954,9 +2356,13 @@ void mpop_command(int argc, char* argv[]) {
             printr("Running program...\n");
             int result = mpop_run(cpu);
             if (result != MPOP_SUCCESS) {
-                            } else {
+                printr("Execution error: %s\n", mpop_get_error_string(result));
+            } else {
                 printr("Program completed successfully\n");
             }
+            if (cpu->profiling && !cpu->debug_mode) {
+                mpop_profile_report(cpu);
+            }
         } else if (strcmp(input, "step") == 0) {
             if (cpu->program_size == 0) {
                 printr("No program loaded\n");
@@ -975,30 +2381,64 @@ void mpop_command(int argc, char* argv[]) {
             int result = mpop_load_program(cpu, MPOP_HELLO_WORLD);
             if (result == MPOP_SUCCESS) {
                 printr("Hello World program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
             } else {
-                printr("Failed to load program: %s\n", mpop_get_error_string(result));
+                mpop_print_load_error(cpu, result);
             }
         } else if (strcmp(input, "load fib") == 0) {
             int result = mpop_load_program(cpu, MPOP_FIBONACCI);
             if (result == MPOP_SUCCESS) {
                 printr("Fibonacci program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
             } else {
-                printr("Failed to load program: %s\n", mpop_get_error_string(result));
+                mpop_print_load_error(cpu, result);
             }
         } else if (strcmp(input, "load fact") == 0) {
             int result = mpop_load_program(cpu, MPOP_FACTORIAL);
             if (result == MPOP_SUCCESS) {
                 printr("Factorial program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
+            } else {
+                mpop_print_load_error(cpu, result);
+            }
+        } else if (strcmp(input, "load primes") == 0) {
+            int result = mpop_load_program(cpu, MPOP_PRIMES);
+            if (result == MPOP_SUCCESS) {
+                printr("Primes program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
             } else {
-                printr("Failed to load program: %s\n", mpop_get_error_string(result));
+                mpop_print_load_error(cpu, result);
             }
+        } else if (strcmp(input, "jit on") == 0) {
+            cpu->jit_enabled = true;
+            printr("JIT enabled\n");
+        } else if (strcmp(input, "jit off") == 0) {
+            cpu->jit_enabled = false;
+            printr("JIT disabled\n");
+        } else if (strcmp(input, "bench") == 0) {
+            mpop_bench(cpu);
+        } else if (strcmp(input, "opt on") == 0) {
+            cpu->optimize = true;
+            printr("Peephole pass enabled for the next load\n");
+        } else if (strcmp(input, "opt off") == 0) {
+            cpu->optimize = false;
+            printr("Peephole pass disabled for the next load\n");
+        } else if (strcmp(input, "profile on") == 0) {
+            cpu->profiling = true;
+            printr("Profiling enabled, runs use the interpreter\n");
+        } else if (strcmp(input, "profile off") == 0) {
+            cpu->profiling = false;
+            printr("Profiling disabled\n");
+        } else if (strcmp(input, "profile") == 0) {
+            mpop_profile_report(cpu);
         } 
         else if (strcmp(input, "load test") == 0) {
             int result = mpop_load_program(cpu, MPOP_TESTr);
             if (result == MPOP_SUCCESS) {
                 printr("Test program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
             } else {
-                printr("Failed to load program: %s\n", mpop_get_error_string(result));
+                mpop_print_load_error(cpu, result);
             }
         } else if (strncmp(input, "load ", 5) == 0) {
             // Custom program loading
@@ -1025,14 +2465,16 @@ void mpop_command(int argc, char* argv[]) {
             int result = mpop_load_program(cpu, processed_program);
             if (result == MPOP_SUCCESS) {
                 printr("Custom program loaded (%d instructions)\n", cpu->program_size);
+                mpop_print_peephole(cpu);
             } else {
-                printr("Failed to load program: %s\n", mpop_get_error_string(result));
+                mpop_print_load_error(cpu, result);
             }
         } else if (strcmp(input, "examples") == 0) {
             printr("Available example programs:\n");
             printr("  hello - Hello World\n");
             printr("  fib   - Fibonacci sequence\n");
             printr("  fact  - Factorial calculation\n");
+            printr("  primes - Count primes below 5000\n");
             printr("\nCustom program syntax:\n");
             printr("  load mov R0, 42\nprintr R0\nHALT\n");
         } else if (strcmp(input, "mem") == 0) {
@@ -1111,10 +2553,7 @@ void mpop_command(int argc, char* argv[]) {
             }
         } else if (strcmp(input, "program") == 0) {
             printr("loaded program (%d instructions):\n", cpu->program_size);
-            for (uint32_t i = 0; i < cpu->program_size; i++) {
-                char marker = (i == cpu->pc) ? '>' : ' ';
-                printr("%c %03d: opcode=%d\n", marker, i, cpu->program[i].opcode);
-            }
+            mpop_disassemble(cpu);
         } else if (strcmp(input, "tutorial") == 0) {
             printr("MPOP Tutorial:\n");
             printr("1. load a program: load hello\n");
@@ -1129,7 +2568,7 @@ void mpop_command(int argc, char* argv[]) {
         }
     }
     
-    mpop_cleanup(cpu);
+    mpop_release_instances(owned);
 }
 
 // additional utility functions for enhanced functionality
@@ -1209,27 +2648,70 @@ int mpop_validate_program(const char* assembly) {
     return MPOP_SUCCESS;
 }
 
-// Disassembler function
+// Mnemonic of an MPOP opcode, for listings
+static const char* mpop_opcode_name(mpop_opcode_t opcode) {
+    switch (opcode) {
+        case MPOP_NOP: return "NOP";     case MPOP_MOV: return "MOV";
+        case MPOP_LOAD: return "LOAD";   case MPOP_STORE: return "STORE";
+        case MPOP_ADD: return "ADD";     case MPOP_SUB: return "SUB";
+        case MPOP_MUL: return "MUL";     case MPOP_DIV: return "DIV";
+        case MPOP_MOD: return "MOD";     case MPOP_INC: return "INC";
+        case MPOP_DEC: return "DEC";     case MPOP_AND: return "AND";
+        case MPOP_OR: return "OR";       case MPOP_XOR: return "XOR";
+        case MPOP_NOT: return "NOT";     case MPOP_SHL: return "SHL";
+        case MPOP_SHR: return "SHR";     case MPOP_CMP: return "CMP";
+        case MPOP_TEST: return "TEST";   case MPOP_JMP: return "JMP";
+        case MPOP_JZ: return "JZ";       case MPOP_JNZ: return "JNZ";
+        case MPOP_JE: return "JE";       case MPOP_JNE: return "JNE";
+        case MPOP_JL: return "JL";       case MPOP_JG: return "JG";
+        case MPOP_JLE: return "JLE";     case MPOP_JGE: return "JGE";
+        case MPOP_CALL: return "CALL";   case MPOP_RET: return "RET";
+        case MPOP_PUSH: return "PUSH";   case MPOP_POP: return "POP";
+        case MPOP_PRINT: return "PRINT"; case MPOP_PRINTC: return "PRINTC";
+        case MPOP_PRINTS: return "PRINTS"; case MPOP_INPUT: return "INPUT";
+        case MPOP_HALT: return "HALT";
+        default: return "???";
+    }
+}
+
+static void mpop_print_operand(mpop_operand_t* operand) {
+    switch (operand->type) {
+        case MPOP_OPERAND_REGISTER:  printr(" R%d", operand->value.reg_num); break;
+        case MPOP_OPERAND_IMMEDIATE: printr(" %d", operand->value.immediate); break;
+        case MPOP_OPERAND_MEMORY:    printr(" [%d]", operand->value.address); break;
+        default: break;
+    }
+}
+
+static void mpop_print_target(mpop_cpu_t* cpu, int32_t target) {
+    const char* label = mpop_label_at(cpu, target);
+    if (label) printr(" %s", label);
+    else printr(" %d", target);
+}
+
+// Disassembler function, works from the packed form with label names taken
+// from the label table
 void mpop_disassemble(mpop_cpu_t* cpu) {
     if (!cpu || cpu->program_size == 0) {
         printr("No program loaded\n");
         return;
     }
     
-    const char* opcode_names[] = {
-        "NOP", "mov", "load", "store",
-        "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???",
-        "add", "sub", "mul", "DIV", "MOD", "INC", "DEC",
-        "???", "???", "???", "???", "???", "???", "???", "???", "???",
-        "AND", "OR", "XOR", "NOT", "SHL", "SHR",
-        "???", "???", "???", "???", "???", "???", "???", "???", "???", "???",
-        "CMP", "TEST",
-        "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???",
-        "JMP", "JZ", "JNZ", "JE", "JNE", "JL", "JG", "CALL", "RET",
-        "???", "???", "???", "???", "???", "???", "???",
-        "PUSH", "POP",
-        "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???", "???",
-        "PRINT", "PRINTC", "PRINTS", "INPUT"
+    static const char* const names[VOP_COUNT] = {
+        [VOP_END] = "END", [VOP_NOP] = "NOP", [VOP_HALT] = "HALT",
+        [VOP_MOV_RR] = "MOV", [VOP_MOV_RI] = "MOV",
+        [VOP_ADD_RR] = "ADD", [VOP_ADD_RI] = "ADD", [VOP_SUB_RR] = "SUB", [VOP_SUB_RI] = "SUB",
+        [VOP_MUL_RR] = "MUL", [VOP_MUL_RI] = "MUL", [VOP_DIV_RR] = "DIV", [VOP_DIV_RI] = "DIV",
+        [VOP_MOD_RR] = "MOD", [VOP_MOD_RI] = "MOD", [VOP_AND_RR] = "AND", [VOP_AND_RI] = "AND",
+        [VOP_OR_RR] = "OR", [VOP_OR_RI] = "OR", [VOP_XOR_RR] = "XOR", [VOP_XOR_RI] = "XOR",
+        [VOP_SHL_RR] = "SHL", [VOP_SHL_RI] = "SHL", [VOP_SHR_RR] = "SHR", [VOP_SHR_RI] = "SHR",
+        [VOP_CMP_RR] = "CMP", [VOP_CMP_RI] = "CMP",
+        [VOP_INC] = "INC", [VOP_DEC] = "DEC", [VOP_NOT] = "NOT",
+        [VOP_JMP] = "JMP", [VOP_JZ] = "JZ", [VOP_JNZ] = "JNZ", [VOP_JL] = "JL", [VOP_JG] = "JG",
+        [VOP_JLE] = "JLE", [VOP_JGE] = "JGE",
+        [VOP_CALL] = "CALL", [VOP_RET] = "RET",
+        [VOP_PUSH_R] = "PUSH", [VOP_PUSH_I] = "PUSH", [VOP_POP] = "POP",
+        [VOP_PRINT] = "PRINT", [VOP_PRINTC_R] = "PRINTC", [VOP_PRINTC_I] = "PRINTC",
     };
     
     printr("Disassembly:\n");
@@ -1237,14 +2719,50 @@ void mpop_disassemble(mpop_cpu_t* cpu) {
         mpop_instruction_t* instr = &cpu->program[i];
         char marker = (i == cpu->pc) ? '>' : ' ';
         
-        if (instr->opcode < sizeof(opcode_names)/sizeof(opcode_names[0])) {
-            printr("%c %03d: %s\n", marker, i, opcode_names[instr->opcode]);
-        } else if (instr->opcode == MPOP_HALT) {
-            printr("%c %03d: HALT\n", marker, i);
-        } else {
-            printr("%c %03d: UNKNOWN(%d)\n", marker, i, instr->opcode);
+        const char* label = mpop_label_at(cpu, i);
+        if (label) {
+            printr("%s:\n", label);
         }
+        
+        if (instr->op == VOP_GENERIC) {
+            mpop_slow_instruction_t* slow = &cpu->slow[instr->imm];
+            printr("%c %03d: %s", marker, i, mpop_opcode_name(slow->opcode));
+            mpop_print_operand(&slow->operand1);
+            mpop_print_operand(&slow->operand2);
+            printr("\n");
+            continue;
+        }
+        
+        uint8_t op = mpop_base_op(instr->op);
+        printr("%c %03d: %s", marker, i, names[op]);
+        switch (op) {
+            case VOP_MOV_RR: printr(" R%d R%d", instr->a, instr->b); break;
+            case VOP_MOV_RI: printr(" R%d %d", instr->a, instr->imm); break;
+            case VOP_CMP_RR: printr(" R%d R%d", instr->b, instr->c); break;
+            case VOP_CMP_RI: printr(" R%d %d", instr->b, instr->imm); break;
+            case VOP_INC: case VOP_DEC: case VOP_NOT:
+            case VOP_PUSH_R: case VOP_POP: case VOP_PRINT: case VOP_PRINTC_R:
+                printr(" R%d", instr->a);
+                break;
+            case VOP_PUSH_I: case VOP_PRINTC_I:
+                printr(" %d", instr->imm);
+                break;
+            case VOP_JMP: case VOP_JZ: case VOP_JNZ: case VOP_JL: case VOP_JG:
+            case VOP_JLE: case VOP_JGE: case VOP_CALL:
+                mpop_print_target(cpu, instr->imm);
+                break;
+            default:
+                if (op >= VOP_ADD_RR && op <= VOP_SHR_RI) {
+                    bool immediate = (op - VOP_ADD_RR) & 1;
+                    printr(" R%d R%d", instr->a, instr->b);
+                    if (immediate) printr(" %d", instr->imm);
+                    else printr(" R%d", instr->c);
+                }
+                break;
+        }
+        if (op != instr->op) {
+            printr("   ; fused with the next");
+        }
+        printr("\n");
     }
 }
-
-
@@ -4,13 +4,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>  // For va_list
+#include "../scheduler/task.h"
 // Configuration constants
 #define MPOP_MEMORY_SIZE 1024
 #define MPOP_STACK_SIZE 256
 #define MPOP_REGISTER_COUNT 16
-#define MPOP_MAX_CODE_SIZE 2048
-#define MPOP_MAX_LABELS 64
+#define MPOP_MAX_CODE_SIZE 20480
+#define MPOP_MAX_LABELS 128
 #define MPOP_MAX_LABEL_NAME 32
+#define MPOP_LABEL_HASH_SIZE 256   // Power of two, at least twice MPOP_MAX_LABELS
+#define MPOP_MAX_FIXUPS 1024       // Forward label references per program
+#define MPOP_LABEL_UNDEFINED 0xFFFFFFFF
+#define MPOP_MAX_INSTANCES 4            // CPUs that can exist at once
+#define MPOP_SLICE_INSTRUCTIONS 20000   // Interpreted per slice before yielding
+#define MPOP_SLICE_BRANCHES 5000        // JIT branches per slice before yielding
 
 // MPOP Opcodes
 typedef enum {
@@ -51,6 +58,8 @@ typedef enum {
     MPOP_JG = 0x46,         // JG addr - Jump if greater
     MPOP_CALL = 0x47,       // CALL addr - Call subroutine
     MPOP_RET = 0x48,        // RET - Return from subroutine
+    MPOP_JLE = 0x49,        // JLE addr - Jump if less or equal
+    MPOP_JGE = 0x4A,        // JGE addr - Jump if greater or equal
     
     // Stack operations
     MPOP_PUSH = 0x50,       // PUSH src - Push to stack
@@ -71,7 +80,8 @@ typedef enum {
     MPOP_OPERAND_REGISTER,  // Register (R0-R15)
     MPOP_OPERAND_IMMEDIATE, // Immediate value
     MPOP_OPERAND_MEMORY,    // Memory address
-    MPOP_OPERAND_LABEL      // Label reference
+    MPOP_OPERAND_LABEL,     // Label reference
+    MPOP_OPERAND_NONE       // Operand not given
 } mpop_operand_type_t;
 
 // Operand structure
@@ -85,17 +95,71 @@ typedef struct {
     } value;
 } mpop_operand_t;
 
-// Instruction structure
+// Full operand form, only kept for the rare instructions without a packed
+// encoding (memory operands, I/O, computed jumps)
 typedef struct {
     mpop_opcode_t opcode;
     mpop_operand_t operand1;
     mpop_operand_t operand2;
+} mpop_slow_instruction_t;
+
+// Operations of the lowered program. Each two-operand ALU op comes as a
+// register form followed by its immediate form so lowering can add 1
+enum {
+    VOP_END, VOP_GENERIC, VOP_NOP, VOP_HALT,
+    VOP_MOV_RR, VOP_MOV_RI,
+    VOP_ADD_RR, VOP_ADD_RI, VOP_SUB_RR, VOP_SUB_RI, VOP_MUL_RR, VOP_MUL_RI,
+    VOP_DIV_RR, VOP_DIV_RI, VOP_MOD_RR, VOP_MOD_RI,
+    VOP_AND_RR, VOP_AND_RI, VOP_OR_RR, VOP_OR_RI, VOP_XOR_RR, VOP_XOR_RI,
+    VOP_SHL_RR, VOP_SHL_RI, VOP_SHR_RR, VOP_SHR_RI,
+    VOP_CMP_RR, VOP_CMP_RI,
+    VOP_INC, VOP_DEC, VOP_NOT,
+    VOP_JMP, VOP_JZ, VOP_JNZ, VOP_JL, VOP_JG, VOP_JLE, VOP_JGE, VOP_CALL, VOP_RET,
+    VOP_PUSH_R, VOP_PUSH_I, VOP_POP,
+    VOP_PRINT, VOP_PRINTC_R, VOP_PRINTC_I,
+    
+    // Superinstructions, written by the peephole pass over the first of the
+    // instructions they cover. Those keep their own encoding, so a jump into
+    // the middle still works. Compare-and-branch follows the VOP_JZ order
+    VOP_CMP_RR_JZ, VOP_CMP_RR_JNZ, VOP_CMP_RR_JL, VOP_CMP_RR_JG, VOP_CMP_RR_JLE, VOP_CMP_RR_JGE,
+    VOP_CMP_RI_JZ, VOP_CMP_RI_JNZ, VOP_CMP_RI_JL, VOP_CMP_RI_JG, VOP_CMP_RI_JLE, VOP_CMP_RI_JGE,
+    VOP_INC_CMP_RR_JL, VOP_INC_CMP_RI_JL,
+    VOP_MOV_RR_ADD_RR, VOP_MOV_RR_ADD_RI, VOP_MOV_RI_ADD_RR, VOP_MOV_RI_ADD_RI,
+    VOP_COUNT
+};
+
+// Packed instruction run by the threaded interpreter, 12 bytes. Operand kinds
+// are folded into op, so the common register/immediate forms need no decoding
+typedef struct {
+    const void* handler;    // Dispatch target, filled in on the first run
+    uint8_t op;             // Lowered operation
+    uint8_t a;              // Destination register
+    uint8_t b;              // First source register
+    uint8_t c;              // Second source register
+    int32_t imm;            // Immediate, branch target or slow[] index
 } mpop_instruction_t;
 
+// State passed between C and the native code of mpop_jit_run. The generated
+// code addresses it absolutely, so it lives inside the CPU it was built for
+typedef struct {
+    uint32_t entry;         // Native address to start at
+    uint32_t pc;            // Instruction to resume at after an exit
+    uint32_t sp;
+    uint32_t budget;        // Backward branches and returns left, 0 for no limit
+    int32_t flags;          // Last result stand-in, loaded into EFLAGS on entry
+    uint32_t eflags;        // EFLAGS at the exit
+} mpop_jit_frame_t;
+
+// What the profiler has seen of one instruction
+typedef struct {
+    uint32_t count;         // Times it was executed
+    uint64_t cycles;        // TSC cycles spent in it, timer overhead removed
+} mpop_profile_entry_t;
+
 // Label structure
 typedef struct {
     char name[MPOP_MAX_LABEL_NAME];
-    uint32_t address;
+    uint32_t address;       // MPOP_LABEL_UNDEFINED until its line is reached
 } mpop_label_t;
 
 // CPU state structure
@@ -111,17 +175,62 @@ typedef struct {
     bool carry_flag;
     bool negative_flag;
     
-    // Program storage
-    mpop_instruction_t program[MPOP_MAX_CODE_SIZE];
+    // Program storage, taken from the page allocator and grown as the
+    // program is assembled. program[program_size] is the end marker
+    mpop_instruction_t* program;
     uint32_t program_size;
+    uint32_t program_capacity;
+    mpop_slow_instruction_t* slow;
+    uint32_t slow_count;
+    uint32_t slow_capacity;
+    bool threaded;                          // program[].handler is filled in
     
     // Labels
     mpop_label_t labels[MPOP_MAX_LABELS];
     uint32_t label_count;
+    uint8_t label_hash[MPOP_LABEL_HASH_SIZE]; // labels[] index + 1, 0 is empty
     
     // Execution state
     bool running;
     bool debug_mode;
+    
+    // Peephole pass, run by every load while optimize is set
+    bool optimize;
+    uint32_t fused_count;                   // Superinstructions written
+    uint32_t dispatch_count;                // Dispatches of a straight pass after fusing
+    uint32_t dead_flag_count;               // Flag results found to be overwritten unread
+    
+    // Where mpop_load_program stopped, 1-based, 0 after a clean load
+    uint32_t error_line;
+    uint32_t error_column;
+    
+    // Native code built by mpop_jit_compile, dropped by every load
+    uint8_t* jit_code;
+    uint32_t jit_pages;
+    uint32_t* jit_map;                      // Native address of each instruction
+    uint32_t jit_map_pages;
+    mpop_jit_frame_t jit_frame;
+    bool jit_ready;
+    bool jit_enabled;                       // mpop_run goes through the JIT
+    bool quiet;                             // Drop PRINT output, for benchmarks
+    
+    // Counters of the last profiled run, one entry per instruction
+    bool profiling;                         // mpop_run fills profile[]
+    mpop_profile_entry_t* profile;
+    uint32_t profile_capacity;
+    uint32_t profile_size;                  // Entries filled by the last run
+    uint32_t profile_overhead;              // Cycles of an empty TSC read pair
+    
+    // Instance bookkeeping, see mpop_init and mpop_start
+    bool in_use;
+    bool release_on_exit;                   // Return to the pool when the task ends
+    bool background;                        // No keyboard, INPUT fails
+    bool ctrl_held;                         // Ctrl state seen by the Ctrl+C check
+    volatile bool task_active;              // A task is running the program
+    volatile bool cancel;                   // Stop before the next slice
+    int task_id;
+    int status;                             // Result of the last run
+    wait_queue_t done;                      // Woken when the task ends
 } mpop_cpu_t;
 
 // Error codes
@@ -135,19 +244,25 @@ typedef enum {
     MPOP_ERROR_DIVISION_BY_ZERO = -6,
     MPOP_ERROR_LABEL_NOT_FOUND = -7,
     MPOP_ERROR_PROGRAM_TOO_LARGE = -8,
-    MPOP_ERROR_PARSE_ERROR = -9
+    MPOP_ERROR_PARSE_ERROR = -9,
+    MPOP_ERROR_DUPLICATE_LABEL = -10,
+    MPOP_ERROR_CANCELLED = -11,
+    MPOP_ERROR_NO_INPUT = -12,
+    MPOP_ERROR_BUSY = -13,
+    MPOP_ERROR_NO_TASK = -14
 } mpop_error_t;
 
 // Function prototypes
 
 /**
- * Initialize MPOP CPU
- * @return Pointer to initialized CPU state
+ * Take a cleared CPU from the instance pool
+ * @return Pointer to initialized CPU state, NULL when all MPOP_MAX_INSTANCES are taken
  */
 mpop_cpu_t* mpop_init(void);
 
 /**
- * Clean up MPOP CPU
+ * Give a CPU back to the pool. One still running in the background goes
+ * back when its task ends
  * @param cpu Pointer to CPU state
  */
 void mpop_cleanup(mpop_cpu_t* cpu);
@@ -159,13 +274,35 @@ void mpop_cleanup(mpop_cpu_t* cpu);
 void mpop_reset(mpop_cpu_t* cpu);
 
 /**
- * Load program from assembly text
+ * Assemble a program in one pass. Mnemonics are case-insensitive, ALU
+ * instructions take an optional third operand (ADD Rd, Ra, Rb|imm) and ';'
+ * starts a comment anywhere on a line. On failure cpu->error_line and
+ * cpu->error_column point at the offending token. With cpu->optimize set
+ * the program then goes through the peephole pass.
  * @param cpu Pointer to CPU state
  * @param assembly Assembly code string
  * @return Error code
  */
 int mpop_load_program(mpop_cpu_t* cpu, const char* assembly);
 
+/**
+ * Operation a superinstruction starts with, so code that works on single
+ * instructions can read program[i] as if nothing was fused
+ * @param op Lowered operation
+ * @return The first covered operation, op itself for any other
+ */
+uint8_t mpop_base_op(uint8_t op);
+
+/**
+ * Whether the flags set by program[index] are always overwritten before
+ * anything reads them. Only straight-line code and JMP are followed, anything
+ * else counts as a read
+ * @param cpu Pointer to CPU state
+ * @param index Instruction that sets the flags
+ * @return true when its flags can be left unset
+ */
+bool mpop_flags_dead(mpop_cpu_t* cpu, uint32_t index);
+
 /**
  * Execute single instruction
  * @param cpu Pointer to CPU state
@@ -174,12 +311,37 @@ int mpop_load_program(mpop_cpu_t* cpu, const char* assembly);
 int mpop_step(mpop_cpu_t* cpu);
 
 /**
- * Execute program until halt or error
+ * Execute program until halt or error. It runs as its own task in slices of
+ * MPOP_SLICE_INSTRUCTIONS while the caller sleeps, and Ctrl+C cancels it
+ * With cpu->profiling set every instruction is timed in the interpreter,
+ * even when the JIT is enabled
  * @param cpu Pointer to CPU state
- * @return Error code
+ * @return Error code, MPOP_ERROR_CANCELLED after Ctrl+C
  */
 int mpop_run(mpop_cpu_t* cpu);
 
+/**
+ * Start the program from the top in a background task and return at once.
+ * A line is printed when it ends
+ * @param cpu Pointer to CPU state
+ * @return Error code, MPOP_ERROR_BUSY when a task already runs it,
+ *         MPOP_ERROR_NO_TASK when no task could be created
+ */
+int mpop_start(mpop_cpu_t* cpu);
+
+/**
+ * Ask the task running a program to stop before its next slice
+ * @param cpu Pointer to CPU state
+ */
+void mpop_cancel(mpop_cpu_t* cpu);
+
+/**
+ * Print where the last profiled run spent its time: the hottest
+ * instructions, then the time per label, both sorted by cycles
+ * @param cpu Pointer to CPU state
+ */
+void mpop_profile_report(mpop_cpu_t* cpu);
+
 /**
  * Set debug mode
  * @param cpu Pointer to CPU state
@@ -200,6 +362,13 @@ void mpop_debug_print(mpop_cpu_t* cpu);
  */
 const char* mpop_get_error_string(int error);
 
+/**
+ * Print why mpop_load_program failed, with the source position when known
+ * @param cpu CPU the load was attempted on
+ * @param error Error code returned by the load
+ */
+void mpop_print_load_error(mpop_cpu_t* cpu, int error);
+
 /**
  * Parse operand from string
  * @param str Operand string
@@ -217,7 +386,7 @@ int mpop_parse_operand(const char* str, mpop_operand_t* operand);
 int mpop_resolve_label(mpop_cpu_t* cpu, const char* label_name);
 
 /**
- * Add label to CPU
+ * Add label to CPU, names are unique
  * @param cpu Pointer to CPU state
  * @param name Label name
  * @param address Label address
@@ -225,6 +394,29 @@ int mpop_resolve_label(mpop_cpu_t* cpu, const char* label_name);
  */
 int mpop_add_label(mpop_cpu_t* cpu, const char* name, uint32_t address);
 
+/**
+ * Print the loaded program with label names
+ * @param cpu Pointer to CPU state
+ */
+void mpop_disassemble(mpop_cpu_t* cpu);
+
+/**
+ * Translate the loaded program into i386 code. Done by mpop_jit_run when
+ * needed, the code stays valid until the next load
+ * @param cpu Pointer to CPU state
+ * @return Error code
+ */
+int mpop_jit_compile(mpop_cpu_t* cpu);
+
+/**
+ * Run the loaded program as native code from cpu->pc. PRINT, INPUT and the
+ * other instructions without a template exit to the interpreter for one step
+ * @param cpu Pointer to CPU state
+ * @param budget Taken backward branches and returns before giving up, 0 for no limit
+ * @return Error code, cpu->running stays set when the budget ran out
+ */
+int mpop_jit_run(mpop_cpu_t* cpu, uint32_t budget);
+
 /**
  * MPOP command interface
  * @param argc Number of arguments
@@ -236,6 +428,7 @@ void mpop_command(int argc, char* argv[]);
 extern const char* MPOP_HELLO_WORLD;
 extern const char* MPOP_FIBONACCI;
 extern const char* MPOP_FACTORIAL;
+extern const char* MPOP_PRIMES;
 extern const char* MPOP_BUBBLE_SORT;
 
 // Utility macros
@@ -0,0 +1,512 @@
+#include "mpop.h"
+#include "../memory/memory.h"
+#include "../utility/utility.h"
+#include "../utility/jit_emit.h"
+
+// Template JIT for MPOP. Each lowered instruction becomes a fixed i386
+// sequence with R0-R15 left in cpu->registers:
+//   esi  cpu->registers        ebx  cpu->stack
+//   edi  MPOP stack pointer    ebp  branch budget
+//   eax, ecx, edx scratch
+// Flags stay in EFLAGS. Only ZF and SF carry meaning, so JL tests the sign
+// like the interpreter does, and every check the templates add in between
+// (stack bounds, budget) is done with lea/jecxz to leave them alone.
+
+#define MPOP_JIT_MAX_BYTES  96      // Longest template, RET is about 80
+#define MPOP_JIT_HEADER     128     // Entry and common exit
+#define MPOP_JIT_EXIT_SIZE  20      // One exit stub
+
+#define EFLAGS_ZF 0x40
+#define EFLAGS_SF 0x80
+
+// Why the native code returned to mpop_jit_run
+enum {
+    MPOP_JIT_EXIT_HALT = 1,     // HALT or the end of the program
+    MPOP_JIT_EXIT_FALLBACK,     // Interpret the instruction at frame.pc
+    MPOP_JIT_EXIT_BUDGET,       // Out of branches, resume at frame.pc
+};
+
+// i386 register numbers
+enum { JIT_EAX, JIT_ECX, JIT_EDX };
+
+typedef struct {
+    jit_emit_t emit;
+    mpop_cpu_t* cpu;
+    uint32_t exit;              // Offset of the common exit
+} mpop_jit_t;
+
+// opcode reg, [esi + 4 * mpop_reg]
+static void jit_reg(mpop_jit_t* jit, uint8_t opcode, uint8_t native, uint8_t mpop_reg) {
+    jit_byte(&jit->emit, opcode);
+    jit_byte(&jit->emit, 0x46 | (native << 3));
+    jit_byte(&jit->emit, mpop_reg * 4);
+}
+
+// Jump with a rel32 to instruction target, patched once every address is known
+static void jit_branch(mpop_jit_t* jit, uint32_t index, const uint8_t* opcode, int length, uint32_t target) {
+    for (int i = 0; i < length; i++) {
+        jit_byte(&jit->emit, opcode[i]);
+    }
+    jit_fixup(&jit->emit, index, target);
+}
+
+// Leave the native code with frame.pc = pc
+static void jit_exit(mpop_jit_t* jit, uint32_t pc, uint32_t reason) {
+    jit_byte(&jit->emit, 0xC7);                             // mov [frame.pc], pc
+    jit_byte(&jit->emit, 0x05);
+    jit_word(&jit->emit, (uint32_t) &jit->cpu->jit_frame.pc);
+    jit_word(&jit->emit, pc);
+    jit_byte(&jit->emit, 0xB8);                             // mov eax, reason
+    jit_word(&jit->emit, reason);
+    jit_byte(&jit->emit, 0xE9);                             // jmp exit
+    jit_rel32(&jit->emit, jit->exit);
+}
+
+// Exit with frame.pc = eax
+static void jit_exit_eax(mpop_jit_t* jit, uint32_t reason) {
+    jit_byte(&jit->emit, 0xA3);                             // mov [frame.pc], eax
+    jit_word(&jit->emit, (uint32_t) &jit->cpu->jit_frame.pc);
+    jit_byte(&jit->emit, 0xB8);
+    jit_word(&jit->emit, reason);
+    jit_byte(&jit->emit, 0xE9);
+    jit_rel32(&jit->emit, jit->exit);
+}
+
+// Exit to the interpreter when ecx is zero, which then reports the error
+static void jit_fail_if_ecx_zero(mpop_jit_t* jit, uint32_t pc) {
+    jit_byte(&jit->emit, 0xE3);                             // jecxz fail
+    jit_byte(&jit->emit, 0x02);
+    jit_byte(&jit->emit, 0xEB);                             // jmp over
+    jit_byte(&jit->emit, MPOP_JIT_EXIT_SIZE);
+    jit_exit(jit, pc, MPOP_JIT_EXIT_FALLBACK);
+}
+
+static void jit_check_push(mpop_jit_t* jit, uint32_t pc) {
+    jit_byte(&jit->emit, 0x8D);                             // lea ecx, [edi - MPOP_STACK_SIZE]
+    jit_byte(&jit->emit, 0x8F);
+    jit_word(&jit->emit, (uint32_t) -MPOP_STACK_SIZE);
+    jit_fail_if_ecx_zero(jit, pc);
+}
+
+static void jit_check_pop(mpop_jit_t* jit, uint32_t pc) {
+    jit_byte(&jit->emit, 0x89);                             // mov ecx, edi
+    jit_byte(&jit->emit, 0xF9);
+    jit_fail_if_ecx_zero(jit, pc);
+}
+
+// Count one branch against the budget, leaving to resume at target when it
+// runs out
+static void jit_spend(mpop_jit_t* jit) {
+    jit_byte(&jit->emit, 0x8D);                             // lea ebp, [ebp - 1]
+    jit_byte(&jit->emit, 0x6D);
+    jit_byte(&jit->emit, 0xFF);
+    jit_byte(&jit->emit, 0x89);                             // mov ecx, ebp
+    jit_byte(&jit->emit, 0xE9);
+}
+
+// Taken path of a branch from index to target. Backward ones pay the budget
+static void jit_taken(mpop_jit_t* jit, uint32_t index, uint32_t target) {
+    static const uint8_t jmp[] = { 0xE9 };
+
+    if (target > index) {
+        jit_branch(jit, index, jmp, 1, target);
+        return;
+    }
+
+    jit_spend(jit);
+    jit_byte(&jit->emit, 0xE3);                             // jecxz out
+    jit_byte(&jit->emit, 0x05);
+    jit_branch(jit, index, jmp, 1, target);
+    jit_exit(jit, target, MPOP_JIT_EXIT_BUDGET);
+}
+
+// ALU instructions whose i386 form sets ZF and SF from the result, as the
+// opcode of the register and of the immediate form
+static bool jit_alu(uint8_t op, uint8_t* rm, uint8_t* imm) {
+    switch (op) {
+        case VOP_ADD_RR: case VOP_ADD_RI: *rm = 0x03; *imm = 0x05; return true;
+        case VOP_SUB_RR: case VOP_SUB_RI: *rm = 0x2B; *imm = 0x2D; return true;
+        case VOP_AND_RR: case VOP_AND_RI: *rm = 0x23; *imm = 0x25; return true;
+        case VOP_OR_RR:  case VOP_OR_RI:  *rm = 0x0B; *imm = 0x0D; return true;
+        case VOP_XOR_RR: case VOP_XOR_RI: *rm = 0x33; *imm = 0x35; return true;
+        case VOP_CMP_RR: case VOP_CMP_RI: *rm = 0x3B; *imm = 0x3D; return true;
+        default: return false;
+    }
+}
+
+// Load ZF and SF from a result register, unless the peephole pass found
+// that nothing reads them
+static void jit_test(mpop_jit_t* jit, uint32_t index, uint8_t native) {
+    if (mpop_flags_dead(jit->cpu, index)) {
+        return;
+    }
+    jit_byte(&jit->emit, 0x85);                             // test reg, reg
+    jit_byte(&jit->emit, 0xC0 | (native << 3) | native);
+}
+
+// Superinstructions are compiled as their parts, each covered instruction
+// gets its own template when the loop reaches it
+static void jit_instruction(mpop_jit_t* jit, uint32_t index) {
+    mpop_instruction_t* instr = &jit->cpu->program[index];
+    uint32_t size = jit->cpu->program_size;
+    uint8_t op = mpop_base_op(instr->op);
+    uint8_t rm, imm;
+
+    if (jit_alu(op, &rm, &imm)) {
+        // Register forms are the even ones, see the VOP list
+        jit_reg(jit, 0x8B, JIT_EAX, instr->b);              // mov eax, Rb
+        if ((op - VOP_ADD_RR) % 2 == 0) {
+            jit_reg(jit, rm, JIT_EAX, instr->c);            // op eax, Rc
+        } else {
+            jit_byte(&jit->emit, imm);                      // op eax, imm
+            jit_word(&jit->emit, instr->imm);
+        }
+        if (op != VOP_CMP_RR && op != VOP_CMP_RI) {
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);          // mov Ra, eax
+        }
+        return;
+    }
+
+    switch (op) {
+        case VOP_END:
+            jit_exit(jit, size, MPOP_JIT_EXIT_HALT);
+            break;
+
+        case VOP_HALT:
+            jit_exit(jit, index, MPOP_JIT_EXIT_HALT);
+            break;
+
+        case VOP_NOP:
+            break;
+
+        case VOP_MOV_RR:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            break;
+
+        case VOP_MOV_RI:
+            jit_reg(jit, 0xC7, 0, instr->a);                // mov dword Ra, imm
+            jit_word(&jit->emit, instr->imm);
+            break;
+
+        case VOP_MUL_RR:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_byte(&jit->emit, 0x0F);                     // imul eax, Rc
+            jit_reg(jit, 0xAF, JIT_EAX, instr->c);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            jit_test(jit, index, JIT_EAX);
+            break;
+
+        case VOP_MUL_RI:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_byte(&jit->emit, 0x69);                     // imul eax, eax, imm
+            jit_byte(&jit->emit, 0xC0);
+            jit_word(&jit->emit, instr->imm);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            jit_test(jit, index, JIT_EAX);
+            break;
+
+        case VOP_DIV_RR:
+        case VOP_DIV_RI:
+        case VOP_MOD_RR:
+        case VOP_MOD_RI: {
+            if (op == VOP_DIV_RR || op == VOP_MOD_RR) {
+                jit_reg(jit, 0x8B, JIT_ECX, instr->c);      // mov ecx, Rc
+            } else {
+                jit_byte(&jit->emit, 0xB9);                 // mov ecx, imm
+                jit_word(&jit->emit, instr->imm);
+            }
+            jit_fail_if_ecx_zero(jit, index);
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_byte(&jit->emit, 0x99);                     // cdq
+            jit_byte(&jit->emit, 0xF7);                     // idiv ecx
+            jit_byte(&jit->emit, 0xF9);
+
+            uint8_t result = (op == VOP_DIV_RR || op == VOP_DIV_RI) ? JIT_EAX : JIT_EDX;
+            jit_reg(jit, 0x89, result, instr->a);
+            jit_test(jit, index, result);
+            break;
+        }
+
+        case VOP_SHL_RR:
+        case VOP_SHR_RR:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_reg(jit, 0x8B, JIT_ECX, instr->c);
+            jit_byte(&jit->emit, 0xD3);                     // shl/sar eax, cl
+            jit_byte(&jit->emit, op == VOP_SHL_RR ? 0xE0 : 0xF8);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            jit_test(jit, index, JIT_EAX);
+            break;
+
+        case VOP_SHL_RI:
+        case VOP_SHR_RI:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->b);
+            jit_byte(&jit->emit, 0xC1);                     // shl/sar eax, imm
+            jit_byte(&jit->emit, op == VOP_SHL_RI ? 0xE0 : 0xF8);
+            jit_byte(&jit->emit, instr->imm & 31);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            jit_test(jit, index, JIT_EAX);
+            break;
+
+        case VOP_INC:
+            jit_reg(jit, 0xFF, 0, instr->a);                // inc dword Ra
+            break;
+
+        case VOP_DEC:
+            jit_reg(jit, 0xFF, 1, instr->a);                // dec dword Ra
+            break;
+
+        case VOP_NOT:
+            jit_reg(jit, 0x8B, JIT_EAX, instr->a);
+            jit_byte(&jit->emit, 0xF7);                     // not eax
+            jit_byte(&jit->emit, 0xD0);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            jit_test(jit, index, JIT_EAX);
+            break;
+
+        case VOP_JMP:
+            jit_taken(jit, index, instr->imm);
+            break;
+
+        case VOP_JZ:
+        case VOP_JNZ:
+        case VOP_JL:
+        case VOP_JG:
+        case VOP_JLE:
+        case VOP_JGE: {
+            uint32_t target = instr->imm;
+
+            // Forward branches on one flag jump straight to the target
+            static const uint8_t jcc[] = { 0x84, 0x85, 0x88, 0, 0, 0x89 };   // jz jnz js - - jns
+            uint8_t direct = jcc[op - VOP_JZ];
+            if (target > index && direct) {
+                uint8_t branch[] = { 0x0F, direct };
+                jit_branch(jit, index, branch, 2, target);
+                break;
+            }
+
+            // Otherwise skip the taken path when the condition fails
+            uint32_t skip[2];
+            int skips = 1;
+            switch (op) {
+                case VOP_JZ:  skip[0] = jit_short(&jit->emit, 0x75); break; // jnz
+                case VOP_JNZ: skip[0] = jit_short(&jit->emit, 0x74); break; // jz
+                case VOP_JL:  skip[0] = jit_short(&jit->emit, 0x79); break; // jns
+                case VOP_JGE: skip[0] = jit_short(&jit->emit, 0x78); break; // js
+                case VOP_JG:
+                    skip[0] = jit_short(&jit->emit, 0x74);                 // jz
+                    skip[1] = jit_short(&jit->emit, 0x78);                 // js
+                    skips = 2;
+                    break;
+                default:
+                    jit_byte(&jit->emit, 0x74);                            // jz taken
+                    jit_byte(&jit->emit, 0x02);
+                    skip[0] = jit_short(&jit->emit, 0x79);                 // jns
+                    break;
+            }
+            jit_taken(jit, index, target);
+            for (int i = 0; i < skips; i++) {
+                jit_land(&jit->emit, skip[i]);
+            }
+            break;
+        }
+
+        case VOP_CALL:
+            jit_check_push(jit, index);
+            jit_byte(&jit->emit, 0xC7);                     // mov [ebx + edi * 4], return
+            jit_byte(&jit->emit, 0x04);
+            jit_byte(&jit->emit, 0xBB);
+            jit_word(&jit->emit, index + 1);
+            jit_byte(&jit->emit, 0x8D);                     // lea edi, [edi + 1]
+            jit_byte(&jit->emit, 0x7F);
+            jit_byte(&jit->emit, 0x01);
+            jit_taken(jit, index, instr->imm);
+            break;
+
+        case VOP_RET:
+            jit_check_pop(jit, index);
+            jit_byte(&jit->emit, 0x8D);                     // lea edi, [edi - 1]
+            jit_byte(&jit->emit, 0x7F);
+            jit_byte(&jit->emit, 0xFF);
+            jit_byte(&jit->emit, 0x8B);                     // mov eax, [ebx + edi * 4]
+            jit_byte(&jit->emit, 0x04);
+            jit_byte(&jit->emit, 0xBB);
+
+            // Clamp like the interpreter, keeping the caller's flags
+            jit_byte(&jit->emit, 0x9C);                     // pushfd
+            jit_byte(&jit->emit, 0x3D);                     // cmp eax, size
+            jit_word(&jit->emit, size);
+            jit_byte(&jit->emit, 0x76);                     // jbe in_range
+            jit_byte(&jit->emit, 0x05);
+            jit_byte(&jit->emit, 0xB8);                     // mov eax, size
+            jit_word(&jit->emit, size);
+            jit_byte(&jit->emit, 0x9D);                     // popfd
+
+            jit_spend(jit);
+            jit_byte(&jit->emit, 0xE3);                     // jecxz out
+            jit_byte(&jit->emit, 0x07);
+            jit_byte(&jit->emit, 0xFF);                     // jmp [map + eax * 4]
+            jit_byte(&jit->emit, 0x24);
+            jit_byte(&jit->emit, 0x85);
+            jit_word(&jit->emit, (uint32_t) jit->cpu->jit_map);
+            jit_exit_eax(jit, MPOP_JIT_EXIT_BUDGET);
+            break;
+
+        case VOP_PUSH_R:
+        case VOP_PUSH_I:
+            jit_check_push(jit, index);
+            if (op == VOP_PUSH_R) {
+                jit_reg(jit, 0x8B, JIT_EAX, instr->a);
+                jit_byte(&jit->emit, 0x89);                 // mov [ebx + edi * 4], eax
+                jit_byte(&jit->emit, 0x04);
+                jit_byte(&jit->emit, 0xBB);
+            } else {
+                jit_byte(&jit->emit, 0xC7);                 // mov dword [ebx + edi * 4], imm
+                jit_byte(&jit->emit, 0x04);
+                jit_byte(&jit->emit, 0xBB);
+                jit_word(&jit->emit, instr->imm);
+            }
+            jit_byte(&jit->emit, 0x8D);                     // lea edi, [edi + 1]
+            jit_byte(&jit->emit, 0x7F);
+            jit_byte(&jit->emit, 0x01);
+            break;
+
+        case VOP_POP:
+            jit_check_pop(jit, index);
+            jit_byte(&jit->emit, 0x8D);                     // lea edi, [edi - 1]
+            jit_byte(&jit->emit, 0x7F);
+            jit_byte(&jit->emit, 0xFF);
+            jit_byte(&jit->emit, 0x8B);                     // mov eax, [ebx + edi * 4]
+            jit_byte(&jit->emit, 0x04);
+            jit_byte(&jit->emit, 0xBB);
+            jit_reg(jit, 0x89, JIT_EAX, instr->a);
+            break;
+
+        default:
+            // PRINT, PRINTC and everything left to mpop_step_slow
+            jit_exit(jit, index, MPOP_JIT_EXIT_FALLBACK);
+            break;
+    }
+}
+
+// Entry at offset 0, called as int (*)(void). Everything else comes from
+// the frame
+static void jit_prologue(mpop_jit_t* jit) {
+    mpop_cpu_t* cpu = jit->cpu;
+    mpop_jit_frame_t* frame = &cpu->jit_frame;
+
+    jit_byte(&jit->emit, 0x55);                             // push ebp
+    jit_byte(&jit->emit, 0x53);                             // push ebx
+    jit_byte(&jit->emit, 0x56);                             // push esi
+    jit_byte(&jit->emit, 0x57);                             // push edi
+    jit_byte(&jit->emit, 0xBE);                             // mov esi, registers
+    jit_word(&jit->emit, (uint32_t) cpu->registers);
+    jit_byte(&jit->emit, 0xBB);                             // mov ebx, stack
+    jit_word(&jit->emit, (uint32_t) cpu->stack);
+    jit_byte(&jit->emit, 0x8B);                             // mov edi, [frame.sp]
+    jit_byte(&jit->emit, 0x3D);
+    jit_word(&jit->emit, (uint32_t) &frame->sp);
+    jit_byte(&jit->emit, 0x8B);                             // mov ebp, [frame.budget]
+    jit_byte(&jit->emit, 0x2D);
+    jit_word(&jit->emit, (uint32_t) &frame->budget);
+    jit_byte(&jit->emit, 0xA1);                             // mov eax, [frame.flags]
+    jit_word(&jit->emit, (uint32_t) &frame->flags);
+    jit_byte(&jit->emit, 0x85);                             // test eax, eax
+    jit_byte(&jit->emit, 0xC0);
+    jit_byte(&jit->emit, 0xFF);                             // jmp [frame.entry]
+    jit_byte(&jit->emit, 0x25);
+    jit_word(&jit->emit, (uint32_t) &frame->entry);
+
+    // Common exit, eax holds the reason
+    jit->exit = jit->emit.pos;
+    jit_byte(&jit->emit, 0x9C);                             // pushfd
+    jit_byte(&jit->emit, 0x5A);                             // pop edx
+    jit_byte(&jit->emit, 0x89);                             // mov [frame.eflags], edx
+    jit_byte(&jit->emit, 0x15);
+    jit_word(&jit->emit, (uint32_t) &frame->eflags);
+    jit_byte(&jit->emit, 0x89);                             // mov [frame.sp], edi
+    jit_byte(&jit->emit, 0x3D);
+    jit_word(&jit->emit, (uint32_t) &frame->sp);
+    jit_byte(&jit->emit, 0x89);                             // mov [frame.budget], ebp
+    jit_byte(&jit->emit, 0x2D);
+    jit_word(&jit->emit, (uint32_t) &frame->budget);
+    jit_byte(&jit->emit, 0x5F);                             // pop edi
+    jit_byte(&jit->emit, 0x5E);                             // pop esi
+    jit_byte(&jit->emit, 0x5B);                             // pop ebx
+    jit_byte(&jit->emit, 0x5D);                             // pop ebp
+    jit_byte(&jit->emit, 0xC3);                             // ret
+}
+
+int mpop_jit_compile(mpop_cpu_t* cpu) {
+    if (!cpu || cpu->program_size == 0) return MPOP_ERROR_PARSE_ERROR;
+
+    // One template more for the end marker
+    uint32_t size = cpu->program_size;
+    mpop_jit_t jit;
+    jit.cpu = cpu;
+
+    cpu->jit_ready = false;
+    if (!jit_prepare(&jit.emit, &cpu->jit_code, &cpu->jit_pages, &cpu->jit_map, &cpu->jit_map_pages,
+                     size + 1, MPOP_JIT_HEADER, MPOP_JIT_MAX_BYTES)) {
+        return MPOP_ERROR_PROGRAM_TOO_LARGE;
+    }
+
+    jit_prologue(&jit);
+
+    for (uint32_t i = 0; i <= size; i++) {
+        jit_mark(&jit.emit, i);
+        jit_instruction(&jit, i);
+    }
+
+    // Branch targets are all placed now
+    jit_patch(&jit.emit, size);
+
+    cpu->jit_ready = true;
+    return MPOP_SUCCESS;
+}
+
+int mpop_jit_run(mpop_cpu_t* cpu, uint32_t budget) {
+    if (!cpu) return MPOP_ERROR_PARSE_ERROR;
+    if (cpu->program_size == 0) {
+        cpu->running = false;
+        return MPOP_SUCCESS;
+    }
+
+    if (!cpu->jit_ready) {
+        int result = mpop_jit_compile(cpu);
+        if (result != MPOP_SUCCESS) return result;
+    }
+
+    int (*native)(void) = (int (*)(void)) cpu->jit_code;
+    mpop_jit_frame_t* frame = &cpu->jit_frame;
+    frame->budget = budget;
+
+    while (true) {
+        uint32_t pc = cpu->pc < cpu->program_size ? cpu->pc : cpu->program_size;
+        frame->entry = cpu->jit_map[pc];
+        frame->sp = cpu->sp;
+        frame->flags = cpu->zero_flag ? 0 : (cpu->negative_flag ? -1 : 1);
+
+        int reason = native();
+
+        cpu->pc = frame->pc;
+        cpu->sp = frame->sp;
+        cpu->zero_flag = (frame->eflags & EFLAGS_ZF) != 0;
+        cpu->negative_flag = (frame->eflags & EFLAGS_SF) != 0;
+        cpu->carry_flag = false;
+
+        if (reason == MPOP_JIT_EXIT_HALT) {
+            cpu->running = false;
+            return MPOP_SUCCESS;
+        }
+        if (reason == MPOP_JIT_EXIT_BUDGET) {
+            return MPOP_SUCCESS;
+        }
+
+        // One instruction the templates do not cover, or one about to fail
+        int result = mpop_step(cpu);
+        if (result != MPOP_SUCCESS || !cpu->running) {
+            return result;
+        }
+    }
+}
@@ -2,7 +2,11 @@
 #include "../keyboard/keyboard.h"
 #include "../timers/timer.h"
 #include "../io/io.h"
+#include "../scheduler/task.h"
+#include "../timers/timer_wheel.h"
 #include "../utility/utility.h"
+#include "../scheduler/workqueue.h"
+#include "../arp/arp.h"
 #include "rtl8139.h"
 
 struct rtl8139* RTL8139 = NULL;
@@ -51,6 +55,9 @@ typedef struct {
 // Global transmit descriptor index
 static uint8_t tx_descriptor = 0;
 
+// Set once the IRQ and the events worker take over receiving
+static bool rtl8139_rx_deferred = false;
+
 // Allocate transmit buffers (4 buffers of 2KB each)
 static uint8_t* tx_buffers[4] = {NULL, NULL, NULL, NULL};
 
@@ -159,6 +166,16 @@ void read_mac_address() {
 }
 
 // Initialize RTL8139 NIC (safe version with hardware checks)
+// Set from the timer wheel when the chip does not leave reset in time
+#define RTL8139_RESET_TIMEOUT_MS 100
+
+static volatile bool rtl8139_reset_timed_out;
+
+static void rtl8139_reset_timeout(uint32_t data) {
+    (void)data;
+    rtl8139_reset_timed_out = true;
+}
+
 bool rtl8139_init() {
     info("Starting RTL8139 initialization...", __FILE__);
     
@@ -192,16 +209,18 @@ bool rtl8139_init() {
     info("Performing software reset...", __FILE__);
     outb(RTL8139->io_base + RTL8139_REG_COMMAND, RTL8139_CMD_RESET);
     
-    // Wait for reset to complete (with timeout to prevent hanging)
-    uint32_t reset_timeout = 1000;
-    while ((inb(RTL8139->io_base + RTL8139_REG_COMMAND) & RTL8139_CMD_RESET) && reset_timeout > 0) {
-        reset_timeout--;
-        if (reset_timeout % 100 == 0) {
-            print("Waiting for reset...\n");
-        }
+    // Wait for reset to complete, bounded by a real-time timer rather than a loop count
+    timer_list_t reset_timer;
+    setup_timer(&reset_timer, rtl8139_reset_timeout, 0);
+    rtl8139_reset_timed_out = false;
+    mod_timer(&reset_timer, ticks + RTL8139_RESET_TIMEOUT_MS);
+    
+    while ((inb(RTL8139->io_base + RTL8139_REG_COMMAND) & RTL8139_CMD_RESET) && !rtl8139_reset_timed_out) {
+        asm volatile("pause");
     }
+    del_timer(&reset_timer);
     
-    if (reset_timeout == 0) {
+    if (rtl8139_reset_timed_out) {
         warn("RTL8139 reset timeout", __FILE__);
         return false;
     }
@@ -243,6 +262,12 @@ bool rtl8139_init() {
     
     // Step 6: Set IMR (Interrupt Mask Register) - enable interrupts
     info("Setting up interrupts...", __FILE__);
+    if (RTL8139->irq < 16) {
+        register_irq_handler(RTL8139->irq, rtl8139_irq_handler);
+        
+        // Without a worker thread readers keep polling the ring themselves
+        rtl8139_rx_deferred = workqueue_ready();
+    }
     outw(RTL8139->io_base + RTL8139_REG_IMR, 
          RTL8139_INT_ROK |      // Receive OK
          RTL8139_INT_TOK |      // Transmit OK
@@ -508,16 +533,142 @@ bool rtl8139_send_packet(const int8* data, int16 length) {
     uint32_t tsd_value = actual_length & RTL8139_TSD_SIZE_MASK;
     outl(RTL8139->io_base + tsd_reg, tsd_value);
     
-    info("Packet transmitted via hardware", __FILE__);
-    
     // Move to next descriptor
     tx_descriptor = (tx_descriptor + 1) % 4;
     
     return true;
 }
 
-// Receive a packet
+// Acknowledge pending interrupt causes, returns the status that was cleared
+// ----- Receive bottom half -----
+
+// The IRQ only acks the card; frames are pulled off the ring by a work item,
+// ARP is answered there and everything else waits here for a reader
+#define RTL8139_RX_QUEUE_LEN  32     // Above the 16 echoes ping -f keeps in flight
+#define RTL8139_MAX_FRAME     1518
+#define RTL8139_ETHERTYPE_ARP 0x0806
+
+typedef struct {
+    int16 length;
+    int8 data[RTL8139_MAX_FRAME];
+} rx_frame_t;
+
+static rx_frame_t rx_queue[RTL8139_RX_QUEUE_LEN];
+static volatile uint32_t rx_queue_head = 0;   // Next slot to read
+static volatile uint32_t rx_queue_tail = 0;   // Next slot to fill
+static uint32_t rx_queue_dropped = 0;
+static spinlock_t rx_queue_lock = SPINLOCK_INIT;  // Worker and reader may be on different CPUs
+
+static bool rtl8139_read_ring(int8* buffer, int16* length);
+
+static void rtl8139_rx_work(work_t* work) {
+    static rx_frame_t frame;
+    (void)work;
+    
+    while (rtl8139_read_ring(frame.data, &frame.length)) {
+        uint16_t ethertype = (uint16_t)((frame.data[12] << 8) | frame.data[13]);
+        if (ethertype == RTL8139_ETHERTYPE_ARP) {
+            arp_handle_packet(frame.data + 14, (uint16_t)(frame.length - 14));
+            continue;
+        }
+        
+        uint32_t flags = spin_lock_irqsave(&rx_queue_lock);
+        if (rx_queue_tail - rx_queue_head >= RTL8139_RX_QUEUE_LEN) {
+            // Nobody is reading, keep the older frames
+            rx_queue_dropped++;
+        } else {
+            rx_frame_t* slot = &rx_queue[rx_queue_tail % RTL8139_RX_QUEUE_LEN];
+            slot->length = frame.length;
+            memcpy(slot->data, frame.data, frame.length);
+            rx_queue_tail++;
+        }
+        spin_unlock_irqrestore(&rx_queue_lock, flags);
+    }
+}
+
+static work_t rtl8139_rx_work_item = WORK_INITIALIZER(rtl8139_rx_work);
+
+uint16_t rtl8139_handle_interrupt() {
+    if (!RTL8139 || RTL8139->io_base == 0) {
+        return 0;
+    }
+    
+    uint16_t status = inw(RTL8139->io_base + RTL8139_REG_ISR);
+    if (status) {
+        // ISR bits are write-one-to-clear, the line stays asserted until then
+        outw(RTL8139->io_base + RTL8139_REG_ISR, status);
+    }
+    
+    return status;
+}
+
+void rtl8139_irq_handler() {
+    uint16_t status = rtl8139_handle_interrupt();
+    
+    if (rtl8139_rx_deferred && (status & (RTL8139_INT_ROK | RTL8139_INT_RXOVW))) {
+        schedule_work(&rtl8139_rx_work_item);
+    }
+}
+
+// Frames the receive queue has turned away since boot
+uint32_t rtl8139_rx_dropped() {
+    return rx_queue_dropped;
+}
+
+// True when at least one received frame is waiting to be read
+bool rtl8139_rx_pending() {
+    if (rtl8139_rx_deferred) {
+        return rx_queue_tail != rx_queue_head;
+    }
+    if (!RTL8139 || RTL8139->io_base == 0) {
+        return false;
+    }
+    return (inb(RTL8139->io_base + RTL8139_REG_COMMAND) & RTL8139_CMD_BUFFER_EMPTY) == 0;
+}
+
+// Check whether the next transmit descriptor can take a packet without waiting
+bool rtl8139_tx_ready() {
+    if (!RTL8139 || !RTL8139->initialized) {
+        return false;
+    }
+    
+    // Buffers are set up lazily by the first send
+    if (!tx_buffers[0]) {
+        return true;
+    }
+    
+    uint32_t tsd_status = inl(RTL8139->io_base + RTL8139_REG_TSD0 + (tx_descriptor * 4));
+    return (tsd_status & RTL8139_TSD_OWN) == 0 || (tsd_status & RTL8139_TSD_TOK);
+}
+
+// Receive a packet, from the bottom half queue once interrupts drive RX
 bool rtl8139_receive_packet(int8* buffer, int16* length) {
+    if (!rtl8139_rx_deferred) {
+        return rtl8139_read_ring(buffer, length);
+    }
+    
+    if (!buffer || !length) {
+        warn("Invalid buffer or length pointer", __FILE__);
+        return false;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&rx_queue_lock);
+    if (rx_queue_tail == rx_queue_head) {
+        spin_unlock_irqrestore(&rx_queue_lock, flags);
+        return false;
+    }
+    
+    rx_frame_t* slot = &rx_queue[rx_queue_head % RTL8139_RX_QUEUE_LEN];
+    memcpy(buffer, slot->data, slot->length);
+    *length = slot->length;
+    rx_queue_head++;
+    spin_unlock_irqrestore(&rx_queue_lock, flags);
+    
+    return true;
+}
+
+// Pull the next frame straight off the card's receive ring
+static bool rtl8139_read_ring(int8* buffer, int16* length) {
     if (!RTL8139 || RTL8139->io_base == 0 || !RTL8139->initialized) {
         warn("RTL8139 Card is not initialized", __FILE__);
         return false;
@@ -637,6 +788,16 @@ void rtl8139_rx_stats() {
     } else {
         print("  Status: Packets available for reading\n");
     }
+    
+    if (rtl8139_rx_deferred) {
+        print("  Queued frames: ");
+        itoa(rx_queue_tail - rx_queue_head, buffer, 10);
+        print(buffer);
+        print(", dropped: ");
+        itoa(rx_queue_dropped, buffer, 10);
+        print(buffer);
+        print("\n");
+    }
 }
 
 // Test packet transmission
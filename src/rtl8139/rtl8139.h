@@ -143,6 +143,9 @@ bool rtl8139_detect(void);
 bool rtl8139_init(void);
 bool rtl8139_init_tx_buffers(void);
 bool rtl8139_send_packet(const int8* data, int16 length);
+bool rtl8139_tx_ready(void);
+bool rtl8139_rx_pending(void);
+uint32_t rtl8139_rx_dropped(void);
 bool rtl8139_receive_packet(int8* buffer, int16* length);
 bool rtl8139_tx_status(uint8_t descriptor);
 void rtl8139_rx_stats(void);
@@ -152,6 +155,7 @@ void rtl8139_print_status(void);
 void rtl8139_enable_interrupts(uint16_t interrupt_mask);
 void rtl8139_disable_interrupts(void);
 uint16_t rtl8139_handle_interrupt(void);
+void rtl8139_irq_handler(void);
 void rtl8139_configure_receive(uint32_t config);
 void rtl8139_configure_transmit(uint32_t config);
 bool rtl8139_get_link_status(void);
@@ -0,0 +1,46 @@
+#include "kthread.h"
+#include "task.h"
+#include "../errors/error.h"
+
+// Every kernel thread starts here, the body and argument live in its Task
+static void kthread_entry() {
+    Task* self = current_task;
+    self->kthread_fn(self->kthread_arg);
+    kthread_exit();
+}
+
+int kthread_create(const char* name, kthread_fn_t fn, void* arg) {
+    if (!fn) {
+        task_error("Kernel thread", "0x01C");
+        return -1;
+    }
+
+    // The slot is reserved for us, only a full table or no stack fails here
+    int id = task_alloc_id();
+    if (id < 0) {
+        return -1;
+    }
+
+    // Keep the new task off every CPU until its body is filled in
+    if (!create_task_stopped((uint32_t) id, (uint32_t) kthread_entry, 0, 0, true)) {
+        task_free_id(id);
+        return -1;
+    }
+
+    Task* task = task_get((uint32_t) id);
+    task->name = name;
+    task->kthread_fn = fn;
+    task->kthread_arg = arg;
+
+    task_start((uint32_t) id);
+    return id;
+}
+
+void kthread_exit(void) {
+    cleanup_task(current_task->id);
+
+    // cleanup_task switched away for good, this is never reached
+    while (true) {
+        halt();
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+#include <stdint.h>
+
+typedef void (*kthread_fn_t)(void* arg);
+
+/**
+ * @brief Starts fn(arg) in a new kernel-mode task with its own stack.
+ *        The thread exits when fn returns.
+ * @return Task id, or -1 when no slot or stack is available.
+ */
+int kthread_create(const char* name, kthread_fn_t fn, void* arg);
+
+/**
+ * @brief Ends the calling kernel thread, does not return.
+ */
+void kthread_exit(void);
+
+#endif // KTHREAD_H
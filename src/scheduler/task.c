@@ -3,6 +3,13 @@
 #include "../terminal/terminal.h"
 #include "../errors/error.h"
 #include "../io/io.h"
+#include "../timers/clocksource.h"
+#include "../timers/tick.h"
+#include "../cpu/lapic.h"
+#include "../timers/timer.h"
+#include "../timers/timer_wheel.h"
+#include "../cpu/cpu.h"
+#include "../memory/memory.h"
 
 // ----- GDT / TSS -----
 
@@ -10,6 +17,16 @@ GDTEntry gdt_entries[NUM_GDT_ENTRIES];
 GDTPointer gdt_pointer;
 TSS tss;
 
+Task tasks[MAX_TASKS];
+int num_tasks;
+
+// Guards tasks[] slots, num_tasks and the stack freelist
+static spinlock_t task_lock = SPINLOCK_INIT;
+
+static void task_init_sched(Task* task, uint8_t prio);
+static uint32_t select_task_cpu(Task* task);
+static void task_activate(Task* task);
+
 int set_gdt_entry(uint32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
     if (num >= NUM_GDT_ENTRIES) {
         memory_error("GDT entry setup", "0x001");
@@ -81,6 +98,30 @@ int remap_pic() {
 
 extern void* isr_redirect_table[];
 extern void isr128();
+extern void isr48();
+extern void isr49();
+extern void isr255();
+
+static irq_handler_t irq_handlers[16];
+
+int register_irq_handler(uint8_t irq, irq_handler_t handler) {
+    if (irq >= 16) {
+        system_error("IRQ handler registration", "0x019");
+        return 0;
+    }
+    
+    irq_handlers[irq] = handler;
+    
+    // Unmask the line on the PIC that owns it (and the cascade for the slave)
+    if (irq < 8) {
+        outb(0x21, inb(0x21) & ~(1 << irq));
+    } else {
+        outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+        outb(0x21, inb(0x21) & ~(1 << 2));
+    }
+    
+    return 1;
+}
 
 int setup_interrupts() {
     if (!remap_pic()) {
@@ -104,6 +145,17 @@ int setup_interrupts() {
     if (!set_idt_entry(0x80, isr128, 0xEE)) {
         return 0;
     }
+    
+    // LAPIC timer, IPI and spurious vectors, only raised once the LAPIC is enabled
+    if (!set_idt_entry(LAPIC_TIMER_VECTOR, isr48, 0x8E)) {
+        return 0;
+    }
+    if (!set_idt_entry(LAPIC_RESCHED_VECTOR, isr49, 0x8E)) {
+        return 0;
+    }
+    if (!set_idt_entry(LAPIC_SPURIOUS_VECTOR, isr255, 0x8E)) {
+        return 0;
+    }
 
     idt_pointer.limit = sizeof(IDTEntry) * 256 - 1;
     idt_pointer.base  = (uint32_t) &idt;
@@ -117,18 +169,46 @@ void handle_interrupt(TrapFrame regs) {
         system_error("Invalid interrupt vector", "0x005");
         return;
     }
-    
-    *(VGA_MEMORY + 80 + regs.interrupt) = 0xF100 | 'G';
 
     if (regs.interrupt >= 32 && regs.interrupt <= 47) {
+        irq_handler_t handler = irq_handlers[regs.interrupt - 32];
+        if (handler) {
+            handler();
+        }
+        
         if (regs.interrupt >= 40) {
             outb(0xA0, 0x20);
         }
         outb(0x20, 0x20);
 
-        if (regs.interrupt == 32) {
+        // The tick or a woken task asked for a switch
+        if (this_cpu()->need_resched) {
+            schedule();
+        }
+        return;
+    }
+    
+    if (regs.interrupt == LAPIC_TIMER_VECTOR) {
+        lapic_eoi();
+        tick_handle_interrupt();
+        if (this_cpu()->need_resched) {
+            schedule();
+        }
+        return;
+    }
+    
+    // Another CPU queued work for us, the switch happens on the way out
+    if (regs.interrupt == LAPIC_RESCHED_VECTOR) {
+        lapic_eoi();
+        if (this_cpu()->need_resched) {
             schedule();
         }
+        return;
+    }
+    
+    // Spurious LAPIC interrupts must not be acknowledged
+    if (regs.interrupt == LAPIC_SPURIOUS_VECTOR) {
+        return;
     }
  
     if (regs.interrupt == 0x80) {
@@ -147,44 +227,116 @@ int setup_pit(uint32_t frequency) {
     }
     
     uint32_t divisor = 1193180 / frequency;
-    outb(0x43, 0x36);
+    
+    // Channel 0, lobyte/hibyte, mode 2 (rate generator) so the count reads back linearly
+    outb(0x43, 0x34);
     uint8_t l = (uint8_t) (divisor & 0xFF);
     uint8_t h = (uint8_t) (divisor >> 8 & 0xFF);
     outb(0x40, l);
     outb(0x40, h);
+    clocksource_set_pit_divisor(divisor);
     
     return 1;
 }
 
-Task tasks[MAX_TASKS];
-int num_tasks;
-Task* current_task;
 
-// Stack allocation functions
-uint32_t allocate_kernel_stack() {
-    static uint32_t stack_base = 0x200000;
-    static uint32_t stack_size = 0x4000;
-    uint32_t allocated_stack = stack_base;
-    stack_base += stack_size;
-    return allocated_stack + stack_size;
+// ----- Stacks -----
+
+// Each stack is one guard page followed by KERNEL_STACK_PAGES usable pages,
+// taken from the page allocator and recycled through a small freelist
+static uint32_t stack_freelist[MAX_TASKS * 2];
+static int stack_free_count = 0;
+
+static void stack_fill(uint32_t base) {
+    uint32_t* words = (uint32_t*) base;
+    uint32_t guard_words = PAGE_SIZE / 4;
+    uint32_t total_words = (KERNEL_STACK_PAGES + 1) * PAGE_SIZE / 4;
+    
+    // Paging is off, so the guard page cannot be unmapped; it holds a canary
+    // that schedule() checks, the rest is painted for the high-water mark
+    for (uint32_t i = 0; i < guard_words; i++) {
+        words[i] = STACK_GUARD_MAGIC;
+    }
+    for (uint32_t i = guard_words; i < total_words; i++) {
+        words[i] = STACK_FILL_MAGIC;
+    }
 }
 
-uint32_t allocate_user_stack() {
-    static uint32_t user_stack_base = 0x400000;
-    static uint32_t user_stack_size = 0x4000;
-    uint32_t allocated_stack = user_stack_base;
-    user_stack_base += user_stack_size;
-    return allocated_stack + user_stack_size;
+// Returns the guard page address, the usable stack ends STACK_REGION_SIZE above it
+static uint32_t stack_alloc(void) {
+    uint32_t base;
+    
+    if (stack_free_count > 0) {
+        base = stack_freelist[--stack_free_count];
+    } else {
+        base = allocate_contiguous_pages(KERNEL_STACK_PAGES + 1);
+        if (base == 0) {
+            return 0;
+        }
+    }
+    
+    stack_fill(base);
+    return base;
 }
 
-int create_task(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_stack, bool is_kernel_task) {
-    if (id >= MAX_TASKS) {
-        task_error("Task creation", "0x008");
+static void stack_free(uint32_t base) {
+    if (base == 0) {
+        return;
+    }
+    
+    if (stack_free_count < (int)(sizeof(stack_freelist) / sizeof(stack_freelist[0]))) {
+        stack_freelist[stack_free_count++] = base;
+    } else {
+        free_contiguous_pages(base, KERNEL_STACK_PAGES + 1);
+    }
+}
+
+// A task cannot free the stack it is running on, so exited tasks are
+// reaped here once they are switched out for good. Called with task_lock held.
+static void reap_zombie_stacks(void) {
+    for (int i = 1; i < MAX_TASKS; i++) {
+        Task* task = &tasks[i];
+        if (task->state == TASK_ZOMBIE && !task->on_cpu) {
+            stack_free(task->kstack_base);
+            stack_free(task->ustack_base);
+            task->kstack_base = 0;
+            task->ustack_base = 0;
+        }
+    }
+}
+
+// Lowest painted word still intact tells how deep the stack ever went
+uint32_t task_stack_high_water(Task* task) {
+    if (!task->kstack_base) {
         return 0;
     }
     
-    if (num_tasks >= MAX_TASKS) {
-        task_error("Task creation", "0x009");
+    uint32_t* words = (uint32_t*)(task->kstack_base + PAGE_SIZE);
+    uint32_t count = KERNEL_STACK_PAGES * PAGE_SIZE / 4;
+    uint32_t unused = 0;
+    
+    while (unused < count && words[unused] == STACK_FILL_MAGIC) {
+        unused++;
+    }
+    return (count - unused) * 4;
+}
+
+static void stack_check_guard(Task* task) {
+    if (!task->kstack_base) {
+        return;
+    }
+    
+    // Overflow grows down into the top of the guard page first
+    uint32_t* top = (uint32_t*)(task->kstack_base + PAGE_SIZE) - 4;
+    if (top[0] != STACK_GUARD_MAGIC || top[1] != STACK_GUARD_MAGIC ||
+        top[2] != STACK_GUARD_MAGIC || top[3] != STACK_GUARD_MAGIC) {
+        kernel_panic("Kernel stack overflow", "0x01B");
+    }
+}
+
+int create_task_stopped(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_stack, bool is_kernel_task) {
+    if (id >= MAX_TASKS) {
+        task_error("Task creation", "0x008");
         return 0;
     }
     
@@ -193,26 +345,45 @@ int create_task(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_
         return 0;
     }
     
-    if (tasks[id].id != 0 && id != 0) {
-        task_error("Task already exists", "0x00B");
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    
+    // A full table or a taken slot is the caller's to handle, not fatal
+    if (num_tasks >= MAX_TASKS) {
+        spin_unlock_irqrestore(&task_lock, flags);
+        return 0;
+    }
+    
+    // Zombie slots are free again
+    if (tasks[id].is_active || (tasks[id].id != 0 && tasks[id].state != TASK_ZOMBIE)) {
+        spin_unlock_irqrestore(&task_lock, flags);
         return 0;
     }
 
+    reap_zombie_stacks();
+    
     // Allocate stacks if not provided
+    uint32_t kstack_base = 0;
+    uint32_t ustack_base = 0;
+    
     if (kernel_stack == 0) {
-        kernel_stack = allocate_kernel_stack();
-        if (kernel_stack == 0) {
+        kstack_base = stack_alloc();
+        if (kstack_base == 0) {
+            spin_unlock_irqrestore(&task_lock, flags);
             memory_error("Kernel stack allocation failed", "0x00C");
             return 0;
         }
+        kernel_stack = kstack_base + STACK_REGION_SIZE;
     }
     
     if (!is_kernel_task && user_stack == 0) {
-        user_stack = allocate_user_stack();
-        if (user_stack == 0) {
+        ustack_base = stack_alloc();
+        if (ustack_base == 0) {
+            stack_free(kstack_base);
+            spin_unlock_irqrestore(&task_lock, flags);
             memory_error("User stack allocation failed", "0x00D");
             return 0;
         }
+        user_stack = ustack_base + STACK_REGION_SIZE;
     }
 
     num_tasks++;
@@ -257,64 +428,776 @@ int create_task(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_
 
     tasks[id].kesp_bottom = kernel_stack;
     tasks[id].kesp = (uint32_t) kesp;
+    tasks[id].kstack_base = kstack_base;
+    tasks[id].ustack_base = ustack_base;
     tasks[id].id = id;
+    tasks[id].wait_next = 0;
+    tasks[id].wait_queue = 0;
+    tasks[id].sleep_timer = 0;
+    tasks[id].name = 0;
+    tasks[id].kthread_fn = 0;
+    tasks[id].kthread_arg = 0;
     tasks[id].is_active = true;  // Add this line
+    tasks[id].reserved = false;
+    task_init_sched(&tasks[id], DEFAULT_PRIO);
+    tasks[id].is_user = !is_kernel_task;
+    tasks[id].pinned = tasks[id].is_user;
+    tasks[id].cpu = select_task_cpu(&tasks[id]);
+    tasks[id].state = TASK_BLOCKED;
     
+    spin_unlock_irqrestore(&task_lock, flags);
     return 1;  // Return success
 }
 
+int create_task(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_stack, bool is_kernel_task) {
+    if (!create_task_stopped(id, eip, user_stack, kernel_stack, is_kernel_task)) {
+        return 0;
+    }
+    
+    task_start(id);
+    return 1;
+}
+
+void task_start(uint32_t id) {
+    if (id >= MAX_TASKS || !tasks[id].is_active) {
+        return;
+    }
+    
+    uint32_t flags = irq_save();
+    task_activate(&tasks[id]);
+    irq_restore(flags);
+}
+
+// ----- Per-CPU state -----
+
+cpu_t cpus[MAX_CPUS];
+uint32_t num_cpus = 1;
+uint8_t apic_to_cpu[256];
+volatile bool smp_active = false;
+
+// Runs whenever nothing else is runnable, never sleeps itself; one per CPU
+static Task idle_tasks[MAX_CPUS];
+static uint8_t idle_stacks[MAX_CPUS][4096] __attribute__((aligned(16)));
+static const char* idle_names[MAX_CPUS] = {
+    "idle/0", "idle/1", "idle/2", "idle/3", "idle/4", "idle/5", "idle/6", "idle/7"
+};
+static bool tasks_ready = false;
+
+cpu_t* this_cpu(void) {
+    // Until the APs are up everything runs on the boot CPU
+    if (!smp_active) {
+        return &cpus[0];
+    }
+    return &cpus[apic_to_cpu[lapic_id()]];
+}
+
+uint32_t smp_processor_id(void) {
+    return this_cpu()->index;
+}
+
+Task* get_current_task(void) {
+    // Interrupts off so the task cannot migrate between the lookup and the read
+    uint32_t flags = irq_save();
+    Task* task = this_cpu()->current;
+    irq_restore(flags);
+    return task;
+}
+
+void cpu_kick(uint32_t cpu_index) {
+    if (smp_active && cpu_index < num_cpus && cpu_index != smp_processor_id()) {
+        lapic_send_ipi(cpus[cpu_index].apic_id, LAPIC_ICR_FIXED | LAPIC_RESCHED_VECTOR);
+    }
+}
+
+// ----- Run queues -----
+
+static void enqueue_task(run_queue_t* rq, Task* task) {
+    uint8_t prio = task->prio;
+    task->run_next = 0;
+    task->run_prev = rq->tail[prio];
+    if (rq->tail[prio]) {
+        rq->tail[prio]->run_next = task;
+    } else {
+        rq->head[prio] = task;
+    }
+    rq->tail[prio] = task;
+    rq->bitmap |= 1u << prio;
+    rq->nr_running++;
+    if (!task->pinned) {
+        rq->nr_migratable++;
+    }
+    task->on_rq = true;
+    task->state = TASK_READY;
+}
+
+static void dequeue_task(run_queue_t* rq, Task* task) {
+    uint8_t prio = task->prio;
+    if (task->run_prev) {
+        task->run_prev->run_next = task->run_next;
+    } else {
+        rq->head[prio] = task->run_next;
+    }
+    if (task->run_next) {
+        task->run_next->run_prev = task->run_prev;
+    } else {
+        rq->tail[prio] = task->run_prev;
+    }
+    if (!rq->head[prio]) {
+        rq->bitmap &= ~(1u << prio);
+    }
+    task->run_next = task->run_prev = 0;
+    rq->nr_running--;
+    if (!task->pinned) {
+        rq->nr_migratable--;
+    }
+}
+
+// Lock the run queue a task belongs to, interrupts must be off. The task can
+// be stolen while we wait for the lock, so check it is still the right one.
+static run_queue_t* task_rq_lock(Task* task) {
+    while (true) {
+        run_queue_t* rq = &cpus[task->cpu].rq;
+        spin_lock(&rq->lock);
+        if (rq == &cpus[task->cpu].rq) {
+            return rq;
+        }
+        spin_unlock(&rq->lock);
+    }
+}
+
+// Another CPU has queued work this one could take, read without locking
+static bool steal_candidate(cpu_t* cpu) {
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (i != cpu->index && cpus[i].online && cpus[i].rq.nr_migratable) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pull the most important kernel task off another CPU's queue. Only trylock,
+// the victim may be stealing from us at the same time.
+static Task* steal_task(cpu_t* cpu) {
+    for (uint32_t n = 1; n < num_cpus; n++) {
+        cpu_t* victim = &cpus[(cpu->index + n) % num_cpus];
+        if (!victim->online || !victim->rq.nr_migratable || !spin_trylock(&victim->rq.lock)) {
+            continue;
+        }
+        
+        Task* task = 0;
+        for (uint32_t prio = 0; prio < MAX_PRIO && !task; prio++) {
+            if (victim->rq.bitmap & (1u << prio)) {
+                for (Task* t = victim->rq.head[prio]; t; t = t->run_next) {
+                    if (!t->pinned) {
+                        task = t;
+                        break;
+                    }
+                }
+            }
+        }
+        
+        if (task) {
+            dequeue_task(&victim->rq, task);
+            task->cpu = cpu->index;
+            cpu->nr_steals++;
+        }
+        spin_unlock(&victim->rq.lock);
+        
+        if (task) {
+            return task;
+        }
+    }
+    return 0;
+}
+
+// Highest priority local task, then a stolen one, else the idle task
+static Task* pick_next_task(cpu_t* cpu) {
+    run_queue_t* rq = &cpu->rq;
+    
+    if (!rq->bitmap) {
+        Task* stolen = smp_active ? steal_task(cpu) : 0;
+        return stolen ? stolen : cpu->idle;
+    }
+    
+    uint32_t prio;
+    asm("bsf %1, %0" : "=r"(prio) : "r"(rq->bitmap));
+    Task* next = rq->head[prio];
+    dequeue_task(rq, next);
+    return next;
+}
+
+static uint32_t task_timeslice(Task* task) {
+    // Important tasks get longer slices: 20 ticks at prio 0, 5 at the bottom
+    return TASK_MIN_SLICE + (MAX_PRIO - 1 - task->static_prio) / 2;
+}
+
+static void task_update_prio(Task* task) {
+    int prio = (int) task->static_prio - task->bonus;
+    if (prio < 0) prio = 0;
+    if (prio >= MAX_PRIO) prio = MAX_PRIO - 1;
+    task->prio = (uint8_t) prio;
+}
+
+static void task_init_sched(Task* task, uint8_t prio) {
+    task->static_prio = prio;
+    task->bonus = 0;
+    task->run_next = task->run_prev = 0;
+    task->on_rq = false;
+    task->on_cpu = 0;
+    task->exec_start = get_cpu_timestamp();
+    task->runtime_cycles = 0;
+    task->nr_switches = 0;
+    task->nr_wakeups = 0;
+    task->wake_tsc = 0;
+    task->wakeup_latency_total = 0;
+    task->wakeup_latency_max = 0;
+    task_update_prio(task);
+    task->time_slice = task_timeslice(task);
+}
+
+// Let some idle CPU know there is work it could steal
+static void kick_idle_cpu(uint32_t busy_cpu) {
+    for (uint32_t i = 0; i < num_cpus; i++) {
+        if (i != busy_cpu && cpus[i].online && cpus[i].current == cpus[i].idle) {
+            cpus[i].need_resched = true;
+            cpu_kick(i);
+            return;
+        }
+    }
+}
+
+// A task was just queued on its CPU's run queue (locked): preempt there if it
+// beats what is running, otherwise offer it to an idle CPU
+static void check_preempt(Task* task) {
+    cpu_t* target = &cpus[task->cpu];
+    Task* curr = target->current;
+    
+    if (curr == target->idle || task->prio < curr->prio) {
+        target->need_resched = true;
+        cpu_kick(target->index);
+    } else if (smp_active && !task->pinned) {
+        kick_idle_cpu(target->index);
+    }
+}
+
+// Put a task that is off every run queue back on its CPU's, interrupts off
+static void task_activate(Task* task) {
+    run_queue_t* rq = task_rq_lock(task);
+    enqueue_task(rq, task);
+    check_preempt(task);
+    spin_unlock(&rq->lock);
+}
+
+// Least loaded online CPU for a new task; user tasks need the boot CPU's TSS
+static uint32_t select_task_cpu(Task* task) {
+    uint32_t best = 0;
+    
+    if (task->is_user) {
+        return 0;
+    }
+    for (uint32_t i = 1; i < num_cpus; i++) {
+        if (cpus[i].online && cpus[i].rq.nr_running < cpus[best].rq.nr_running) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void idle_task_entry() {
+    while (true) {
+        disable_interrupts();
+        cpu_t* cpu = this_cpu();
+        if (cpu->need_resched || cpu->rq.bitmap || steal_candidate(cpu)) {
+            enable_interrupts();
+            schedule();
+        } else {
+            tick_idle(0);
+        }
+    }
+}
+
 int setup_tasks() {
     memset((uint8_t*) tasks, 0, sizeof(Task) * MAX_TASKS);
-
+    memset((uint8_t*) cpus, 0, sizeof(cpus));
+    memset((uint8_t*) idle_tasks, 0, sizeof(idle_tasks));
+    
+    // Idle tasks live outside tasks[] and start like any new kernel task, an
+    // AP instead becomes its idle task on the same stack, see task_start_ap
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpu_t* cpu = &cpus[i];
+        Task* idle = &idle_tasks[i];
+        uint8_t* stack_top = idle_stacks[i] + sizeof(idle_stacks[i]);
+        
+        uint8_t* kesp = stack_top - sizeof(NewTaskKernelStack);
+        NewTaskKernelStack* stack = (NewTaskKernelStack*) kesp;
+        memset((uint8_t*) stack, 0, sizeof(NewTaskKernelStack));
+        stack->switch_context_return_addr = (uint32_t) new_task_setup;
+        stack->data_selector = GDT_KERNEL_DATA;
+        stack->eip = (uint32_t) idle_task_entry;
+        stack->cs = GDT_KERNEL_CODE;
+        stack->eflags = 0x200;
+        
+        idle->id = MAX_TASKS + i;
+        idle->name = idle_names[i];
+        idle->kesp = (uint32_t) kesp;
+        idle->kesp_bottom = (uint32_t) stack_top;
+        idle->is_active = true;
+        idle->state = TASK_RUNNING;
+        idle->cpu = i;
+        task_init_sched(idle, MAX_PRIO - 1);
+        
+        cpu->index = i;
+        cpu->idle = idle;
+        spin_lock_init(&cpu->rq.lock);
+    }
+    
     num_tasks = 1;
-    current_task = &tasks[0];
-    current_task->id = 0;
-    current_task->is_active = true;
-    current_task->kesp_bottom = 0x100000;
-    current_task->kesp = 0x100000 - 0x1000;
+    Task* shell = &tasks[0];
+    shell->id = 0;
+    shell->name = "shell";
+    shell->is_active = true;
+    shell->state = TASK_RUNNING;
+    shell->kesp_bottom = 0x100000;
+    shell->kesp = 0x100000 - 0x1000;
+    task_init_sched(shell, DEFAULT_PRIO);
+    shell->on_cpu = 1;
+    shell->on_rq = true;
+    
+    cpus[0].current = shell;
+    cpus[0].online = true;
     
-    if (!current_task) {
+    if (!cpus[0].current) {
         kernel_panic("Task initialization failed", "0x00F");
         return 0;
     }
     
+    tasks_ready = true;
+    return 1;
+}
+
+void task_start_ap(uint32_t cpu_index) {
+    cpu_t* cpu = &cpus[cpu_index];
+    Task* idle = cpu->idle;
+    
+    // Already running on the idle stack, this context simply becomes the idle task
+    disable_interrupts();
+    idle->on_cpu = 1;
+    idle->exec_start = get_cpu_timestamp();
+    cpu->current = idle;
+    cpu->online = true;
+    enable_interrupts();
+    
+    idle_task_entry();
+}
+
+// First free slot in tasks[], zombies count as free
+int task_alloc_id(void) {
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    int id = -1;
+    
+    for (int i = 1; i < MAX_TASKS; i++) {
+        if (!tasks[i].is_active && !tasks[i].reserved &&
+            (tasks[i].id == 0 || tasks[i].state == TASK_ZOMBIE)) {
+            tasks[i].reserved = true;
+            id = i;
+            break;
+        }
+    }
+    
+    spin_unlock_irqrestore(&task_lock, flags);
+    return id;
+}
+
+void task_free_id(int id) {
+    if (id <= 0 || id >= MAX_TASKS) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    tasks[id].reserved = false;
+    spin_unlock_irqrestore(&task_lock, flags);
+}
+
+Task* task_get(uint32_t id) {
+    return id < MAX_TASKS ? &tasks[id] : 0;
+}
+
+bool task_is_alive(uint32_t id) {
+    return id < MAX_TASKS && tasks[id].is_active;
+}
+
+bool scheduler_ready(void) {
+    return tasks_ready && tick_ready();
+}
+
+bool task_others_runnable(void) {
+    return this_cpu()->rq.bitmap != 0;
+}
+
+int task_set_priority(uint32_t id, uint8_t prio) {
+    if (id >= MAX_TASKS || prio >= MAX_PRIO || !tasks[id].is_active) {
+        task_error("Task priority", "0x01A");
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    Task* task = &tasks[id];
+    run_queue_t* rq = task_rq_lock(task);
+    bool queued = task->state == TASK_READY;
+    
+    // Requeue under the new level so the bitmap stays right
+    if (queued) {
+        dequeue_task(rq, task);
+    }
+    task->static_prio = prio;
+    task_update_prio(task);
+    if (queued) {
+        enqueue_task(rq, task);
+        check_preempt(task);
+    }
+    
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
     return 1;
 }
 
+void task_set_pinned(uint32_t id, bool pinned) {
+    if (id >= MAX_TASKS || !tasks[id].is_active) {
+        return;
+    }
+    
+    uint32_t flags = irq_save();
+    Task* task = &tasks[id];
+    run_queue_t* rq = task_rq_lock(task);
+    
+    // User tasks stay on the boot CPU, it has the only TSS
+    pinned = pinned || task->is_user;
+    if (task->state == TASK_READY && task->pinned != pinned) {
+        if (pinned) {
+            rq->nr_migratable--;
+        } else {
+            rq->nr_migratable++;
+        }
+    }
+    
+    // Off every run queue, so it can move over to the caller's CPU right away
+    if (!task->on_rq && !task->is_user) {
+        task->cpu = smp_processor_id();
+    }
+    task->pinned = pinned;
+    
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+static void task_fill_stats(Task* task, task_stats_t* stats, uint64_t now) {
+    stats->id = task->id;
+    stats->name = task->name;
+    stats->state = task->state;
+    stats->prio = task->prio;
+    stats->is_user = task->is_user;
+    stats->is_idle = task == cpus[task->cpu].idle;
+    stats->cpu = task->cpu;
+    stats->runtime_cycles = task->runtime_cycles;
+    if (task == cpus[task->cpu].current) {
+        stats->runtime_cycles += now - task->exec_start;
+    }
+    stats->stack_used = task_stack_high_water(task);
+    stats->stack_size = task->kstack_base ? KERNEL_STACK_PAGES * PAGE_SIZE : 0;
+    stats->nr_switches = task->nr_switches;
+    stats->nr_wakeups = task->nr_wakeups;
+    stats->wakeup_latency_total = task->wakeup_latency_total;
+    stats->wakeup_latency_max = task->wakeup_latency_max;
+}
+
+int task_snapshot(task_stats_t* out, int max) {
+    if (!tasks_ready || max <= 0) {
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    uint64_t now = get_cpu_timestamp();
+    int count = 0;
+    
+    // Other CPUs keep running, the copy is only roughly consistent
+    for (int i = 0; i < MAX_TASKS && count < max - (int) num_cpus; i++) {
+        if (tasks[i].is_active) {
+            task_fill_stats(&tasks[i], &out[count++], now);
+        }
+    }
+    for (uint32_t i = 0; i < num_cpus && count < max; i++) {
+        if (cpus[i].online) {
+            task_fill_stats(cpus[i].idle, &out[count++], now);
+        }
+    }
+    
+    irq_restore(flags);
+    return count;
+}
+
+// Charge the running task one tick, called from the timer interrupt
+void scheduler_tick(void) {
+    cpu_t* cpu = this_cpu();
+    Task* task = cpu->current;
+    if (!tasks_ready || !task) {
+        return;
+    }
+    
+    if (task == cpu->idle) {
+        if (cpu->rq.bitmap || steal_candidate(cpu)) {
+            cpu->need_resched = true;
+        }
+        return;
+    }
+    
+    if (task->time_slice > 1) {
+        task->time_slice--;
+        return;
+    }
+    
+    // Slice used up: CPU hogs sink, the refill follows the new level
+    spin_lock(&cpu->rq.lock);
+    if (task->bonus > -PRIO_BONUS_MAX) {
+        task->bonus--;
+    }
+    task_update_prio(task);
+    task->time_slice = task_timeslice(task);
+    if (cpu->rq.bitmap) {
+        cpu->need_resched = true;
+    }
+    spin_unlock(&cpu->rq.lock);
+}
+
 void schedule() {
     if (num_tasks == 0) {
         system_error("Scheduler", "0x010");
         return;
     }
     
-    if (!current_task) {
+    uint32_t flags = irq_save();
+    cpu_t* cpu = this_cpu();
+    run_queue_t* rq = &cpu->rq;
+    Task* prev = cpu->current;
+    
+    if (!prev) {
+        irq_restore(flags);
         kernel_panic("Current task is null", "0x011");
         return;
     }
     
-    int next_id = (current_task->id + 1) % num_tasks;
-    int attempts = 0;
+    cpu->need_resched = false;
     
-    while (attempts < num_tasks) {
-        Task* next = &tasks[next_id];
-        
-        if (next->is_active && next->kesp_bottom != 0 && next->kesp != 0) {
-            if (next->kesp < next->kesp_bottom && 
-                (next->kesp_bottom - next->kesp) >= sizeof(NewTaskKernelStack)) {
-                
-                Task* old = current_task;
-                current_task = next;
-                tss.esp0 = next->kesp_bottom;
-                switch_context(old, next);
-                return;
-            }
+    // Nothing else is ready and prev can keep going, skip the queue round trip
+    if (!rq->bitmap && (prev == cpu->idle ? !steal_candidate(cpu) : prev->state == TASK_RUNNING)) {
+        irq_restore(flags);
+        return;
+    }
+    
+    spin_lock(&rq->lock);
+    
+    // A task that is still runnable goes to the back of its level, one that
+    // blocked or exited leaves the queue until a wake-up puts it back
+    if (prev != cpu->idle) {
+        if (prev->state == TASK_RUNNING) {
+            enqueue_task(rq, prev);
+        } else {
+            prev->on_rq = false;
+        }
+    }
+    
+    Task* next = pick_next_task(cpu);
+    next->state = TASK_RUNNING;
+    
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    
+    // Woken and picked before the CPU it blocked on finished switching away
+    while (next->on_cpu) {
+        cpu_relax();
+    }
+    next->on_cpu = 1;
+    
+    stack_check_guard(prev);
+    if (prev == cpu->idle) {
+        tick_restart();
+    }
+    
+    uint64_t now = get_cpu_timestamp();
+    prev->runtime_cycles += now - prev->exec_start;
+    next->exec_start = now;
+    next->nr_switches++;
+    
+    // Time from being made ready to actually running
+    if (next->wake_tsc) {
+        uint64_t latency = now - next->wake_tsc;
+        next->wakeup_latency_total += latency;
+        if (latency > next->wakeup_latency_max) {
+            next->wakeup_latency_max = latency;
         }
+        next->wake_tsc = 0;
+    }
+    
+    cpu->current = next;
+    
+    // Only the boot CPU has a TSS, user tasks never run anywhere else
+    if (cpu->index == 0) {
+        tss.esp0 = next->kesp_bottom;
+    }
+    
+    spin_unlock(&rq->lock);
+    switch_context(prev, next);
+    
+    irq_restore(flags);
+}
+
+void task_yield(void) {
+    schedule();
+}
+
+// ----- Sleep / wait queues -----
+
+void wait_queue_init(wait_queue_t* wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = 0;
+}
+
+// Queue the current task on wq and mark it blocked, the caller then checks
+// its condition and calls schedule() if it still has to wait
+void prepare_to_wait(wait_queue_t* wq) {
+    Task* self = current_task;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    
+    // wake_up empties the queue, so every pass adds the task back
+    Task* task = wq->head;
+    while (task && task != self) {
+        task = task->wait_next;
+    }
+    if (!task) {
+        self->wait_next = wq->head;
+        wq->head = self;
+        self->wait_queue = wq;
+    }
+    self->state = TASK_BLOCKED;
+    
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Take task off wq if it is still there, wq->lock held
+static void wait_queue_unlink(wait_queue_t* wq, Task* task) {
+    Task** link = &wq->head;
+    while (*link && *link != task) {
+        link = &(*link)->wait_next;
+    }
+    if (*link) {
+        *link = task->wait_next;
+        task->wait_next = 0;
+    }
+    task->wait_queue = 0;
+}
+
+// The condition holds: back to running and off the queue if nobody woke us
+void finish_wait(wait_queue_t* wq) {
+    Task* self = current_task;
+    uint32_t flags = irq_save();
+    
+    run_queue_t* rq = task_rq_lock(self);
+    self->state = TASK_RUNNING;
+    spin_unlock(&rq->lock);
+    
+    spin_lock(&wq->lock);
+    wait_queue_unlink(wq, self);
+    spin_unlock(&wq->lock);
+    
+    irq_restore(flags);
+}
+
+void wake_up_task(Task* task) {
+    uint32_t flags = irq_save();
+    run_queue_t* rq = task_rq_lock(task);
+    
+    if (task->state == TASK_BLOCKED) {
+        // Tasks that give up the CPU on their own float up
+        if (task->bonus < PRIO_BONUS_MAX) {
+            task->bonus++;
+        }
+        task_update_prio(task);
+        
+        task->nr_wakeups++;
         
-        next_id = (next_id + 1) % num_tasks;
-        attempts++;
+        if (task->on_rq) {
+            // Woken before schedule() took it off its CPU, just keep running
+            task->state = TASK_RUNNING;
+        } else {
+            task->wake_tsc = get_cpu_timestamp();
+            enqueue_task(rq, task);
+            check_preempt(task);
+        }
+    }
+    
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+// Wake every task parked on wq, they recheck their condition themselves
+void wake_up(wait_queue_t* wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    
+    Task* task = wq->head;
+    wq->head = 0;
+    while (task) {
+        Task* next = task->wait_next;
+        task->wait_next = 0;
+        task->wait_queue = 0;
+        wake_up_task(task);
+        task = next;
+    }
+    
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+static void task_sleep_timeout(uint32_t data) {
+    wake_up_task((Task*) data);
+}
+
+// Block the current task for at least ms milliseconds
+void task_sleep_ms(uint32_t ms) {
+    if (!scheduler_ready() || current_task == this_cpu()->idle) {
+        tick_wait_until(clocksource_read_ns() + (uint64_t)ms * 1000000);
+        return;
     }
     
-    task_error("No valid tasks to schedule", "0x013");
+    uint32_t flags = irq_save();
+    Task* self = current_task;
+    
+    // +1 so a tick landing right after this point cannot cut the sleep short
+    timer_list_t timer;
+    setup_timer(&timer, task_sleep_timeout, (uint32_t) self);
+    self->sleep_timer = &timer;
+    self->state = TASK_BLOCKED;
+    mod_timer(&timer, ticks + ms + 1);
+    
+    while (self->state == TASK_BLOCKED) {
+        schedule();
+    }
+    
+    del_timer(&timer);
+    self->sleep_timer = 0;
+    irq_restore(flags);
+}
+
+// Wait for the next event without hogging the CPU: run other tasks when there
+// are any, otherwise halt. Call with interrupts off after checking the wake-up
+// condition; returns with interrupts on.
+void task_idle_wait(void) {
+    if (tasks_ready && task_others_runnable()) {
+        enable_interrupts();
+        schedule();
+        return;
+    }
+    
+    tick_idle(0);
 }
 
 void cleanup_task(uint32_t task_id) {
@@ -328,12 +1211,61 @@ void cleanup_task(uint32_t task_id) {
         return;
     }
     
-    tasks[task_id].is_active = false;
-    memset(&tasks[task_id], 0, sizeof(Task));
+    uint32_t flags = irq_save();
+    Task* self = current_task;
+    Task* task = &tasks[task_id];
     
-    if (current_task && current_task->id == task_id) {
+    spin_lock(&task_lock);
+    if (!task->is_active) {
+        spin_unlock(&task_lock);
+        irq_restore(flags);
+        return;
+    }
+    task->is_active = false;
+    num_tasks--;
+    spin_unlock(&task_lock);
+    
+    run_queue_t* rq = task_rq_lock(task);
+    if (task->state == TASK_READY) {
+        dequeue_task(rq, task);
+        task->on_rq = false;
+    } else if (task != self && task->on_rq) {
+        // Running on another CPU, it drops off the next time it schedules
+        cpus[task->cpu].need_resched = true;
+        cpu_kick(task->cpu);
+    }
+    task->state = TASK_ZOMBIE;
+    spin_unlock(&rq->lock);
+    
+    // Our own stack is still in use, a later create_task reaps it
+    if (task != self) {
+        // Once it is off its CPU the zombie never runs again, and nothing
+        // may still point into its stack or at its slot
+        while (task->on_cpu) {
+            cpu_relax();
+        }
+        if (task->sleep_timer) {
+            del_timer(task->sleep_timer);
+            task->sleep_timer = 0;
+        }
+        wait_queue_t* wq = task->wait_queue;
+        if (wq) {
+            spin_lock(&wq->lock);
+            wait_queue_unlink(wq, task);
+            spin_unlock(&wq->lock);
+        }
+        
+        spin_lock(&task_lock);
+        reap_zombie_stacks();
+        spin_unlock(&task_lock);
+    }
+    
+    // A zombie is never queued again, so this does not return
+    if (task == self) {
         schedule();
     }
+    
+    irq_restore(flags);
 }
 
 bool validate_task_memory(uint32_t task_id) {
@@ -365,18 +1297,14 @@ bool validate_task_memory(uint32_t task_id) {
     return true;
 }
 
+// Peek at what schedule() would run next on this CPU, without dequeuing it
 Task* get_next_valid_task() {
-    int start_id = current_task ? current_task->id : 0;
-    int next_id = (start_id + 1) % num_tasks;
-    int attempts = 0;
-    
-    while (attempts < num_tasks) {
-        if (tasks[next_id].is_active && validate_task_memory(next_id)) {
-            return &tasks[next_id];
-        }
-        next_id = (next_id + 1) % num_tasks;
-        attempts++;
+    run_queue_t* rq = &this_cpu()->rq;
+    if (!rq->bitmap) {
+        return current_task;
     }
     
-    return &tasks[0];
+    uint32_t prio;
+    asm("bsf %1, %0" : "=r"(prio) : "r"(rq->bitmap));
+    return rq->head[prio];
 }
@@ -2,11 +2,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "spinlock.h"
+
+struct wait_queue;
+struct timer_list;
 
 // Constants
 #define NUM_GDT_ENTRIES 6
-#define MAX_TASKS 64
-#define VGA_MEMORY ((uint16_t*)0xB8000)
 
 // GDT Selectors
 #define GDT_KERNEL_CODE 0x08
@@ -21,7 +23,10 @@
 // fixed number of tasks for simplicity
 #define MAX_TASKS 16
 
-#define VGA_MEMORY ((uint16_t*) 0xB8000)
+// CPUs the scheduler keeps state for, extra processors stay parked
+#define MAX_CPUS 8
+
+#define VGA_MEMORY ((volatile uint16_t*)0xB8000)
 
 typedef struct {
     uint16_t limit_low;
@@ -92,13 +97,127 @@ typedef struct {
 	uint32_t eip, cs, eflags, usermode_esp, usermode_ss;
 } NewTaskKernelStack;
 
-typedef struct {
+// Kernel and user stacks: one guard page below KERNEL_STACK_PAGES usable pages
+#define KERNEL_STACK_PAGES  4
+#define STACK_REGION_SIZE   ((KERNEL_STACK_PAGES + 1) * 4096)
+#define STACK_GUARD_MAGIC   0xDEADBEEF
+#define STACK_FILL_MAGIC    0x57ACF111
+
+// Task run states
+#define TASK_RUNNING  0   // On the CPU
+#define TASK_READY    1   // Queued on the run queue
+#define TASK_BLOCKED  2   // Waiting on a wait queue or a sleep timer
+#define TASK_ZOMBIE   3   // Exited, slot can be reused
+
+// Priorities, lower is more important; each level has its own run queue
+#define MAX_PRIO          32
+#define DEFAULT_PRIO      16
+#define PRIO_BONUS_MAX    5    // How far blocking/spinning moves the dynamic priority
+#define TASK_MIN_SLICE    5    // Ticks (ms) for the least important level
+
+// id, kesp and on_cpu must stay first, switch_context uses offsets 4 and 8
+typedef struct Task {
     uint32_t id;
     uint32_t kesp;
+    volatile uint32_t on_cpu;   // Stack in use by a CPU, cleared by switch_context
     uint32_t kesp_bottom;
     bool is_active;
+    bool reserved;              // Handed out by task_alloc_id, not created yet
+    volatile uint32_t state;
+    struct Task* wait_next;     // Link while parked on a wait queue
+    struct wait_queue* wait_queue;  // Queue wait_next belongs to, NULL when none
+    struct timer_list* sleep_timer; // Armed by task_sleep_ms, NULL when none
+    const char* name;           // Shown by top, NULL for unnamed tasks
+    void (*kthread_fn)(void*);  // Kernel thread body, see kthread.h
+    void* kthread_arg;
+    uint32_t kstack_base;       // Guard page of an allocated kernel stack, 0 if caller-owned
+    uint32_t ustack_base;       // Same for the user stack
+
+    // Scheduling
+    uint8_t static_prio;        // Set by the creator or task_set_priority
+    uint8_t prio;               // static_prio adjusted by the interactivity bonus
+    int8_t bonus;               // +1 per voluntary block, -1 per expired slice
+    uint32_t time_slice;        // Ticks left before a forced reschedule
+    struct Task* run_next;      // Links on the run queue of its priority
+    struct Task* run_prev;
+    uint32_t cpu;               // Run queue the task belongs to
+    bool on_rq;                 // Queued or running, false once it blocked or exited
+    bool pinned;                // Never stolen by another CPU, always set for user tasks
+
+    // Accounting, all times in TSC cycles
+    bool is_user;               // Runs in ring 3
+    uint64_t exec_start;        // TSC when last switched in
+    uint64_t runtime_cycles;    // Time spent on the CPU up to exec_start
+    uint32_t nr_switches;       // Times switched in
+    uint32_t nr_wakeups;        // Wake-ups from a blocked state
+    uint64_t wake_tsc;          // TSC of the pending wake-up, 0 when none
+    uint64_t wakeup_latency_total;
+    uint64_t wakeup_latency_max;
 } Task;
 
+// Point-in-time copy of a task's accounting, see task_snapshot
+typedef struct {
+    uint32_t id;
+    const char* name;
+    uint32_t state;
+    uint8_t prio;
+    bool is_user;
+    bool is_idle;
+    uint32_t cpu;
+    uint64_t runtime_cycles;    // Includes the current slice for the running task
+    uint32_t stack_used;        // Deepest kernel stack use seen, bytes
+    uint32_t stack_size;        // 0 for stacks not owned by the scheduler
+    uint32_t nr_switches;
+    uint32_t nr_wakeups;
+    uint64_t wakeup_latency_total;
+    uint64_t wakeup_latency_max;
+} task_stats_t;
+
+// One FIFO per priority plus a bitmap of non-empty levels, so picking the next
+// task is a bit scan no matter how many tasks exist
+typedef struct {
+    spinlock_t lock;
+    uint32_t bitmap;
+    Task* head[MAX_PRIO];
+    Task* tail[MAX_PRIO];
+    uint32_t nr_running;
+    uint32_t nr_migratable;     // Queued kernel tasks another CPU may steal
+} run_queue_t;
+
+// Scheduler state of one processor
+typedef struct {
+    uint32_t index;
+    uint32_t apic_id;
+    Task* current;
+    Task* idle;
+    volatile bool need_resched;
+    volatile bool online;
+    run_queue_t rq;
+    uint32_t nr_steals;         // Tasks pulled over from other CPUs
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t num_cpus;
+
+typedef struct wait_queue {
+    spinlock_t lock;
+    Task* head;
+} wait_queue_t;
+
+// Sleep on wq until condition holds. The task is queued and marked blocked
+// before the check, so a wake-up from another CPU cannot slip in between.
+#define wait_event(wq, condition)                 \
+    do {                                          \
+        while (true) {                            \
+            prepare_to_wait(&(wq));               \
+            if (condition) {                      \
+                break;                            \
+            }                                     \
+            schedule();                           \
+        }                                         \
+        finish_wait(&(wq));                       \
+    } while (0)
+
 // in multitask.asm
 void load_gdt(uint32_t addr);
 void switch_context(Task* from, Task* to);
@@ -111,10 +230,82 @@ int setup_interrupts(void);
 // PIC functions
 int remap_pic(void);
 
+// Handlers for the 16 legacy IRQ lines, run before the EOI is sent
+typedef void (*irq_handler_t)(void);
+
 // Interrupt handling
+int register_irq_handler(uint8_t irq, irq_handler_t handler);
 void handle_interrupt(TrapFrame regs);
 void schedule();
+void task_yield(void);
+void task_sleep_ms(uint32_t ms);
+void task_idle_wait(void);
+bool task_others_runnable(void);
+bool scheduler_ready(void);
+void scheduler_tick(void);
+int task_set_priority(uint32_t id, uint8_t prio);
+
+/**
+ * @brief Keeps a task on the CPU it is on, or lets it migrate again. A task
+ *        that is not queued anywhere (stopped or blocked) moves to the caller's CPU.
+ */
+void task_set_pinned(uint32_t id, bool pinned);
+/**
+ * @brief Reserves a free slot for create_task_stopped, so no other CPU can
+ *        take it in between. Give it back with task_free_id if creation fails.
+ * @return The slot, -1 when the table is full.
+ */
+int task_alloc_id(void);
+void task_free_id(int id);
+Task* task_get(uint32_t id);
+uint32_t task_stack_high_water(Task* task);
+bool task_is_alive(uint32_t id);
+
+/**
+ * @brief Copies the accounting of every live task, idle task last.
+ * @return Number of entries written, at most max.
+ */
+int task_snapshot(task_stats_t* out, int max);
+
+// Wait queues
+void wait_queue_init(wait_queue_t* wq);
+void prepare_to_wait(wait_queue_t* wq);
+void finish_wait(wait_queue_t* wq);
+void wake_up(wait_queue_t* wq);
+void wake_up_task(Task* task);
+
+/**
+ * @brief The calling CPU's state. Looked up by LAPIC ID once the APs are up.
+ */
+cpu_t* this_cpu(void);
+uint32_t smp_processor_id(void);
+Task* get_current_task(void);
+
+/**
+ * @brief Makes the calling CPU the AP with the given index and runs its idle loop.
+ */
+void task_start_ap(uint32_t cpu_index);
+
+/**
+ * @brief Sends a reschedule IPI so an idle CPU looks at its run queue again.
+ */
+void cpu_kick(uint32_t cpu_index);
+
+// Table used by this_cpu, filled in by smp_init
+extern uint8_t apic_to_cpu[256];
+extern volatile bool smp_active;
+
+#define current_task (get_current_task())
+
 int create_task(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_stack, bool is_kernel_task);
+
+/**
+ * @brief create_task without queueing the task, so the creator can finish
+ *        setting it up before any CPU runs it. task_start releases it.
+ */
+int create_task_stopped(uint32_t id, uint32_t eip, uint32_t user_stack, uint32_t kernel_stack, bool is_kernel_task);
+void task_start(uint32_t id);
+void cleanup_task(uint32_t task_id);
 int setup_pit(uint32_t frequency);
 void handle_interrupt(TrapFrame regs);
 int remap_pic();
@@ -126,4 +317,4 @@ int set_gdt_entry(uint32_t num, uint32_t base, uint32_t limit, uint8_t access, u
 
 #define halt() asm volatile("hlt")
 #define enable_interrupts() asm volatile("sti")
-#define disable_interrupts() asm volatile("cli")
\ No newline at end of file
+#define disable_interrupts() asm volatile("cli")
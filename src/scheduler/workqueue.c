@@ -0,0 +1,109 @@
+#include "workqueue.h"
+#include "kthread.h"
+#include "../errors/error.h"
+
+static workqueue_t workqueues[WORKQUEUE_MAX];
+static int workqueue_count = 0;
+static workqueue_t* system_wq = 0;
+
+static work_t* workqueue_pop(workqueue_t* wq) {
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+
+    work_t* work = wq->head;
+    if (work) {
+        wq->head = work->next;
+        if (!wq->head) {
+            wq->tail = 0;
+        }
+        work->next = 0;
+
+        // Cleared before running so the item can requeue itself
+        work->pending = false;
+    }
+
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return work;
+}
+
+static void worker_thread(void* arg) {
+    workqueue_t* wq = (workqueue_t*) arg;
+
+    while (true) {
+        wait_event(wq->wait, wq->head != 0);
+
+        work_t* work;
+        while ((work = workqueue_pop(wq))) {
+            work->func(work);
+            wq->processed++;
+        }
+    }
+}
+
+workqueue_t* workqueue_create(const char* name) {
+    if (workqueue_count >= WORKQUEUE_MAX) {
+        task_error("Workqueue", "0x01E");
+        return 0;
+    }
+
+    workqueue_t* wq = &workqueues[workqueue_count];
+    wq->name = name;
+    spin_lock_init(&wq->lock);
+    wq->head = wq->tail = 0;
+    wq->processed = 0;
+    wait_queue_init(&wq->wait);
+
+    wq->task_id = kthread_create(name, worker_thread, wq);
+    if (wq->task_id < 0) {
+        return 0;
+    }
+    task_set_priority((uint32_t) wq->task_id, WORKQUEUE_PRIO);
+
+    workqueue_count++;
+    return wq;
+}
+
+int workqueue_init(void) {
+    system_wq = workqueue_create("events");
+    return system_wq != 0;
+}
+
+bool workqueue_ready(void) {
+    return system_wq != 0;
+}
+
+void work_init(work_t* work, work_func_t func) {
+    work->next = 0;
+    work->func = func;
+    work->pending = false;
+}
+
+bool queue_work(workqueue_t* wq, work_t* work) {
+    if (!wq || !work || !work->func) {
+        return false;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+
+    if (work->pending) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+        return false;
+    }
+
+    work->pending = true;
+    work->next = 0;
+    if (wq->tail) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+
+    wake_up(&wq->wait);
+
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return true;
+}
+
+bool schedule_work(work_t* work) {
+    return queue_work(system_wq, work);
+}
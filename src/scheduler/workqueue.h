@@ -0,0 +1,61 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "task.h"
+
+#define WORKQUEUE_MAX  4
+#define WORKQUEUE_PRIO (DEFAULT_PRIO - 4)   // Deferred IRQ work preempts normal tasks
+
+typedef struct work_struct work_t;
+typedef void (*work_func_t)(work_t* work);
+
+// Embed one of these in whatever state the deferred function needs
+struct work_struct {
+    work_t* next;
+    work_func_t func;
+    volatile bool pending;      // Queued and not yet started
+};
+
+#define WORK_INITIALIZER(fn) { 0, (fn), false }
+
+// FIFO of work items drained by its own kernel thread
+typedef struct {
+    const char* name;
+    spinlock_t lock;            // Guards the list, queue_work may run on any CPU
+    work_t* head;
+    work_t* tail;
+    wait_queue_t wait;
+    int task_id;
+    uint32_t processed;
+} workqueue_t;
+
+/**
+ * @brief Creates the shared "events" queue used by schedule_work.
+ *        Needs the scheduler, call after setup_tasks.
+ */
+int workqueue_init(void);
+
+/**
+ * @brief Creates a queue with a dedicated worker thread.
+ * @return NULL when all WORKQUEUE_MAX queues are in use.
+ */
+workqueue_t* workqueue_create(const char* name);
+
+void work_init(work_t* work, work_func_t func);
+
+/**
+ * @brief Queues work to run in the worker thread. Safe from interrupt handlers.
+ * @return false if the item was already pending or the queue is not running.
+ */
+bool queue_work(workqueue_t* wq, work_t* work);
+
+/**
+ * @brief queue_work on the shared "events" queue.
+ */
+bool schedule_work(work_t* work);
+
+bool workqueue_ready(void);
+
+#endif // WORKQUEUE_H
@@ -2,14 +2,19 @@
 #include "../io/io.h"
 #include "../timers/timer.h"
 #include "../utility/utility.h"
+#include "../timers/timer_wheel.h"
 
-// Simple delay function using busy waiting
+// Turns the speaker off once an asynchronous tone has run its course
+static timer_list_t speaker_timer;
+
+static void speaker_timer_callback(uint32_t data) {
+    (void)data;
+    speaker_disable();
+}
+
+// Note/pause length, idles on the clocksource instead of counting loops
 void speaker_delay(uint32_t ms) {
-    // Simple busy wait - adjust multiplier based on your CPU speed
-    volatile uint32_t count = ms * 10000; // Adjust this value as needed
-    while (count--) {
-        // Just wait
-    }
+    delay_ms(ms);
 }
 
 // Initialize the PC speaker
@@ -17,6 +22,7 @@ void speaker_init(void) {
     // Configure PIT channel 2 for square wave generation
     port_byte_out(PIT_COMMAND_PORT, 0xB6);
     speaker_disable();
+    setup_timer(&speaker_timer, speaker_timer_callback, 0);
 }
 
 // Enable the PC speaker
@@ -40,6 +46,9 @@ void speaker_set_frequency(uint32_t frequency) {
     
     uint32_t divisor = PIT_FREQUENCY / frequency;
     
+    // Channel 2 is shared with TSC calibration, restore square wave mode every time
+    port_byte_out(PIT_COMMAND_PORT, 0xB6);
+    
     // Send the divisor to PIT channel 2
     port_byte_out(PIT_CHANNEL_2_PORT, (uint8_t)(divisor & 0xFF));
     port_byte_out(PIT_CHANNEL_2_PORT, (uint8_t)((divisor >> 8) & 0xFF));
@@ -47,6 +56,9 @@ void speaker_set_frequency(uint32_t frequency) {
 
 // Play a tone for a specific duration
 void speaker_play_tone(uint32_t frequency, uint32_t duration_ms) {
+    // A synchronous tone replaces any asynchronous one still playing
+    del_timer(&speaker_timer);
+    
     if (frequency == 0) {
         // Rest/silence
         speaker_disable();
@@ -60,9 +72,21 @@ void speaker_play_tone(uint32_t frequency, uint32_t duration_ms) {
     speaker_disable();
 }
 
+// Start a tone and return immediately, a kernel timer silences it
+void speaker_play_tone_async(uint32_t frequency, uint32_t duration_ms) {
+    if (frequency == 0) {
+        speaker_disable();
+        return;
+    }
+    
+    speaker_set_frequency(frequency);
+    speaker_enable();
+    mod_timer(&speaker_timer, ticks + duration_ms);
+}
+
 // Simple beep sound
 void speaker_beep(void) {
-    speaker_play_tone(NOTE_A4, 200); // Shorter duration
+    speaker_play_tone_async(NOTE_A4, 200); // Shorter duration
 }
 
 // Test function to verify speaker works
@@ -45,6 +45,7 @@ void speaker_enable(void);
 void speaker_disable(void);
 void speaker_set_frequency(uint32_t frequency);
 void speaker_play_tone(uint32_t frequency, uint32_t duration_ms);
+void speaker_play_tone_async(uint32_t frequency, uint32_t duration_ms);
 void speaker_beep(void);
 void speaker_play_melody(uint32_t* frequencies, uint32_t* durations, uint32_t count);
 void speaker_play_startup_sound(void);
@@ -3,6 +3,7 @@
 #include "../utility/utility.h" // For strlen
 #include "../timers/timer.h"
 #include "../io/io.h"
+#include "../scheduler/spinlock.h"
 #include <stdbool.h> // For bool type
 #include <stdarg.h>  // For va_list
 #include <limits.h> 
@@ -16,6 +17,10 @@ size_t terminal_column;
 uint8_t terminal_color;
 uint16_t* terminal_buffer;
 
+// Writers on other CPUs, background MPOP programs among them, would tear the
+// cursor and the cells. irqsave since interrupt handlers print too
+static spinlock_t console_lock = SPINLOCK_INIT;
+
 char _binary_font_psf_start[];
 char _binary_font_psf_end[];
 typedef struct {
@@ -88,9 +93,14 @@ void terminal_set_cursor_position(size_t position) {
     outb(0x3D5, (uint8_t)((position >> 8) & 0xFF));
 }
 
+static void terminal_move_cursor(void) {
+    terminal_set_cursor_position(terminal_row * terminal_width + terminal_column);
+}
+
 void terminal_update_cursor(void) {
-    size_t position = terminal_row * terminal_width + terminal_column;
-    terminal_set_cursor_position(position);
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    terminal_move_cursor();
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void terminal_setsize(size_t width, size_t height) {
@@ -106,9 +116,25 @@ void terminal_setsize(size_t width, size_t height) {
     }
 }
 
+static void terminal_drain(void);
+
 void terminal_setcolor(uint8_t color) 
 {
+    // Queued text keeps the color it was written in
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    terminal_drain();
     terminal_color = color;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void terminal_set_position(size_t row, size_t column)
+{
+    // Queued text still goes where it was written
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    terminal_drain();
+    terminal_row = row < terminal_height ? row : terminal_height - 1;
+    terminal_column = column < terminal_width ? column : terminal_width - 1;
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) 
@@ -117,91 +143,181 @@ void terminal_putentryat(char c, uint8_t color, size_t x, size_t y)
     terminal_buffer[index] = vga_entry(c, color);
 }
 
-void terminal_putchar(char c) 
-{
-    switch (c) {
-        case '\n':
-            terminal_column = 0; // Reset column to 0
-            if (++terminal_row == terminal_height) {
-                terminal_row--; // Prevent overflow
-                // Scroll up
-                for (size_t y = 1; y < terminal_height; y++) {
-                    for (size_t x = 0; x < terminal_width; x++) {
-                        terminal_buffer[(y - 1) * terminal_width + x] = terminal_buffer[y * terminal_width + x];
-                    }
+// Rows the screen moves up by with one memmove, blanking the rows that open up
+static void terminal_scroll(size_t lines) {
+    if (lines > terminal_height) {
+        lines = terminal_height;
+    }
+    size_t kept = (terminal_height - lines) * terminal_width;
+    memmove(terminal_buffer, terminal_buffer + lines * terminal_width, kept * sizeof(uint16_t));
+
+    uint16_t blank = vga_entry(' ', terminal_color);
+    for (size_t i = kept; i < terminal_height * terminal_width; i++) {
+        terminal_buffer[i] = blank;
+    }
+}
+
+typedef struct {
+    size_t row;
+    size_t column;
+    size_t scrolls;     // Times the text has run off the bottom so far
+} terminal_cursor_t;
+
+static void terminal_cursor_newline(terminal_cursor_t* cursor) {
+    cursor->column = 0;
+    if (++cursor->row == terminal_height) {
+        cursor->row--; // Prevent overflow
+        cursor->scrolls++;
+    }
+}
+
+// Cell of the cursor once the screen has moved up by shift rows, false if
+// that row has already left the screen
+static bool terminal_cursor_cell(terminal_cursor_t* cursor, size_t shift, size_t* index) {
+    size_t row = cursor->row + cursor->scrolls;
+    if (row < shift) {
+        return false;
+    }
+    *index = (row - shift) * terminal_width + cursor->column;
+    return true;
+}
+
+// Walks data from the current position and returns the rows it scrolls by.
+// The first pass only counts them, the second draws with the screen already
+// moved up by that much, so a batch costs one scroll however many lines it has
+static size_t terminal_layout(const char* data, size_t size, bool draw, size_t shift) {
+    terminal_cursor_t cursor = { terminal_row, terminal_column, 0 };
+    size_t index;
+
+    for (size_t i = 0; i < size; i++) {
+        char c = data[i];
+        switch (c) {
+            case '\n':
+                terminal_cursor_newline(&cursor);
+                break;
+
+            case '\r':
+                // Carriage return - move cursor to beginning of current line
+                cursor.column = 0;
+                break;
+
+            case '\t':
+                // Move to the next tab stop (align to 4-character boundaries)
+                cursor.column = (cursor.column + 4) & ~3;
+                if (cursor.column >= terminal_width) {
+                    terminal_cursor_newline(&cursor);
                 }
-                // Clear the last row
-                for (size_t x = 0; x < terminal_width; x++) {
-                    terminal_buffer[(terminal_height - 1) * terminal_width + x] = vga_entry(' ', terminal_color);
+                break;
+
+            case '\b':
+                // Handle backspace
+                if (cursor.column > 0) {
+                    cursor.column--; // Move back a column
+                } else if (cursor.row > 0) {
+                    cursor.row--; // Move up a row
+                    cursor.column = terminal_width - 1; // Go to the end of the previous line
+                } else {
+                    break;
                 }
-            }
-            break;
-
-        case '\r':
-            // Carriage return - move cursor to beginning of current line
-            terminal_column = 0;
-            break;
-
-        case '\t':
-            // Move to the next tab stop (align to 4-character boundaries)
-            terminal_column = (terminal_column + 4) & ~3;
-            if (terminal_column >= terminal_width) {
-                terminal_column = 0; // Move to the next line if overflow
-                if (++terminal_row == terminal_height) {
-                    terminal_row--; // Prevent overflow
-                    // Scroll up
-                    for (size_t y = 1; y < terminal_height; y++) {
-                        for (size_t x = 0; x < terminal_width; x++) {
-                            terminal_buffer[(y - 1) * terminal_width + x] = terminal_buffer[y * terminal_width + x];
-                        }
-                    }
-                    // Clear the last row
-                    for (size_t x = 0; x < terminal_width; x++) {
-                        terminal_buffer[(terminal_height - 1) * terminal_width + x] = vga_entry(' ', terminal_color);
-                    }
+                if (draw && terminal_cursor_cell(&cursor, shift, &index)) {
+                    terminal_buffer[index] = vga_entry(' ', terminal_color); // Clear the character
                 }
-            }
-            break;
-
-        case '\b':
-            // Handle backspace
-            if (terminal_column > 0) {
-                terminal_column--; // Move back a column
-                terminal_putentryat(' ', terminal_color, terminal_column, terminal_row); // Clear the character
-            } else if (terminal_row > 0) {
-                terminal_row--; // Move up a row
-                terminal_column = terminal_width - 1; // Go to the end of the previous line
-                terminal_putentryat(' ', terminal_color, terminal_column, terminal_row);
-            }
-            break;
-
-        default:
-            terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-            if (++terminal_column == terminal_width) {
-                terminal_column = 0; // Move to the next line if overflow
-                if (++terminal_row == terminal_height) {
-                    terminal_row--; // Prevent overflow
-                    // Scroll up
-                    for (size_t y = 1; y < terminal_height; y++) {
-                        for (size_t x = 0; x < terminal_width; x++) {
-                            terminal_buffer[(y - 1) * terminal_width + x] = terminal_buffer[y * terminal_width + x];
-                        }
-                    }
-                    // Clear the last row
-                    for (size_t x = 0; x < terminal_width; x++) {
-                        terminal_buffer[(terminal_height - 1) * terminal_width + x] = vga_entry(' ', terminal_color);
-                    }
+                break;
+
+            default:
+                if (draw && terminal_cursor_cell(&cursor, shift, &index)) {
+                    terminal_buffer[index] = vga_entry(c, terminal_color);
                 }
-            }
-            break;
+                if (++cursor.column == terminal_width) {
+                    terminal_cursor_newline(&cursor);
+                }
+                break;
+        }
     }
+
+    if (draw) {
+        terminal_row = cursor.row;
+        terminal_column = cursor.column;
+    }
+    return cursor.scrolls;
+}
+
+static void terminal_render(const char* data, size_t size) {
+    size_t scrolls = terminal_layout(data, size, false, 0);
+    if (scrolls > 0) {
+        terminal_scroll(scrolls);
+    }
+    terminal_layout(data, size, true, scrolls);
+}
+
+// Output of open batches and their nesting, all under console_lock. A batch
+// counts for every CPU, so writes from elsewhere queue up behind it in order
+static char terminal_pending[TERMINAL_BATCH_SIZE];
+static size_t terminal_pending_length = 0;
+static int terminal_batch_depth = 0;
+
+// Draws the queued output, the console lock is held
+static void terminal_drain(void) {
+    if (terminal_pending_length > 0) {
+        terminal_render(terminal_pending, terminal_pending_length);
+        terminal_pending_length = 0;
+    }
+}
+
+static void terminal_queue(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (terminal_pending_length == TERMINAL_BATCH_SIZE) {
+            terminal_drain();
+        }
+        terminal_pending[terminal_pending_length++] = data[i];
+    }
+}
+
+void terminal_begin_batch(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    terminal_batch_depth++;
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void terminal_end_batch(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    if (terminal_batch_depth > 0 && --terminal_batch_depth == 0) {
+        terminal_drain();
+        terminal_move_cursor();
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void terminal_flush(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    terminal_drain();
+    terminal_move_cursor();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void terminal_putchar(char c) 
+{
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    if (terminal_batch_depth > 0) {
+        terminal_queue(&c, 1);
+    } else {
+        terminal_render(&c, 1);
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
+// Holds the console from the layout pass through the drawing, so text from
+// another CPU cannot land in between
 void terminal_write(const char* data, size_t size) 
 {
-    for (size_t i = 0; i < size; i++) {
-        terminal_putchar(data[i]);
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    if (terminal_batch_depth > 0) {
+        terminal_queue(data, size);
+    } else {
+        terminal_render(data, size);
+        terminal_move_cursor();
     }
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void print(const char* data) 
@@ -420,7 +536,6 @@ void printr(const char* format, ...) {
     print(buffer);
     
     va_end(args);
-    terminal_update_cursor();
 }
 
 void print_integer(int value) {
@@ -449,13 +564,11 @@ void print_integer(int value) {
     
     buffer[index] = '\0';
     print(buffer);
-    terminal_update_cursor();
 }
 
 void print_decimal(int num) 
 {
     print_integer(num); // Use the fixed print_integer function
-    terminal_update_cursor();
 }
 
 void print_hex(int num) 
@@ -482,7 +595,6 @@ void print_hex(int num)
     }
 
     print(buffer);
-    terminal_update_cursor();
 }
 
 void print_octal(int num) 
@@ -508,7 +620,6 @@ void print_octal(int num)
     }
 
     print(buffer);
-    terminal_update_cursor();
 }
 
 void print_slow(const char* data, uint32_t delay_time) {
@@ -549,7 +660,6 @@ void print_uint64(uint64_t value) {
     buffer[i] = '\0';
     
     print(buffer);
-    terminal_update_cursor();
 }
 
 void print_uint(unsigned int value) {
@@ -575,31 +685,27 @@ void print_uint(unsigned int value) {
     buffer[i] = '\0';
     
     print(buffer);
-    terminal_update_cursor();
 }
 
 void print_capacity(uint64_t bytes) {
+    terminal_begin_batch();
     if (bytes < 1024) {
         print_uint64(bytes);
         print(" B");
-        terminal_update_cursor();
     } else if (bytes < 1024 * 1024) {
         print_uint64(bytes / 1024);
         print(" KB");
-        terminal_update_cursor();
     } else if (bytes < 1024ULL * 1024 * 1024) {
         print_uint64(bytes / (1024 * 1024));
         print(" MB");
-        terminal_update_cursor();
     } else if (bytes < 1024ULL * 1024 * 1024 * 1024) {
         print_uint64(bytes / (1024ULL * 1024 * 1024));
         print(" GB");
-        terminal_update_cursor();
     } else {
         print_uint64(bytes / (1024ULL * 1024 * 1024 * 1024));
         print(" TB");
-        terminal_update_cursor();
     }
+    terminal_end_batch();
 }
 
 void print_qemu(char msg[]) {
@@ -630,6 +736,7 @@ void terminal_clear(void)
     }
     terminal_row = 0;
     terminal_column = 0;
+    terminal_begin_batch();
     terminal_setcolor(VGA_COLOR_CYAN);
     print("\t\t\t\t\t\t\t          .  .           \n");
     print("\t\t\t\t\t\t\t          dOO  OOb       \n");
@@ -649,6 +756,5 @@ void terminal_clear(void)
     print("Type 'radifetch' for system information\n");
     print("Type 'network status' to check network card\n");
     print("Type 'textspace' MPOP coding language interactive\n");
-    
-    
+    terminal_end_batch();
 }
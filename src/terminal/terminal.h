@@ -6,6 +6,8 @@
 #include "../vga/vga.h"
 #include "../utility/utility.h"
 
+#define TERMINAL_BATCH_SIZE 512  // Characters queued before a batch draws early
+
 // Function prototypes for terminal operations
 void terminal_initialize(void);
 void terminal_setcolor(uint8_t color);
@@ -27,6 +29,13 @@ void print_qemu(char msg[]);
 void printr(const char* format, ...);
 void terminal_set_cursor_position(size_t position);
 void terminal_update_cursor(void);
+// Where the next character goes, the hardware cursor follows on the next flush
+void terminal_set_position(size_t row, size_t column);
+// Output between these lands in one draw with at most one scroll; batches nest
+void terminal_begin_batch(void);
+void terminal_end_batch(void);
+// Draws queued output and moves the hardware cursor
+void terminal_flush(void);
 void psf_init(void);
 // New function prototype for setting terminal size
 void terminal_setsize(size_t width, size_t height);
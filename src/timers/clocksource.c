@@ -0,0 +1,215 @@
+#include "clocksource.h"
+#include "timer.h"
+#include "../cpu/cpu.h"
+#include "../io/io.h"
+#include "../scheduler/spinlock.h"
+#include "../utility/utility.h"
+
+#define CPUID_EXT_MAX          0x80000000
+#define CPUID_EXT_POWER        0x80000007
+#define CPUID_POWER_INVARIANT_TSC (1 << 8)
+
+// Calibration gives up on OUT2 after this many cycles of a 10 GHz TSC
+#define TSC_CALIBRATE_TIMEOUT  (10000000ULL * CLOCKSOURCE_CALIBRATE_MS)
+
+static uint64_t tsc_read(void);
+static uint64_t pit_read(void);
+
+static clocksource_t tsc_clocksource = { "tsc", tsc_read, 0, 0, 0, 0 };
+static clocksource_t pit_clocksource = { "pit", pit_read, PIT_BASE_FREQUENCY, 0, 0, 0 };
+
+static clocksource_t* current_clocksource = &pit_clocksource;
+static uint32_t pit_divisor = 1193;   // Matches setup_pit(1000) until told otherwise
+static uint64_t pit_last_value = 0;
+
+// Serializes the channel 0 latch and both count reads, and guards
+// pit_last_value, which CPUs reading the PIT clocksource all share
+static spinlock_t pit_lock = SPINLOCK_INIT;
+
+static uint64_t tsc_read(void) {
+    return get_cpu_timestamp();
+}
+
+// Ticks * reload + elapsed part of the current period, in PIT input clocks
+static uint64_t pit_read(void) {
+    uint32_t flags = spin_lock_irqsave(&pit_lock);
+
+    uint32_t tick_snapshot = ticks;
+
+    // Latch channel 0 and read the current count
+    outb(0x43, 0x00);
+    uint8_t low = inb(0x40);
+    uint8_t high = inb(0x40);
+    uint16_t count = (uint16_t)(low | (high << 8));
+
+    // A pending IRQ0 means the counter wrapped but ticks has not caught up yet
+    outb(0x20, 0x0A);
+    bool wrapped = (inb(0x20) & 0x01) != 0;
+
+    uint64_t value = (uint64_t)tick_snapshot * pit_divisor + (pit_divisor - count);
+    if (wrapped) {
+        value += pit_divisor;
+    }
+
+    // Never go backwards across the latch/IRQ race
+    if (value < pit_last_value) {
+        value = pit_last_value;
+    }
+    pit_last_value = value;
+
+    spin_unlock_irqrestore(&pit_lock, flags);
+    return value;
+}
+
+// (value * mult) >> shift without overflowing 64 bits
+static uint64_t mul_u64_u32_shr(uint64_t value, uint32_t mult, uint32_t shift) {
+    uint32_t low = (uint32_t)value;
+    uint32_t high = (uint32_t)(value >> 32);
+
+    uint64_t result = ((uint64_t)low * mult) >> shift;
+    if (high) {
+        result += ((uint64_t)high * mult) << (32 - shift);
+    }
+    return result;
+}
+
+// Largest shift that still keeps mult within 32 bits
+static void clocksource_calc_mult_shift(clocksource_t* cs) {
+    for (uint32_t shift = 32; shift > 0; shift--) {
+        uint64_t mult = ((1000000000ULL << shift) + cs->frequency_hz / 2) / cs->frequency_hz;
+        if (mult <= 0xFFFFFFFFULL) {
+            cs->mult = (uint32_t)mult;
+            cs->shift = shift;
+            return;
+        }
+    }
+
+    cs->mult = 1;
+    cs->shift = 0;
+}
+
+static bool tsc_is_invariant(void) {
+    CPUIDInfo info;
+
+    get_cpuid(1, &info);
+    if (!(info.edx & (1 << 4))) {
+        return false; // No TSC at all
+    }
+
+    get_cpuid(CPUID_EXT_MAX, &info);
+    if (info.eax < CPUID_EXT_POWER) {
+        return false;
+    }
+
+    get_cpuid(CPUID_EXT_POWER, &info);
+    return (info.edx & CPUID_POWER_INVARIANT_TSC) != 0;
+}
+
+// Count TSC cycles across a fixed PIT channel 2 one-shot, 0 if OUT2 never
+// goes high
+static uint64_t tsc_calibrate_once(uint16_t latch) {
+    // Gate high, speaker output off
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary
+    outb(0x43, 0xB0);
+    outb(0x42, latch & 0xFF);
+    outb(0x42, (latch >> 8) & 0xFF);
+
+    uint64_t start = get_cpu_timestamp();
+
+    // OUT2 goes high once the count reaches zero
+    while (!(inb(0x61) & 0x20)) {
+        if (get_cpu_timestamp() - start > TSC_CALIBRATE_TIMEOUT) {
+            return 0;
+        }
+    }
+
+    return get_cpu_timestamp() - start;
+}
+
+static uint64_t tsc_calibrate_hz(void) {
+    uint16_t latch = (uint16_t)((PIT_BASE_FREQUENCY * CLOCKSOURCE_CALIBRATE_MS) / 1000);
+    uint8_t port61 = inb(0x61);
+    uint64_t best = 0;
+
+    // Take the shortest run, anything longer was disturbed by SMIs or the host
+    for (int i = 0; i < CLOCKSOURCE_CALIBRATE_RUNS; i++) {
+        uint64_t cycles = tsc_calibrate_once(latch);
+        if (cycles == 0) {
+            best = 0;
+            break;
+        }
+        if (best == 0 || cycles < best) {
+            best = cycles;
+        }
+    }
+
+    outb(0x61, port61);
+
+    return best * PIT_BASE_FREQUENCY / latch;
+}
+
+int clocksource_init(void) {
+    CPUIDInfo info;
+    get_cpuid(1, &info);
+
+    if (info.edx & (1 << 4)) {
+        tsc_clocksource.frequency_hz = tsc_calibrate_hz();
+        if (tsc_clocksource.frequency_hz != 0) {
+            clocksource_calc_mult_shift(&tsc_clocksource);
+        } else {
+            warn("TSC calibration timed out, using the PIT clocksource", __FILE__);
+        }
+    } else {
+        warn("No TSC, using the PIT clocksource", __FILE__);
+    }
+
+    clocksource_calc_mult_shift(&pit_clocksource);
+
+    if (tsc_clocksource.frequency_hz == 0) {
+        current_clocksource = &pit_clocksource;
+    } else if (tsc_is_invariant()) {
+        current_clocksource = &tsc_clocksource;
+    } else {
+        warn("TSC is not invariant, using the PIT clocksource", __FILE__);
+        current_clocksource = &pit_clocksource;
+    }
+
+    current_clocksource->base_cycles = current_clocksource->read();
+    return 1;
+}
+
+void clocksource_set_pit_divisor(uint32_t divisor) {
+    if (divisor != 0) {
+        pit_divisor = divisor;
+    }
+}
+
+uint64_t clocksource_read_ns(void) {
+    clocksource_t* cs = current_clocksource;
+    return mul_u64_u32_shr(cs->read() - cs->base_cycles, cs->mult, cs->shift);
+}
+
+uint64_t clocksource_cycles_to_ns(uint64_t cycles) {
+    return mul_u64_u32_shr(cycles, current_clocksource->mult, current_clocksource->shift);
+}
+
+uint64_t clocksource_tsc_to_ns(uint64_t cycles) {
+    if (tsc_clocksource.frequency_hz == 0) {
+        return 0;
+    }
+    return mul_u64_u32_shr(cycles, tsc_clocksource.mult, tsc_clocksource.shift);
+}
+
+uint32_t clocksource_tsc_khz(void) {
+    return (uint32_t)(tsc_clocksource.frequency_hz / 1000);
+}
+
+bool clocksource_is_tsc(void) {
+    return current_clocksource == &tsc_clocksource;
+}
+
+const char* clocksource_name(void) {
+    return current_clocksource->name;
+}
@@ -0,0 +1,66 @@
+#ifndef CLOCKSOURCE_H
+#define CLOCKSOURCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// PIT input clock and the window used to calibrate the TSC against channel 2
+#define PIT_BASE_FREQUENCY        1193182
+#define CLOCKSOURCE_CALIBRATE_MS  20
+#define CLOCKSOURCE_CALIBRATE_RUNS 3
+
+typedef struct {
+    const char* name;
+    uint64_t (*read)(void);   // Free running counter
+    uint64_t frequency_hz;    // Counter frequency
+    uint32_t mult;            // ns = (cycles * mult) >> shift
+    uint32_t shift;
+    uint64_t base_cycles;     // Counter value that maps to 0 ns
+} clocksource_t;
+
+/**
+ * @brief Calibrates the TSC against PIT channel 2 and selects the clocksource.
+ *        Falls back to the PIT when the TSC is missing, not invariant or
+ *        channel 2 never finishes the calibration window.
+ * @return 1 on success, 0 on failure.
+ */
+int clocksource_init(void);
+
+/**
+ * @brief Tells the PIT clocksource which reload value channel 0 is running with.
+ * @param divisor The value programmed into channel 0.
+ */
+void clocksource_set_pit_divisor(uint32_t divisor);
+
+/**
+ * @brief Monotonic time since clocksource_init in nanoseconds.
+ */
+uint64_t clocksource_read_ns(void);
+
+/**
+ * @brief Converts a counter delta of the active clocksource to nanoseconds.
+ */
+uint64_t clocksource_cycles_to_ns(uint64_t cycles);
+
+/**
+ * @brief Converts a TSC delta to nanoseconds using the calibrated TSC rate,
+ *        even when the TSC is not the active clocksource.
+ */
+uint64_t clocksource_tsc_to_ns(uint64_t cycles);
+
+/**
+ * @brief Calibrated TSC frequency in kHz, 0 if the TSC could not be calibrated.
+ */
+uint32_t clocksource_tsc_khz(void);
+
+/**
+ * @brief True when the TSC is the active clocksource.
+ */
+bool clocksource_is_tsc(void);
+
+/**
+ * @brief Name of the active clocksource ("tsc" or "pit").
+ */
+const char* clocksource_name(void);
+
+#endif // CLOCKSOURCE_H
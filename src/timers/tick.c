@@ -0,0 +1,211 @@
+#include "tick.h"
+#include "timer.h"
+#include "clocksource.h"
+#include "timer_wheel.h"
+#include "../cpu/lapic.h"
+#include "../scheduler/task.h"
+#include "../utility/utility.h"
+#include "../io/io.h"
+
+static bool tick_use_lapic = false;
+static bool tick_nohz = false;
+static bool tick_initialized = false;
+static uint32_t lapic_timer_hz = 0;
+static volatile uint32_t tick_interrupts = 0;
+static volatile bool tick_stopped[MAX_CPUS];  // One-shot armed for idle, per CPU
+
+// Restart the steady 1 ms tick used while tasks are running
+static void tick_device_periodic(void) {
+    if (tick_use_lapic) {
+        lapic_timer_periodic(lapic_timer_hz / TICK_HZ);
+    } else {
+        setup_pit(TICK_HZ);
+    }
+}
+
+// Program a single interrupt delta_ns from now
+static void tick_device_oneshot(uint64_t delta_ns) {
+    if (delta_ns > TICK_MAX_IDLE_NS) {
+        delta_ns = TICK_MAX_IDLE_NS;
+    }
+
+    if (tick_use_lapic) {
+        uint64_t count = delta_ns * lapic_timer_hz / 1000000000ULL + 1;
+        lapic_timer_oneshot(count > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)count);
+    } else {
+        // Channel 0 only counts 16 bits, the idle loop re-arms after ~55 ms
+        uint64_t count = delta_ns * PIT_BASE_FREQUENCY / 1000000000ULL + 1;
+        if (count > 0xFFFF) count = 0xFFFF;
+        if (count == 0) count = 1;
+
+        // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        outb(0x43, 0x30);
+        outb(0x40, count & 0xFF);
+        outb(0x40, (count >> 8) & 0xFF);
+    }
+}
+
+static void tick_update_jiffies(void) {
+    ticks = (uint32_t)(clocksource_read_ns() / TICK_PERIOD_NS);
+}
+
+int tick_init(void) {
+    // Counting missed ticks needs a clocksource that keeps running while halted,
+    // the PIT clocksource itself depends on a steady IRQ0
+    tick_nohz = clocksource_is_tsc();
+    if (!tick_nohz) {
+        warn("No stable clocksource, tickless idle disabled", __FILE__);
+    }
+
+    if (tick_nohz && lapic_init()) {
+        lapic_timer_hz = lapic_timer_calibrate();
+        if (lapic_timer_hz >= TICK_HZ) {
+            tick_use_lapic = true;
+
+            // The LAPIC timer takes over, IRQ0 stays masked from here on
+            outb(0x21, inb(0x21) | 0x01);
+        }
+    }
+
+    if (!tick_use_lapic) {
+        register_irq_handler(0, tick_handle_interrupt);
+    }
+
+    tick_device_periodic();
+    tick_initialized = true;
+    return 1;
+}
+
+void tick_handle_interrupt(void) {
+    // Jiffies and the timer wheel belong to the boot CPU, the others only
+    // need the tick for time slices
+    if (smp_processor_id() != 0) {
+        scheduler_tick();
+        return;
+    }
+
+    tick_interrupts++;
+
+    if (tick_nohz) {
+        tick_update_jiffies();
+        tick_restart();
+    } else {
+        ticks++;
+    }
+
+    run_timers();
+    scheduler_tick();
+}
+
+void tick_idle(uint64_t deadline_ns) {
+    if (!tick_initialized) {
+        return;
+    }
+
+    // An idle AP has no slice to count and no timers to run, new work
+    // reaches it as a reschedule IPI. The one-shot is only a backstop; the
+    // periodic tick comes back in schedule() once a task is picked
+    uint32_t cpu = smp_processor_id();
+    if (cpu != 0) {
+        if (lapic_timer_hz >= TICK_HZ) {
+            lapic_timer_oneshot(lapic_timer_hz);
+            tick_stopped[cpu] = true;
+        }
+        asm volatile("sti; hlt" ::: "memory");
+        return;
+    }
+
+    if (tick_nohz) {
+        uint64_t now = clocksource_read_ns();
+        uint64_t delta = TICK_MAX_IDLE_NS;
+
+        // Wake for the earliest kernel timer as well
+        uint32_t expires;
+        if (timer_wheel_next_expiry(&expires)) {
+            int32_t remaining = (int32_t)(expires - ticks);
+            uint64_t timer_deadline = now + (remaining > 0 ? (uint64_t)remaining * TICK_PERIOD_NS : 0);
+            if (deadline_ns == 0 || timer_deadline < deadline_ns) {
+                deadline_ns = timer_deadline;
+            }
+        }
+
+        if (deadline_ns != 0) {
+            if (deadline_ns <= now) {
+                enable_interrupts();
+                return;
+            }
+            delta = deadline_ns - now;
+        }
+
+        tick_device_oneshot(delta);
+        tick_stopped[0] = true;
+    }
+
+    // sti only takes effect after hlt starts, so no wake-up can slip in between
+    asm volatile("sti; hlt" ::: "memory");
+
+    if (tick_nohz) {
+        disable_interrupts();
+        tick_update_jiffies();
+        tick_restart();
+        enable_interrupts();
+    }
+}
+
+void tick_restart(void) {
+    // The waking interrupt may switch tasks before tick_idle gets to run again
+    uint32_t cpu = smp_processor_id();
+    if (tick_stopped[cpu]) {
+        tick_stopped[cpu] = false;
+        if (cpu == 0) {
+            tick_device_periodic();
+        } else {
+            tick_start_ap();
+        }
+    }
+}
+
+void tick_wait_until(uint64_t deadline_ns) {
+    while (clocksource_read_ns() < deadline_ns) {
+        if (!tick_initialized) {
+            asm volatile("pause");
+            continue;
+        }
+
+        disable_interrupts();
+        if (clocksource_read_ns() >= deadline_ns) {
+            enable_interrupts();
+            break;
+        }
+        tick_idle(deadline_ns);
+    }
+}
+
+uint32_t tick_lapic_hz(void) {
+    if (lapic_timer_hz == 0) {
+        lapic_timer_hz = lapic_timer_calibrate();
+    }
+    return lapic_timer_hz;
+}
+
+void tick_start_ap(void) {
+    if (lapic_timer_hz >= TICK_HZ) {
+        lapic_timer_periodic(lapic_timer_hz / TICK_HZ);
+    }
+}
+
+bool tick_is_nohz(void) {
+    return tick_nohz;
+}
+
+bool tick_ready(void) {
+    return tick_initialized;
+}
+
+const char* tick_device_name(void) {
+    return tick_use_lapic ? "lapic" : "pit";
+}
+
+uint32_t tick_interrupt_count(void) {
+    return tick_interrupts;
+}
@@ -0,0 +1,63 @@
+#ifndef TICK_H
+#define TICK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Scheduler tick while something is running
+#define TICK_HZ             1000
+#define TICK_PERIOD_NS      1000000ULL
+
+// Longest single idle period, keeps the ns -> counter math inside 64 bits
+#define TICK_MAX_IDLE_NS    1000000000ULL
+
+/**
+ * @brief Picks the tick device (LAPIC timer when present, else the PIT) and
+ *        enables tickless idle when the clocksource is stable enough.
+ * @return 1 on success, 0 on failure.
+ */
+int tick_init(void);
+
+/**
+ * @brief Timer interrupt bookkeeping, called from IRQ0 or the LAPIC timer vector.
+ */
+void tick_handle_interrupt(void);
+
+/**
+ * @brief Halts the CPU until the next interrupt. In tickless mode the periodic
+ *        tick is stopped and a one-shot is programmed for deadline_ns
+ *        (clocksource time, 0 for no deadline). APs always stop their tick
+ *        and rely on reschedule IPIs, with a one second backstop.
+ *        Call with interrupts disabled after checking the wake-up condition;
+ *        returns with interrupts enabled.
+ */
+void tick_idle(uint64_t deadline_ns);
+
+/**
+ * @brief Puts the periodic tick back if an idle one-shot is still armed.
+ *        Called with interrupts off.
+ */
+void tick_restart(void);
+
+/**
+ * @brief Sleeps the CPU until the clocksource reaches deadline_ns.
+ */
+void tick_wait_until(uint64_t deadline_ns);
+
+/**
+ * @brief LAPIC timer rate after the divide by 16, calibrated on first use when
+ *        the tick runs on the PIT. Call on the boot CPU.
+ */
+uint32_t tick_lapic_hz(void);
+
+/**
+ * @brief Starts the periodic 1 ms LAPIC tick on an application processor.
+ */
+void tick_start_ap(void);
+
+bool tick_is_nohz(void);
+bool tick_ready(void);
+const char* tick_device_name(void);
+uint32_t tick_interrupt_count(void);
+
+#endif // TICK_H
@@ -3,6 +3,8 @@
 #include "../terminal/terminal.h"
 #include "../utility/utility.h"
 #include "../io/io.h"
+#include "clocksource.h"
+#include "tick.h"
 
 volatile uint32_t ticks = 0; // Global tick counter
 
@@ -22,22 +24,21 @@ void init_timer() {
 }
 
 void delay(int milliseconds) {
-    uint32_t start_ticks = ticks;
-    uint32_t target_ticks = start_ticks + milliseconds;
-    
-    // Wait until enough ticks have passed
-    while (ticks < target_ticks) {
-        // Yield to other tasks while waiting
-        asm volatile("hlt");
+    if (milliseconds <= 0) {
+        return;
     }
+    
+    precise_delay((uint32_t)milliseconds);
 }
 
-// More accurate delay using timer ticks
+// Blocks the calling task on a wheel timer once the scheduler is up, before
+// that idles until the clocksource deadline
 void precise_delay(uint32_t milliseconds) {
-    uint32_t start = ticks;
-    while ((ticks - start) < milliseconds) {
-        asm volatile("hlt");
+    if (scheduler_ready()) {
+        task_sleep_ms(milliseconds);
+        return;
     }
+    tick_wait_until(clocksource_read_ns() + (uint64_t)milliseconds * 1000000);
 }
 
 // Delay in milliseconds (alias for delay function)
@@ -45,14 +46,12 @@ void delay_ms(uint32_t ms) {
     precise_delay(ms);
 }
 
-// Delay in microseconds (approximate - limited by timer resolution)
+// Delay in microseconds (spins on the clocksource below 1ms)
 void delay_us(uint32_t us) {
     if (us < 1000) {
-        // For microsecond delays less than 1ms, use busy waiting
-        // This is approximate and depends on CPU speed
-        volatile uint32_t count = us * 1000; // Rough calibration needed
-        while (count--) {
-            asm volatile("nop");
+        uint64_t end = clocksource_read_ns() + (uint64_t)us * 1000;
+        while (clocksource_read_ns() < end) {
+            asm volatile("pause");
         }
     } else {
         // For delays >= 1ms, use the millisecond delay
@@ -163,13 +162,13 @@ void delay_us_precise(uint32_t us) {
     }
 }
 
-// Get system time in different formats
+// Get system time in different formats (monotonic, from the clocksource)
 uint64_t get_time_us(void) {
-    return (uint64_t)ticks * 1000; // Convert ms to us
+    return clocksource_read_ns() / 1000;
 }
 
 uint64_t get_time_ns(void) {
-    return (uint64_t)ticks * 1000000; // Convert ms to ns
+    return clocksource_read_ns();
 }
 
 // Sleep functions (aliases for delay functions)
@@ -0,0 +1,221 @@
+#include "timer_wheel.h"
+#include "timer.h"
+#include "../scheduler/task.h"
+
+// Signed difference so comparisons survive the 32-bit tick wrap
+#define time_after_eq(a, b) ((int32_t)((a) - (b)) >= 0)
+
+typedef struct {
+    uint32_t timer_ticks;                // Next tick the wheel will process
+    timer_list_t* tv1[TVR_SIZE];
+    timer_list_t* tv2[TVN_SIZE];
+    timer_list_t* tv3[TVN_SIZE];
+    timer_list_t* tv4[TVN_SIZE];
+    timer_list_t* tv5[TVN_SIZE];
+    bool started;
+} timer_wheel_t;
+
+static timer_wheel_t wheel;
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+
+// Timers only run on the boot CPU; when it sleeps tickless it has to
+// recompute its wake-up for a timer armed elsewhere
+static void timer_wheel_kick(void) {
+    if (smp_processor_id() != 0 && cpus[0].current == cpus[0].idle) {
+        cpu_kick(0);
+    }
+}
+
+static void timer_link(timer_list_t** head, timer_list_t* timer) {
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void timer_unlink(timer_list_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = 0;
+    timer->pprev = 0;
+}
+
+// Pick the slot from how far away the expiry is, no searching involved
+static void internal_add_timer(timer_list_t* timer) {
+    uint32_t expires = timer->expires;
+    uint32_t idx = expires - wheel.timer_ticks;
+    timer_list_t** slot;
+
+    if ((int32_t)idx < 0) {
+        // Already due, run on the next tick processed
+        slot = &wheel.tv1[wheel.timer_ticks & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &wheel.tv1[expires & TVR_MASK];
+    } else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
+        slot = &wheel.tv2[(expires >> TVR_BITS) & TVN_MASK];
+    } else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
+        slot = &wheel.tv3[(expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+    } else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
+        slot = &wheel.tv4[(expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+    } else {
+        slot = &wheel.tv5[(expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK];
+    }
+
+    timer_link(slot, timer);
+}
+
+// Lazily sync the wheel to the clock so the first timer does not replay boot time
+static void timer_wheel_start(void) {
+    if (!wheel.started) {
+        wheel.timer_ticks = ticks;
+        wheel.started = true;
+    }
+}
+
+void setup_timer(timer_list_t* timer, timer_callback_t function, uint32_t data) {
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expires = 0;
+    timer->function = function;
+    timer->data = data;
+}
+
+bool timer_pending(const timer_list_t* timer) {
+    return timer->pprev != 0;
+}
+
+void add_timer(timer_list_t* timer) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    timer_wheel_start();
+    if (!timer_pending(timer)) {
+        internal_add_timer(timer);
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    timer_wheel_kick();
+}
+
+int mod_timer(timer_list_t* timer, uint32_t expires) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    timer_wheel_start();
+
+    int was_pending = timer_pending(timer);
+    if (was_pending) {
+        timer_unlink(timer);
+    }
+
+    timer->expires = expires;
+    internal_add_timer(timer);
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    timer_wheel_kick();
+    return was_pending;
+}
+
+int del_timer(timer_list_t* timer) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+
+    int was_pending = timer_pending(timer);
+    if (was_pending) {
+        timer_unlink(timer);
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return was_pending;
+}
+
+// Re-file every timer of an outer slot one level down
+static uint32_t cascade(timer_list_t** level, uint32_t index) {
+    timer_list_t* timer = level[index];
+    level[index] = 0;
+
+    while (timer) {
+        timer_list_t* next = timer->next;
+        timer->next = 0;
+        timer->pprev = 0;
+        internal_add_timer(timer);
+        timer = next;
+    }
+
+    return index;
+}
+
+#define WHEEL_INDEX(n) ((wheel.timer_ticks >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+void run_timers(void) {
+    if (!wheel.started) {
+        return;
+    }
+
+    spin_lock(&wheel_lock);
+    while (time_after_eq(ticks, wheel.timer_ticks)) {
+        uint32_t index = wheel.timer_ticks & TVR_MASK;
+
+        // Inner wheel wrapped: pull the next batch down from the outer levels
+        if (!index &&
+            !cascade(wheel.tv2, WHEEL_INDEX(0)) &&
+            !cascade(wheel.tv3, WHEEL_INDEX(1)) &&
+            !cascade(wheel.tv4, WHEEL_INDEX(2))) {
+            cascade(wheel.tv5, WHEEL_INDEX(3));
+        }
+
+        wheel.timer_ticks++;
+
+        while (wheel.tv1[index]) {
+            timer_list_t* timer = wheel.tv1[index];
+            timer_callback_t function = timer->function;
+            uint32_t data = timer->data;
+            timer_unlink(timer);
+
+            // Dropped around the callback so it can rearm timers; the timer
+            // itself may be gone once del_timer sees it unlinked
+            if (function) {
+                spin_unlock(&wheel_lock);
+                function(data);
+                spin_lock(&wheel_lock);
+            }
+        }
+    }
+    spin_unlock(&wheel_lock);
+}
+
+static bool slot_min_expiry(timer_list_t* timer, uint32_t* best, bool found) {
+    for (; timer; timer = timer->next) {
+        if (!found || (int32_t)(timer->expires - *best) < 0) {
+            *best = timer->expires;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool timer_wheel_next_expiry(uint32_t* expires) {
+    if (!wheel.started) {
+        return false;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    bool found = false;
+
+    // The inner wheel is in tick order, the first non-empty slot wins
+    uint32_t index = wheel.timer_ticks & TVR_MASK;
+    for (int i = 0; i < TVR_SIZE && !found; i++) {
+        found = slot_min_expiry(wheel.tv1[(index + i) & TVR_MASK], expires, false);
+    }
+
+    // Outer levels are only consulted when nothing is due within 256 ticks
+    if (!found) {
+        timer_list_t** levels[4] = { wheel.tv2, wheel.tv3, wheel.tv4, wheel.tv5 };
+        for (int level = 0; level < 4; level++) {
+            for (int i = 0; i < TVN_SIZE; i++) {
+                found = slot_min_expiry(levels[level][i], expires, found);
+            }
+        }
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return found;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wheel geometry: 256 one-tick slots, then four 64-slot levels each 64x coarser
+#define TVR_BITS  8
+#define TVN_BITS  6
+#define TVR_SIZE  (1 << TVR_BITS)
+#define TVN_SIZE  (1 << TVN_BITS)
+#define TVR_MASK  (TVR_SIZE - 1)
+#define TVN_MASK  (TVN_SIZE - 1)
+
+typedef void (*timer_callback_t)(uint32_t data);
+
+typedef struct timer_list {
+    struct timer_list* next;
+    struct timer_list** pprev;   // Slot head or previous timer's next, NULL when idle
+    uint32_t expires;            // Absolute time in ticks (ms)
+    timer_callback_t function;   // Runs in interrupt context with interrupts off
+    uint32_t data;
+} timer_list_t;
+
+/**
+ * @brief Prepares a timer for use, must be called before add/mod/del.
+ */
+void setup_timer(timer_list_t* timer, timer_callback_t function, uint32_t data);
+
+/**
+ * @brief Arms an idle timer for timer->expires. O(1).
+ */
+void add_timer(timer_list_t* timer);
+
+/**
+ * @brief (Re)arms a timer for a new expiry, whether pending or not.
+ * @return 1 if the timer was pending before, 0 otherwise.
+ */
+int mod_timer(timer_list_t* timer, uint32_t expires);
+
+/**
+ * @brief Cancels a pending timer.
+ * @return 1 if the timer was pending, 0 otherwise.
+ */
+int del_timer(timer_list_t* timer);
+
+bool timer_pending(const timer_list_t* timer);
+
+/**
+ * @brief Expires every timer due up to the current tick, cascading the outer
+ *        levels as the inner wheel wraps. Called from the timer interrupt.
+ */
+void run_timers(void);
+
+/**
+ * @brief Earliest pending expiry in ticks, used by tickless idle.
+ * @return false when no timer is pending.
+ */
+bool timer_wheel_next_expiry(uint32_t* expires);
+
+#endif // TIMER_WHEEL_H
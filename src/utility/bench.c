@@ -0,0 +1,24 @@
+#include "bench.h"
+#include "../cpu/cpu.h"
+
+uint32_t bench_best_cycles(int runs, void (*reset)(void*), int (*run)(void*), void* arg) {
+    uint64_t best = 0;
+    
+    for (int i = 0; i < runs; i++) {
+        if (reset) {
+            reset(arg);
+        }
+        
+        uint64_t start = get_cpu_timestamp();
+        int result = run(arg);
+        uint64_t cycles = get_cpu_timestamp() - start;
+        
+        if (result != 0) {
+            return 0;
+        }
+        if (i == 0 || cycles < best) {
+            best = cycles;
+        }
+    }
+    return best > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) best;
+}
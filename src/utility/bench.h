@@ -0,0 +1,14 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/**
+ * @brief Times run(arg) runs times and keeps the fastest. reset(arg), which
+ *        may be NULL, puts the state back before each run and is not timed.
+ * @param run Returns 0 on success.
+ * @return Best run in TSC cycles, clamped to 32 bits, 0 if any run fails.
+ */
+uint32_t bench_best_cycles(int runs, void (*reset)(void*), int (*run)(void*), void* arg);
+
+#endif // BENCH_H
@@ -0,0 +1,90 @@
+#include "jit_emit.h"
+#include "utility.h"
+#include "../memory/memory.h"
+
+void jit_byte(jit_emit_t* emit, uint8_t value) {
+    emit->code[emit->pos++] = value;
+}
+
+void jit_word(jit_emit_t* emit, uint32_t value) {
+    memcpy(&emit->code[emit->pos], &value, 4);
+    emit->pos += 4;
+}
+
+uint32_t jit_address(jit_emit_t* emit, uint32_t offset) {
+    return (uint32_t) emit->code + offset;
+}
+
+void jit_rel32(jit_emit_t* emit, uint32_t target) {
+    jit_word(emit, target - (emit->pos + 4));
+}
+
+uint32_t jit_short(jit_emit_t* emit, uint8_t opcode) {
+    jit_byte(emit, opcode);
+    jit_byte(emit, 0);
+    return emit->pos - 1;
+}
+
+void jit_land(jit_emit_t* emit, uint32_t rel8) {
+    emit->code[rel8] = (uint8_t) (emit->pos - rel8 - 1);
+}
+
+void jit_fixup(jit_emit_t* emit, uint32_t index, uint32_t target) {
+    emit->fixups[index] = emit->pos;
+    jit_word(emit, target);
+}
+
+void jit_mark(jit_emit_t* emit, uint32_t index) {
+    emit->map[index] = jit_address(emit, emit->pos);
+    emit->fixups[index] = 0;
+}
+
+void jit_patch(jit_emit_t* emit, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t at = emit->fixups[i];
+        if (!at) continue;
+
+        // The operand holds the target operation until now
+        uint32_t target;
+        memcpy(&target, &emit->code[at], 4);
+        uint32_t rel = emit->map[target] - jit_address(emit, at + 4);
+        memcpy(&emit->code[at], &rel, 4);
+    }
+}
+
+// A buffer of at least needed pages, keeping the old one when it is big enough
+static void* jit_reserve(void* buffer, uint32_t* pages, uint32_t needed) {
+    if (buffer && needed <= *pages) {
+        return buffer;
+    }
+    if (buffer) {
+        free_contiguous_pages((uint32_t) buffer, *pages);
+    }
+    *pages = 0;
+    buffer = (void*) allocate_contiguous_pages(needed);
+    if (buffer) {
+        *pages = needed;
+    }
+    return buffer;
+}
+
+bool jit_prepare(jit_emit_t* emit, uint8_t** code, uint32_t* code_pages,
+                 uint32_t** map, uint32_t* map_pages,
+                 uint32_t count, uint32_t header, uint32_t max_bytes) {
+    uint32_t code_bytes = header + count * max_bytes;
+
+    // Native addresses first, then the pending rel32 of every operation
+    uint32_t map_bytes = count * 2 * sizeof(uint32_t);
+
+    *code = jit_reserve(*code, code_pages, (code_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    *map = jit_reserve(*map, map_pages, (map_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!*code || !*map) {
+        return false;
+    }
+
+    emit->code = *code;
+    emit->pos = 0;
+    emit->map = *map;
+    emit->fixups = *map + count;
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef JIT_EMIT_H
+#define JIT_EMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Code buffer shared by the template JITs (MPOP and Brainfuck). Each JIT
+// keeps one of these next to its own state and places one template per
+// operation; rel32 jumps between operations are recorded in fixups and
+// resolved by jit_patch once every operation has an address.
+typedef struct {
+    uint8_t* code;
+    uint32_t pos;
+    uint32_t* map;              // Native address of each operation
+    uint32_t* fixups;           // rel32 offset per operation, 0 for none
+} jit_emit_t;
+
+void jit_byte(jit_emit_t* emit, uint8_t value);
+void jit_word(jit_emit_t* emit, uint32_t value);
+
+/**
+ * @brief Absolute address of an offset in the code buffer.
+ */
+uint32_t jit_address(jit_emit_t* emit, uint32_t offset);
+
+/**
+ * @brief rel32 to an offset already placed in the buffer.
+ */
+void jit_rel32(jit_emit_t* emit, uint32_t target);
+
+/**
+ * @brief Emits a short jump whose target is set later by jit_land.
+ * @return Offset of the rel8 byte.
+ */
+uint32_t jit_short(jit_emit_t* emit, uint8_t opcode);
+void jit_land(jit_emit_t* emit, uint32_t rel8);
+
+/**
+ * @brief Emits a rel32 to operation target, patched by jit_patch. One
+ *        pending jump per operation.
+ */
+void jit_fixup(jit_emit_t* emit, uint32_t index, uint32_t target);
+
+/**
+ * @brief Records the current position as the start of operation index.
+ */
+void jit_mark(jit_emit_t* emit, uint32_t index);
+
+/**
+ * @brief Resolves the jumps left by jit_fixup for operations below count.
+ */
+void jit_patch(jit_emit_t* emit, uint32_t count);
+
+/**
+ * @brief Sets up code and map buffers for count operations of at most
+ *        max_bytes each after a header, reusing the pages of a previous
+ *        compile when they are big enough.
+ * @return false when the pages could not be allocated.
+ */
+bool jit_prepare(jit_emit_t* emit, uint8_t** code, uint32_t* code_pages,
+                 uint32_t** map, uint32_t* map_pages,
+                 uint32_t count, uint32_t header, uint32_t max_bytes);
+
+#endif // JIT_EMIT_H
@@ -1,4 +1,6 @@
 #include "utility.h"
+#include "../io/io.h"
+#include "../scheduler/workqueue.h"
 #define MEMORY_POOL_SIZE 1024
 static char memory_pool[MEMORY_POOL_SIZE];
 static size_t allocated_size = 0;
@@ -379,6 +381,32 @@ void* memcpy(void* dest, const void* src, size_t n) {
     return dest;
 }
 
+// Overlap safe copy. Aligned buffers go a dword at a time, which matters for
+// device memory such as the VGA text buffer where every access is a bus cycle
+void* memmove(void* dest, const void* src, size_t n) {
+    char* d = (char*)dest; const char* s = (const char*)src;
+    if (d == s || n == 0) return dest;
+
+    bool aligned = (((uint32_t) d | (uint32_t) s | n) & 3) == 0;
+    if (d < s) {
+        if (aligned) {
+            uint32_t* dw = (uint32_t*) d; const uint32_t* sw = (const uint32_t*) s;
+            for (size_t i = 0; i < n / 4; i++) dw[i] = sw[i];
+        } else {
+            for (size_t i = 0; i < n; i++) d[i] = s[i];
+        }
+    } else {
+        // Back to front so the source is read before it is overwritten
+        if (aligned) {
+            uint32_t* dw = (uint32_t*) d; const uint32_t* sw = (const uint32_t*) s;
+            for (size_t i = n / 4; i > 0; i--) dw[i - 1] = sw[i - 1];
+        } else {
+            for (size_t i = n; i > 0; i--) d[i - 1] = s[i - 1];
+        }
+    }
+    return dest;
+}
+
 char* strdup(const char* s) {
     if (!s) return NULL;
     size_t len = strlen(s);
@@ -676,8 +704,74 @@ size_t sizeof_struct_with_padding(size_t* member_sizes, size_t member_count) {
 }
 
 
+// ----- Kernel log -----
+
+// Log lines are mirrored to COM1 from the events worker, the UART is too slow
+// to wait on from drivers and interrupt handlers
+#define KLOG_SIZE      4096
+#define KLOG_COM1      0x3F8
+#define KLOG_COM1_LSR  (KLOG_COM1 + 5)
+
+static char klog_buffer[KLOG_SIZE];
+static volatile uint32_t klog_head = 0;   // Next byte to write
+static volatile uint32_t klog_tail = 0;   // Next byte to flush
+static spinlock_t klog_lock = SPINLOCK_INIT;
+
+static void klog_flush_work(work_t* work);
+static work_t klog_work = WORK_INITIALIZER(klog_flush_work);
+
+static void klog_append(const char* text) {
+    for (; *text; text++) {
+        // Full: the oldest unflushed output gives way
+        if (klog_head - klog_tail >= KLOG_SIZE) {
+            klog_tail++;
+        }
+        klog_buffer[klog_head++ % KLOG_SIZE] = *text;
+    }
+}
+
+static void klog(const char* tag, const char* message, const char* file) {
+    uint32_t flags = spin_lock_irqsave(&klog_lock);
+    klog_append("[");
+    klog_append(tag);
+    if (file) {
+        klog_append(":");
+        klog_append(file);
+    }
+    klog_append("] ");
+    klog_append(message);
+    klog_append("\n");
+    spin_unlock_irqrestore(&klog_lock, flags);
+    
+    // Before the worker exists lines just collect, the first flush sends them
+    schedule_work(&klog_work);
+}
+
+void klog_flush(void) {
+    // Byte at a time so writers on other CPUs are not held up by the UART
+    while (true) {
+        uint32_t flags = spin_lock_irqsave(&klog_lock);
+        if (klog_tail == klog_head) {
+            spin_unlock_irqrestore(&klog_lock, flags);
+            return;
+        }
+        char c = klog_buffer[klog_tail % KLOG_SIZE];
+        klog_tail++;
+        spin_unlock_irqrestore(&klog_lock, flags);
+
+        while (!(inb(KLOG_COM1_LSR) & 0x20));
+        outb(KLOG_COM1, c);
+    }
+}
+
+static void klog_flush_work(work_t* work) {
+    (void)work;
+    klog_flush();
+}
+
 void warn(const char* message, const char* file) {
     if (!message) return;
+    klog("WARN", message, file);
     
     // Set color to yellow/brown for warning messages
     terminal_setcolor(VGA_COLOR_BROWN);
@@ -704,6 +798,7 @@ void warn(const char* message, const char* file) {
  */
 void done(const char* message, const char* file) {
     if (!message) return;
+    klog("DONE", message, file);
     
     // Set color to green for success messages
     terminal_setcolor(VGA_COLOR_GREEN);
@@ -725,6 +820,7 @@ void done(const char* message, const char* file) {
 
 void info(const char* message, const char* file) {
     if (!message) return;
+    klog("INFO", message, file);
     
     // Set color to cyan for info messages
     terminal_setcolor(VGA_COLOR_CYAN);
@@ -746,6 +842,7 @@ void info(const char* message, const char* file) {
 
 void error(const char* message, const char* file) {
     if (!message) return;
+    klog("ERROR", message, file);
     
     // Set color to red for error messages
     terminal_setcolor(VGA_COLOR_RED);
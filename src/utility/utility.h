@@ -96,6 +96,7 @@ void done(const char* message, const char* file);
 void warn(const char* message, const char* file);
 void info(const char* message, const char* file);
 void error(const char* message, const char* file);
+void klog_flush(void);
 void* calloc(size_t nmemb, size_t size);
 void debug_memory_status();
 int abs(int x);